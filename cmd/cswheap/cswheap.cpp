@@ -0,0 +1,180 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "common/error.h"
+#include "common/file.h"
+#include "flag/flag.h"
+#include "memory/heapsnapshot.h"
+
+using codeswitch::DominatorTree;
+using codeswitch::HeapSnapshot;
+using codeswitch::kNoBlock;
+
+namespace {
+
+/** Blocks of one size, and the blocks among them that retain the most. */
+struct SizeClass {
+  uintptr_t blockSize = 0;
+  uintptr_t count = 0;
+  uintptr_t shallowBytes = 0;
+
+  /**
+   * Bytes retained by blocks in this class, not counting blocks dominated
+   * by another block in the same class, so nothing is counted twice.
+   */
+  uintptr_t retainedBytes = 0;
+
+  /** Outermost blocks in this class, by retained size. */
+  std::vector<uint32_t> retainers;
+};
+
+void printRoots(std::ostream& os, const HeapSnapshot& snapshot, const DominatorTree& tree) {
+  // Blocks dominated only by the roots are attributed to the first source
+  // that refers to them.
+  std::vector<uintptr_t> counts(snapshot.rootSources.size()), retained(snapshot.rootSources.size());
+  std::vector<uint8_t> seen(snapshot.blockCount());
+  for (auto& root : snapshot.roots) {
+    counts[root.source]++;
+    if (!seen[root.block] && tree.idom[root.block] == snapshot.blockCount()) {
+      seen[root.block] = 1;
+      retained[root.source] += tree.retainedSize[root.block];
+    }
+  }
+  os << "roots:\n";
+  for (size_t i = 0; i < snapshot.rootSources.size(); i++) {
+    auto name = snapshot.rootSources[i].empty() ? "(unnamed)" : snapshot.rootSources[i];
+    os << "  " << name << ": " << counts[i] << " roots retaining " << retained[i] << " bytes\n";
+  }
+}
+
+std::vector<SizeClass> sizeClasses(const HeapSnapshot& snapshot, const DominatorTree& tree, size_t top) {
+  std::map<uintptr_t, size_t> classIndex;
+  std::vector<SizeClass> classes;
+  std::vector<size_t> blockClass(snapshot.blockCount());
+  for (uint32_t i = 0; i < snapshot.blockCount(); i++) {
+    auto it = classIndex.find(snapshot.sizes[i]);
+    if (it == classIndex.end()) {
+      it = classIndex.emplace(snapshot.sizes[i], classes.size()).first;
+      classes.emplace_back();
+      classes.back().blockSize = snapshot.sizes[i];
+    }
+    blockClass[i] = it->second;
+  }
+
+  // Walk the dominator tree, counting how many blocks of each class are on
+  // the path from the roots. A block is outermost in its class if none are.
+  auto n = snapshot.blockCount();
+  std::vector<size_t> childBegin(n + 2);
+  for (size_t i = 0; i < n; i++) {
+    if (tree.idom[i] != kNoBlock) {
+      childBegin[tree.idom[i] + 1]++;
+    }
+  }
+  for (size_t i = 1; i < childBegin.size(); i++) {
+    childBegin[i] += childBegin[i - 1];
+  }
+  std::vector<uint32_t> children(childBegin.back());
+  auto fill = childBegin;
+  for (uint32_t i = 0; i < n; i++) {
+    if (tree.idom[i] != kNoBlock) {
+      children[fill[tree.idom[i]]++] = i;
+    }
+  }
+  std::vector<uintptr_t> onPath(classes.size());
+  std::vector<std::pair<uint32_t, size_t>> stack;
+  stack.emplace_back(static_cast<uint32_t>(n), childBegin[n]);
+  while (!stack.empty()) {
+    auto& frame = stack.back();
+    if (frame.second == childBegin[frame.first + 1]) {
+      if (frame.first != n) {
+        onPath[blockClass[frame.first]]--;
+      }
+      stack.pop_back();
+      continue;
+    }
+    auto v = children[frame.second++];
+    auto& c = classes[blockClass[v]];
+    c.count++;
+    c.shallowBytes += snapshot.sizes[v];
+    if (onPath[blockClass[v]] == 0) {
+      c.retainedBytes += tree.retainedSize[v];
+      c.retainers.push_back(v);
+    }
+    onPath[blockClass[v]]++;
+    stack.emplace_back(v, childBegin[v]);
+  }
+
+  for (auto& c : classes) {
+    auto k = std::min(top, c.retainers.size());
+    std::partial_sort(c.retainers.begin(), c.retainers.begin() + k, c.retainers.end(),
+                      [&tree](uint32_t a, uint32_t b) { return tree.retainedSize[a] > tree.retainedSize[b]; });
+    c.retainers.resize(k);
+  }
+  std::sort(classes.begin(), classes.end(),
+            [](const SizeClass& a, const SizeClass& b) { return a.retainedBytes > b.retainedBytes; });
+  return classes;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  try {
+    codeswitch::FlagSet flags(argv[0], "snapshot");
+    size_t top = 5;
+    flags.varFlag(
+        "top",
+        [&top](const std::string& value) {
+          try {
+            top = std::stoul(value);
+          } catch (const std::exception&) {
+            throw codeswitch::errorstr("invalid number: ", value);
+          }
+        },
+        "number of retainers to list in each size class (default: 5)", codeswitch::FlagSet::Opt::OPTIONAL,
+        codeswitch::FlagSet::HasValue::EXPLICIT_VALUE);
+    auto argStart = flags.parse(argc - 1, argv + 1);
+    if (argStart != static_cast<size_t>(argc - 2)) {
+      throw codeswitch::errorstr("expected 1 positional argument; got ", argc - 1 - argStart);
+    }
+    std::string inPath(argv[argc - 1]);
+
+    std::ifstream inFile(inPath, std::ios::binary);
+    if (!inFile.good()) {
+      throw codeswitch::FileError(inPath, "could not read file");
+    }
+    auto snapshot = codeswitch::readHeapSnapshot(inFile);
+    auto tree = codeswitch::computeDominators(snapshot);
+
+    uintptr_t totalBytes = 0;
+    for (auto size : snapshot.sizes) {
+      totalBytes += size;
+    }
+    auto& os = std::cout;
+    os << "blocks: " << snapshot.blockCount() << " (" << totalBytes << " bytes), edges: " << snapshot.edges.size()
+       << ", roots: " << snapshot.roots.size() << ", dangling: " << snapshot.danglingCount << "\n";
+    os << "reachable: " << tree.reachableCount << " blocks (" << tree.reachableBytes << " bytes)\n";
+    printRoots(os, snapshot, tree);
+
+    os << "top retainers by size class:\n";
+    for (auto& c : sizeClasses(snapshot, tree, top)) {
+      os << "  size " << c.blockSize << ": " << c.count << " blocks, " << c.shallowBytes << " bytes shallow, "
+         << c.retainedBytes << " bytes retained\n";
+      for (auto v : c.retainers) {
+        os << "    0x" << std::hex << snapshot.addresses[v] << std::dec << " retains " << tree.retainedSize[v]
+           << " bytes\n";
+      }
+    }
+  } catch (const std::exception& ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+}
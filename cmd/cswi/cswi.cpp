@@ -4,28 +4,123 @@
 // the 3-clause BSD license that can be found in the LICENSE.txt file.
 
 #include <exception>
+#include <fstream>
 #include <iostream>
+#include <string>
 #include "common/error.h"
 #include "flag/flag.h"
 #include "interpreter/interpreter.h"
 #include "memory/handle.h"
+#include "memory/heap.h"
 #include "package/package.h"
 
 int main(int argc, char* argv[]) {
   try {
-    codeswitch::FlagSet flags(argv[0], "in.cswp");
+    codeswitch::FlagSet flags(argv[0], "in.cswp|in.cswimg");
     bool validate;
     flags.boolFlag(&validate, "v", false, "validate all packages before interpreting anything");
+    bool hugePages;
+    flags.boolFlag(&hugePages, "hugepages", false, "map heap chunks in groups backed by huge pages if available");
+    uintptr_t heapWarmMB = 0;
+    flags.varFlag(
+        "heapwarm",
+        [&heapWarmMB](const std::string& value) {
+          try {
+            heapWarmMB = std::stoul(value);
+          } catch (const std::exception&) {
+            throw codeswitch::errorstr("invalid size in MiB: ", value);
+          }
+        },
+        "size in MiB of the heap region to fault in before interpreting anything", codeswitch::FlagSet::Opt::OPTIONAL,
+        codeswitch::FlagSet::HasValue::EXPLICIT_VALUE);
+    int gcPercent = codeswitch::kDefaultGCPercent;
+    flags.varFlag(
+        "gcpercent",
+        [&gcPercent](const std::string& value) {
+          if (value == "off") {
+            gcPercent = -1;
+            return;
+          }
+          try {
+            gcPercent = std::stoi(value);
+          } catch (const std::exception&) {
+            throw codeswitch::errorstr("invalid percentage: ", value);
+          }
+        },
+        "percentage the heap may grow over live data before a full collection, or 'off'",
+        codeswitch::FlagSet::Opt::OPTIONAL, codeswitch::FlagSet::HasValue::EXPLICIT_VALUE);
+    auto memoryLimit = codeswitch::heap->memoryLimit();
+    flags.varFlag(
+        "memlimit",
+        [&memoryLimit](const std::string& value) {
+          try {
+            memoryLimit = std::stoul(value) * codeswitch::MB;
+          } catch (const std::exception&) {
+            throw codeswitch::errorstr("invalid size in MiB: ", value);
+          }
+        },
+        "soft memory limit in MiB that makes collection more frequent as it's approached, or 0 for none "
+        "(default: derived from the cgroup memory limit)",
+        codeswitch::FlagSet::Opt::OPTIONAL, codeswitch::FlagSet::HasValue::EXPLICIT_VALUE);
+    bool lazyZero;
+    flags.boolFlag(&lazyZero, "lazyzero", false, "zero freed blocks when they're allocated instead of when they're swept");
+    bool gcStats;
+    flags.boolFlag(&gcStats, "gcstats", false, "print garbage collection statistics after interpreting");
+    std::string gcLogPath;
+    flags.stringFlag(&gcLogPath, "gclog", "", "file to write statistics about each garbage collection to, as JSON lines");
+    std::string memProfilePath;
+    flags.stringFlag(&memProfilePath, "memprofile", "", "file to write a sampled allocation profile to after interpreting");
+    auto memProfileRate = codeswitch::kDefaultAllocationSampleInterval;
+    flags.varFlag(
+        "memprofilerate",
+        [&memProfileRate](const std::string& value) {
+          try {
+            memProfileRate = std::stoul(value);
+          } catch (const std::exception&) {
+            throw codeswitch::errorstr("invalid number of bytes: ", value);
+          }
+        },
+        "average number of bytes allocated between allocation profile samples, or 0 for none",
+        codeswitch::FlagSet::Opt::OPTIONAL, codeswitch::FlagSet::HasValue::EXPLICIT_VALUE);
+    std::string writeImagePath;
+    flags.stringFlag(&writeImagePath, "writeimage", "",
+                     "file to write a heap image of the loaded package to instead of interpreting it; the image "
+                     "may be interpreted in place of the package and starts faster");
+    std::string heapSnapshotPath;
+    flags.stringFlag(&heapSnapshotPath, "heapsnapshot", "",
+                     "file to write a heap snapshot to after interpreting, for analysis with cswheap");
     auto argStart = flags.parse(argc - 1, argv + 1);
+    codeswitch::heap->chunkCache()->setHugePages(hugePages);
+    codeswitch::heap->chunkCache()->prefault(heapWarmMB * codeswitch::MB);
+    codeswitch::heap->setGCPercent(gcPercent);
+    codeswitch::heap->setMemoryLimit(memoryLimit);
+    codeswitch::heap->setLazyZeroing(lazyZero);
+    codeswitch::heap->setAllocationSampleInterval(memProfileRate);
+    std::ofstream gcLog;
+    if (!gcLogPath.empty()) {
+      gcLog.open(gcLogPath);
+      if (!gcLog) {
+        throw codeswitch::errorstr(gcLogPath, ": could not open GC log");
+      }
+      codeswitch::heap->setGCEventListener([&gcLog](const codeswitch::GCCycleStats& cycle) {
+        codeswitch::writeJSONLine(gcLog, cycle);
+        gcLog.flush();
+      });
+    }
     if (argStart != static_cast<size_t>(argc - 2)) {
       throw codeswitch::errorstr("expected 1 positional argument; got ", argc - 1 - argStart);
     }
     std::string inPath(argv[argc - 1]);
 
-    auto package = codeswitch::Package::readFromFile(inPath);
+    auto package = codeswitch::Package::isImageFile(inPath) ? codeswitch::Package::readFromImage(inPath)
+                                                             : codeswitch::Package::readFromFile(inPath);
     if (validate) {
       package->validate();
     }
+    if (!writeImagePath.empty()) {
+      package->writeImage(writeImagePath);
+      return 0;
+    }
     auto entryName = codeswitch::String::create("main");
     auto entryFn = handle(package->functionByName(**entryName));
     if (!entryFn) {
@@ -33,6 +128,26 @@ int main(int argc, char* argv[]) {
     }
 
     codeswitch::interpret(package, entryFn);
+    codeswitch::heap->setGCEventListener(nullptr);
+    if (gcStats) {
+      codeswitch::printSummary(std::cerr, codeswitch::heap->gcStats());
+    }
+    if (!heapSnapshotPath.empty()) {
+      std::ofstream heapSnapshot(heapSnapshotPath, std::ios::binary);
+      codeswitch::heap->writeSnapshot(heapSnapshot);
+      if (!heapSnapshot) {
+        throw codeswitch::errorstr(heapSnapshotPath, ": could not write heap snapshot");
+      }
+    }
+    if (!memProfilePath.empty()) {
+      // In-use counts are as of the last collection, so collect first.
+      codeswitch::heap->collectGarbage();
+      std::ofstream memProfile(memProfilePath);
+      codeswitch::writeHeapProfile(memProfile, codeswitch::heap->allocationProfile());
+      if (!memProfile) {
+        throw codeswitch::errorstr(memProfilePath, ": could not write allocation profile");
+      }
+    }
   } catch (const std::exception& ex) {
     std::cerr << ex.what() << std::endl;
     return 1;
@@ -11,6 +11,7 @@
 
 #include "common/common.h"
 #include "memory/heap.h"
+#include "memory/layout.h"
 #include "memory/ptr.h"
 
 namespace codeswitch {
@@ -40,7 +41,7 @@ class Array {
 
 template <class T>
 Array<T>* Array<T>::make(size_t length) {
-  return new (heap->allocate(length * sizeof(T))) Array<T>;
+  return new (heap->allocate(length * sizeof(T), layoutOf<T>())) Array<T>;
 }
 
 template <class T>
@@ -72,6 +73,8 @@ class BoundArray {
   void slice(size_t i, size_t j);
   void set(Array<T>* array, size_t length);
 
+  static uintptr_t pointerMask() { return memberPointerMask(&BoundArray::array_); }
+
  private:
   Ptr<Array<T>> array_;
   size_t length_ = 0;
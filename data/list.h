@@ -48,6 +48,8 @@ class List {
   const T* end() const { return const_cast<List<T>*>(this)->end(); }
   T* end() { return data_.begin() + length_; }
 
+  static uintptr_t pointerMask() { return memberPointerMask(&List::data_); }
+
  private:
   List(BoundArray<T>* array, size_t length);
   void reserveMore(size_t more);
@@ -65,7 +67,7 @@ List<T>::List(BoundArray<T>* data, size_t cap) : data_(data), length_(length) {
 
 template <class T>
 List<T>* List<T>::make() {
-  return new (heap->allocate(sizeof(List))) List();
+  return new (heap->allocate(sizeof(List), layoutOf<List>())) List();
 }
 
 template <class T>
@@ -8,6 +8,7 @@
 
 #include "array.h"
 #include "common/common.h"
+#include "memory/layout.h"
 #include "memory/ptr.h"
 
 namespace codeswitch {
@@ -31,6 +32,8 @@ class Map {
   V& get(const K& key);
   void set(const K& key, const V& value);
 
+  static uintptr_t pointerMask() { return memberPointerMask(&Map::data_); }
+
  protected:
   static const uintptr_t kMinCap = 16;
   static const uintptr_t kUnused = 0;
@@ -38,6 +41,8 @@ class Map {
     uintptr_t hash;  // in use if non-zero
     K key;
     V value;
+
+    static uintptr_t pointerMask() { return memberPointerMask(&Entry::key) | memberPointerMask(&Entry::value); }
   };
 
   uintptr_t mask() const { return cap_ - 1; }
@@ -54,7 +59,7 @@ class Map {
 
 template <class K, class V, class H>
 Map<K, V, H>* Map<K, V, H>::make() {
-  return new (heap->allocate(sizeof(Map<K, V, H>))) Map<K, V, H>;
+  return new (heap->allocate(sizeof(Map<K, V, H>), layoutOf<Map<K, V, H>>())) Map<K, V, H>;
 }
 
 template <class K, class V, class H>
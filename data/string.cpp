@@ -16,15 +16,15 @@
 namespace codeswitch {
 
 String* String::make() {
-  return new (heap->allocate(sizeof(String))) String();
+  return new (heap->allocate(sizeof(String), layoutOf<String>())) String();
 }
 
 String* String::make(BoundArray<const uint8_t>& data) {
-  return new (heap->allocate(sizeof(String))) String(data);
+  return new (heap->allocate(sizeof(String), layoutOf<String>())) String(data);
 }
 
 String* String::make(Array<const uint8_t>* array, size_t length) {
-  return new (heap->allocate(sizeof(String))) String(array, length);
+  return new (heap->allocate(sizeof(String), layoutOf<String>())) String(array, length);
 }
 
 Handle<String> String::create(const char* s) {
@@ -58,6 +58,8 @@ class String {
   bool operator>(const String& s) const { return compare(s) > 0; }
   bool operator>=(const String& s) const { return compare(s) >= 0; }
 
+  static uintptr_t pointerMask() { return memberPointerMask(&String::data_); }
+
  private:
   friend std::ostream& operator<<(std::ostream&, const String&);
 
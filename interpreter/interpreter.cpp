@@ -30,12 +30,27 @@ void interpret(Handle<Package>& package, Handle<Function>& entry, std::ostream&
   auto fp = reinterpret_cast<Frame*>(s.fp) - 1;
   auto sp = reinterpret_cast<uintptr_t*>(fp);
 
+  // Publish the stack so the heap can attribute sampled allocations to the
+  // function being interpreted.
+  struct CurrentStackScope {
+    explicit CurrentStackScope(Stack* s) : saved(currentStack) { currentStack = s; }
+    ~CurrentStackScope() { currentStack = saved; }
+    Stack* saved;
+  } currentStackScope(&s);
+
+#define SAVE_REGS()                                                                                   \
+  do {                                                                                                \
+    s.sp = reinterpret_cast<uintptr_t>(sp);                                                           \
+    s.fp = reinterpret_cast<uintptr_t>(fp);                                                           \
+    s.fn = fn;                                                                                        \
+    s.ipOffset = reinterpret_cast<uintptr_t>(ip) - reinterpret_cast<uintptr_t>(fn->insts.begin()); \
+  } while (false)
+
 #define CHECK_STACK(fn)                                       \
   do {                                                        \
     auto size = fn->safepoints.frameSize() * kWordSize;       \
     if (reinterpret_cast<uintptr_t>(sp) - size < s.limit()) { \
-      s.sp = reinterpret_cast<uintptr_t>(sp);                 \
-      s.fp = reinterpret_cast<uintptr_t>(fp);                 \
+      SAVE_REGS();                                            \
       s.check(size);                                          \
     }                                                         \
   } while (false)
@@ -234,6 +249,7 @@ void interpret(Handle<Package>& package, Handle<Function>& entry, std::ostream&
         break;
 
       case Op::SYS: {
+        SAVE_REGS();
         auto sys = *reinterpret_cast<const Sys*>(ip + 1);
         switch (sys) {
           case Sys::EXIT: {
@@ -271,6 +287,7 @@ void interpret(Handle<Package>& package, Handle<Function>& entry, std::ostream&
 #undef POP
 #undef PUSH
 #undef CHECK_STACK
+#undef SAVE_REGS
 }
 
 size_t typesSize(const List<Ptr<Type>>& types) {
@@ -0,0 +1,124 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include "allocprofile.h"
+
+#include <execinfo.h>
+#include <cmath>
+#include <tuple>
+#include "platform/platform.h"
+#include "stack.h"
+
+namespace codeswitch {
+
+std::string (*functionNameForProfile)(Function* fn);
+
+bool AllocationSite::operator<(const AllocationSite& other) const {
+  return std::tie(frames, function, offset) < std::tie(other.frames, other.function, other.offset);
+}
+
+void writeHeapProfile(std::ostream& os, const AllocationProfile& profile) {
+  AllocationRecord total;
+  for (auto& r : profile.records) {
+    total.allocObjects += r.allocObjects;
+    total.allocBytes += r.allocBytes;
+    total.inuseObjects += r.inuseObjects;
+    total.inuseBytes += r.inuseBytes;
+  }
+  auto flags = os.flags();
+  os << std::dec << "heap profile: " << total.inuseObjects << ": " << total.inuseBytes << " [" << total.allocObjects
+     << ": " << total.allocBytes << "] @ heap_v2/" << profile.sampleInterval << "\n";
+  for (auto& r : profile.records) {
+    if (!r.site.function.empty()) {
+      os << "# " << r.site.function << "+" << r.site.offset << "\n";
+    }
+    os << std::dec << r.inuseObjects << ": " << r.inuseBytes << " [" << r.allocObjects << ": " << r.allocBytes
+       << "] @";
+    for (auto pc : r.site.frames) {
+      os << " 0x" << std::hex << pc;
+    }
+    os << "\n";
+  }
+  os.flags(flags);
+  os << "\nMAPPED_LIBRARIES:\n" << memoryMappings();
+}
+
+AllocationSampler::AllocationSampler() {
+  bytesUntilSample_ = nextInterval();
+}
+
+void AllocationSampler::setInterval(uintptr_t interval) {
+  interval_ = interval;
+  recordIndex_.clear();
+  records_.clear();
+  samples_.clear();
+  bytesUntilSample_ = nextInterval();
+}
+
+void AllocationSampler::record(uintptr_t block, uintptr_t size) {
+  // Skip this function and Heap::allocate.
+  const int kSkipFrames = 2;
+  void* pcs[kMaxAllocationFrames + kSkipFrames];
+  auto n = backtrace(pcs, kMaxAllocationFrames + kSkipFrames);
+  AllocationSite site;
+  for (auto i = kSkipFrames; i < n; i++) {
+    site.frames.push_back(reinterpret_cast<uintptr_t>(pcs[i]));
+  }
+  if (currentStack != nullptr && currentStack->fn != nullptr && functionNameForProfile != nullptr) {
+    site.function = functionNameForProfile(currentStack->fn);
+    site.offset = currentStack->ipOffset;
+  }
+
+  auto it = recordIndex_.find(site);
+  if (it == recordIndex_.end()) {
+    it = recordIndex_.emplace(site, records_.size()).first;
+    records_.emplace_back();
+    records_.back().site = std::move(site);
+  }
+  auto& r = records_[it->second];
+  r.allocObjects++;
+  r.allocBytes += size;
+  samples_[block] = Sample{it->second, size, false};
+}
+
+void AllocationSampler::update(const std::function<uintptr_t(uintptr_t)>& forward) {
+  std::unordered_map<uintptr_t, Sample> live;
+  for (auto& entry : samples_) {
+    auto sample = entry.second;
+    auto& r = records_[sample.record];
+    auto block = forward(entry.first);
+    if (block == 0) {
+      if (sample.counted) {
+        r.inuseObjects--;
+        r.inuseBytes -= sample.size;
+      }
+      continue;
+    }
+    if (!sample.counted) {
+      r.inuseObjects++;
+      r.inuseBytes += sample.size;
+      sample.counted = true;
+    }
+    live[block] = sample;
+  }
+  samples_ = std::move(live);
+}
+
+AllocationProfile AllocationSampler::profile() const {
+  AllocationProfile profile;
+  profile.sampleInterval = interval_;
+  profile.records = records_;
+  return profile;
+}
+
+uintptr_t AllocationSampler::nextInterval() {
+  if (interval_ == 0) {
+    return 0;
+  }
+  std::exponential_distribution<double> dist(1.0 / interval_);
+  return static_cast<uintptr_t>(std::ceil(dist(random_)));
+}
+
+}  // namespace codeswitch
@@ -0,0 +1,162 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_allocprofile_h
+#define memory_allocprofile_h
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "common/common.h"
+
+namespace codeswitch {
+
+class Function;
+
+/** Average number of bytes allocated between samples by default. */
+const uintptr_t kDefaultAllocationSampleInterval = 512 * KB;
+
+/** Maximum number of native frames recorded for each sample. */
+const size_t kMaxAllocationFrames = 32;
+
+/** Where a sampled allocation happened. */
+struct AllocationSite {
+  /** Native return addresses, innermost first, starting with allocate's caller. */
+  std::vector<uintptr_t> frames;
+
+  /** Name of the function being interpreted, or empty if there wasn't one. */
+  std::string function;
+
+  /** Bytecode offset within function. */
+  uintptr_t offset = 0;
+
+  bool operator<(const AllocationSite& other) const;
+};
+
+/**
+ * Sampled allocations from one site. Counts are of samples, not scaled by
+ * the sampling interval.
+ */
+struct AllocationRecord {
+  AllocationSite site;
+
+  /** Samples taken at this site since sampling started. */
+  uintptr_t allocObjects = 0;
+  uintptr_t allocBytes = 0;
+
+  /**
+   * Samples that were live after the most recent garbage collection.
+   * Samples allocated since then aren't counted until the next one, so
+   * garbage that hasn't been collected yet doesn't look live.
+   */
+  uintptr_t inuseObjects = 0;
+  uintptr_t inuseBytes = 0;
+};
+
+struct AllocationProfile {
+  /** Average number of bytes between samples, or 0 if sampling is off. */
+  uintptr_t sampleInterval = 0;
+
+  std::vector<AllocationRecord> records;
+};
+
+/**
+ * Writes a profile in the legacy text heap profile format read by pprof,
+ * which has inuse_space and alloc_space sample types (and object counts).
+ * pprof scales samples by the interval itself. Memory mappings follow the
+ * records so native addresses can be symbolized. Interpreted sites are
+ * written as comments before their records, since the format has no place
+ * for them.
+ */
+void writeHeapProfile(std::ostream& os, const AllocationProfile& profile);
+
+/**
+ * Returns the name of an interpreted function, used to label allocation
+ * sites. The heap doesn't know how functions are represented, so the
+ * package library sets this when it's initialized.
+ */
+extern std::string (*functionNameForProfile)(Function* fn);
+
+/**
+ * AllocationSampler picks allocations to sample and tracks which sampled
+ * blocks are still live.
+ *
+ * The number of bytes between samples is drawn from an exponential
+ * distribution, so each byte allocated is equally likely to be sampled,
+ * regardless of block size or allocation pattern.
+ *
+ * AllocationSampler is not synchronized. Heap calls it with mu_ held.
+ */
+class AllocationSampler {
+ public:
+  AllocationSampler();
+  NON_COPYABLE(AllocationSampler)
+
+  uintptr_t interval() const { return interval_; }
+
+  /**
+   * Sets the average number of bytes between samples. 0 turns sampling
+   * off. Samples already taken are discarded, since samples taken at
+   * different rates can't be scaled together.
+   */
+  void setInterval(uintptr_t interval);
+
+  /** Returns whether the allocation of a block of size bytes should be sampled. */
+  bool shouldSample(uintptr_t size) {
+    if (interval_ == 0) {
+      return false;
+    }
+    if (size < bytesUntilSample_) {
+      bytesUntilSample_ -= size;
+      return false;
+    }
+    bytesUntilSample_ = nextInterval();
+    return true;
+  }
+
+  /**
+   * Records a sample of a newly allocated block, capturing the native
+   * backtrace and the interpreted function running on this thread, if any.
+   */
+  void record(uintptr_t block, uintptr_t size);
+
+  /**
+   * Updates sampled blocks after garbage collection. forward returns the
+   * block's current address, which may differ if it was moved, or 0 if the
+   * block is dead.
+   */
+  void update(const std::function<uintptr_t(uintptr_t)>& forward);
+
+  AllocationProfile profile() const;
+
+ private:
+  uintptr_t nextInterval();
+
+  struct Sample {
+    size_t record;
+    uintptr_t size;
+
+    /** Whether the sample is counted in its record's in-use totals. */
+    bool counted;
+  };
+
+  uintptr_t interval_ = kDefaultAllocationSampleInterval;
+  uintptr_t bytesUntilSample_;
+  std::mt19937_64 random_;
+  std::map<AllocationSite, size_t> recordIndex_;
+  std::vector<AllocationRecord> records_;
+
+  /** Sampled blocks not known to be dead, by address. */
+  std::unordered_map<uintptr_t, Sample> samples_;
+};
+
+}  // namespace codeswitch
+
+#endif
@@ -5,8 +5,203 @@
 
 #include "bitmap.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace codeswitch {
 
+namespace {
+
+/**
+ * Kernels operate on whole words. Bitmap handles partial words at the
+ * edges of each range.
+ */
+struct Kernels {
+  BitmapKernel kind;
+
+  /** Sets n words to zero. */
+  void (*zero)(uintptr_t* words, uintptr_t n);
+
+  /** Returns the number of set bits in n words. */
+  uintptr_t (*count)(const uintptr_t* words, uintptr_t n);
+
+  /** Returns the index of the first non-zero word, or n if all are zero. */
+  uintptr_t (*findNonZero)(const uintptr_t* words, uintptr_t n);
+};
+
+void zeroScalar(uintptr_t* words, uintptr_t n) {
+  for (uintptr_t i = 0; i < n; i++) words[i] = 0;
+}
+
+uintptr_t countScalar(const uintptr_t* words, uintptr_t n) {
+  uintptr_t count = 0;
+  for (uintptr_t i = 0; i < n; i++) count += __builtin_popcountl(words[i]);
+  return count;
+}
+
+uintptr_t findNonZeroScalar(const uintptr_t* words, uintptr_t n) {
+  uintptr_t i = 0;
+  while (i < n && words[i] == 0) i++;
+  return i;
+}
+
+const Kernels kScalarKernels = {BitmapKernel::SCALAR, zeroScalar, countScalar, findNonZeroScalar};
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, so these need no runtime check.
+
+void zeroSSE2(uintptr_t* words, uintptr_t n) {
+  auto zero = _mm_setzero_si128();
+  uintptr_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(words + i), zero);
+  }
+  for (; i < n; i++) words[i] = 0;
+}
+
+uintptr_t countSSE2(const uintptr_t* words, uintptr_t n) {
+  // SSE2 has no byte shuffle, so count bits in parallel within each byte,
+  // then add the bytes together with psadbw.
+  const auto m1 = _mm_set1_epi8(0x55);
+  const auto m2 = _mm_set1_epi8(0x33);
+  const auto m4 = _mm_set1_epi8(0x0f);
+  auto total = _mm_setzero_si128();
+  uintptr_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i));
+    v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi64(v, 1), m1));
+    v = _mm_add_epi8(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi64(v, 2), m2));
+    v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi64(v, 4)), m4);
+    total = _mm_add_epi64(total, _mm_sad_epu8(v, _mm_setzero_si128()));
+  }
+  uintptr_t count = _mm_cvtsi128_si64(total) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total));
+  for (; i < n; i++) count += __builtin_popcountl(words[i]);
+  return count;
+}
+
+uintptr_t findNonZeroSSE2(const uintptr_t* words, uintptr_t n) {
+  // Check four words per iteration, then find the exact word below.
+  auto zero = _mm_setzero_si128();
+  uintptr_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    auto v = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i)),
+                          _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i + 2)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) {
+      break;
+    }
+  }
+  while (i < n && words[i] == 0) i++;
+  return i;
+}
+
+const Kernels kSSE2Kernels = {BitmapKernel::SSE2, zeroSSE2, countSSE2, findNonZeroSSE2};
+
+__attribute__((target("avx2"))) void zeroAVX2(uintptr_t* words, uintptr_t n) {
+  auto zero = _mm256_setzero_si256();
+  uintptr_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(words + i), zero);
+  }
+  for (; i < n; i++) words[i] = 0;
+}
+
+__attribute__((target("avx2,popcnt"))) uintptr_t countAVX2(const uintptr_t* words, uintptr_t n) {
+  // Look up the bit count of each nibble with vpshufb, then add the bytes
+  // together with vpsadbw.
+  const auto table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                      0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const auto low = _mm256_set1_epi8(0x0f);
+  auto total = _mm256_setzero_si256();
+  uintptr_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i));
+    auto lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low));
+    auto hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+  }
+  uintptr_t count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                    _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+  for (; i < n; i++) count += __builtin_popcountl(words[i]);
+  return count;
+}
+
+__attribute__((target("avx2"))) uintptr_t findNonZeroAVX2(const uintptr_t* words, uintptr_t n) {
+  uintptr_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    auto v = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i)),
+                             _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i + 4)));
+    if (!_mm256_testz_si256(v, v)) {
+      break;
+    }
+  }
+  while (i < n && words[i] == 0) i++;
+  return i;
+}
+
+const Kernels kAVX2Kernels = {BitmapKernel::AVX2, zeroAVX2, countAVX2, findNonZeroAVX2};
+
+#endif
+
+const Kernels* kernelsFor(BitmapKernel kind) {
+#if defined(__x86_64__)
+  // Needed since this may run during static initialization.
+  __builtin_cpu_init();
+#endif
+  switch (kind) {
+    case BitmapKernel::SCALAR:
+      return &kScalarKernels;
+#if defined(__x86_64__)
+    case BitmapKernel::SSE2:
+      return &kSSE2Kernels;
+    case BitmapKernel::AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") ? &kAVX2Kernels : nullptr;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+// Starts out scalar so bitmaps work during static initialization, before
+// the best kernel is selected below.
+const Kernels* kernels = &kScalarKernels;
+[[maybe_unused]] const bool kernelsSelected = setBitmapKernel(bestBitmapKernel());
+
+}  // namespace
+
+BitmapKernel bestBitmapKernel() {
+  for (auto kind : {BitmapKernel::AVX2, BitmapKernel::SSE2}) {
+    if (kernelsFor(kind) != nullptr) {
+      return kind;
+    }
+  }
+  return BitmapKernel::SCALAR;
+}
+
+BitmapKernel bitmapKernel() {
+  return kernels->kind;
+}
+
+bool setBitmapKernel(BitmapKernel kind) {
+  auto k = kernelsFor(kind);
+  if (k == nullptr) {
+    return false;
+  }
+  kernels = k;
+  return true;
+}
+
+/** Returns a mask of bits at or above index within its word. */
+static inline uintptr_t maskFrom(uintptr_t index) {
+  return ~static_cast<uintptr_t>(0) << (index % kBitsInWord);
+}
+
+/** Returns a mask of bits at or below index within its word. */
+static inline uintptr_t maskThrough(uintptr_t index) {
+  return ~static_cast<uintptr_t>(0) >> (kBitsInWord - 1 - index % kBitsInWord);
+}
+
 uintptr_t Bitmap::sizeFor(uintptr_t bitCount) {
   uintptr_t bits = align(bitCount, kBitsInWord);
   uintptr_t words = bits / kBitsInWord;
@@ -43,22 +238,65 @@ void Bitmap::setWord(uintptr_t wordIndex, uintptr_t value) {
 }
 
 void Bitmap::clear() {
-  for (uintptr_t i = 0, n = wordCount(); i < n; i++) base_[i] = 0;
+  kernels->zero(base_, wordCount());
 }
 
-void Bitmap::copyFrom(Bitmap bitmap) {
-  ASSERT(bitCount_ == bitmap.bitCount_);
-  for (uintptr_t i = 0, n = wordCount(); i < n; i++) base_[i] = bitmap.base_[i];
+void Bitmap::clearRange(uintptr_t begin, uintptr_t end) {
+  ASSERT(begin <= end && end <= bitCount_);
+  if (begin == end) {
+    return;
+  }
+  auto first = begin / kBitsInWord;
+  auto last = (end - 1) / kBitsInWord;
+  if (first == last) {
+    base_[first] &= ~(maskFrom(begin) & maskThrough(end - 1));
+    return;
+  }
+  base_[first] &= ~maskFrom(begin);
+  kernels->zero(base_ + first + 1, last - first - 1);
+  base_[last] &= ~maskThrough(end - 1);
+}
+
+uintptr_t Bitmap::countRange(uintptr_t begin, uintptr_t end) const {
+  ASSERT(begin <= end && end <= bitCount_);
+  if (begin == end) {
+    return 0;
+  }
+  auto first = begin / kBitsInWord;
+  auto last = (end - 1) / kBitsInWord;
+  if (first == last) {
+    return __builtin_popcountl(base_[first] & maskFrom(begin) & maskThrough(end - 1));
+  }
+  return __builtin_popcountl(base_[first] & maskFrom(begin)) + kernels->count(base_ + first + 1, last - first - 1) +
+         __builtin_popcountl(base_[last] & maskThrough(end - 1));
 }
 
-uintptr_t Bitmap::wordIndexForBit(uintptr_t index) const {
-  ASSERT(index < bitCount_);
-  return index / kBitsInWord;
+uintptr_t Bitmap::findNextSet(uintptr_t begin, uintptr_t end) const {
+  ASSERT(begin <= end && end <= bitCount_);
+  if (begin == end) {
+    return end;
+  }
+  auto first = begin / kBitsInWord;
+  auto last = (end - 1) / kBitsInWord;
+  auto bits = base_[first] & maskFrom(begin);
+  if (first == last) {
+    bits &= maskThrough(end - 1);
+    return bits != 0 ? first * kBitsInWord + __builtin_ctzl(bits) : end;
+  }
+  if (bits != 0) {
+    return first * kBitsInWord + __builtin_ctzl(bits);
+  }
+  auto wordIndex = first + 1 + kernels->findNonZero(base_ + first + 1, last - first - 1);
+  bits = base_[wordIndex];
+  if (wordIndex == last) {
+    bits &= maskThrough(end - 1);
+  }
+  return bits != 0 ? wordIndex * kBitsInWord + __builtin_ctzl(bits) : end;
 }
 
-uintptr_t Bitmap::bitIndexForBit(uintptr_t index) const {
-  ASSERT(index < bitCount_);
-  return index % kBitsInWord;
+void Bitmap::copyFrom(Bitmap bitmap) {
+  ASSERT(bitCount_ == bitmap.bitCount_);
+  for (uintptr_t i = 0, n = wordCount(); i < n; i++) base_[i] = bitmap.base_[i];
 }
 
 }  // namespace codeswitch
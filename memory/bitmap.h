@@ -10,6 +10,29 @@
 
 namespace codeswitch {
 
+/**
+ * Instruction sets Bitmap's range operations may use. The best one the CPU
+ * supports is selected at startup.
+ */
+enum class BitmapKernel {
+  SCALAR,
+  SSE2,
+  AVX2,
+};
+
+/** Returns the best kernel this CPU supports. */
+BitmapKernel bestBitmapKernel();
+
+/** Returns the kernel in use. */
+BitmapKernel bitmapKernel();
+
+/**
+ * Selects the kernel Bitmap's range operations use. Used for testing and
+ * benchmarking. Returns false, leaving the kernel unchanged, if the CPU
+ * doesn't support it. Must not be called while bitmaps are in use.
+ */
+bool setBitmapKernel(BitmapKernel kernel);
+
 class Bitmap {
  public:
   Bitmap(uintptr_t* base, uintptr_t bitCount) : base_(base), bitCount_(bitCount) {}
@@ -23,9 +46,30 @@ class Bitmap {
   bool operator[](uintptr_t index) const { return at(index); }
   uintptr_t wordAt(uintptr_t wordIndex) const;
   void set(uintptr_t index, bool value);
+
+  /**
+   * Atomically sets a bit and returns its previous value. Safe to call
+   * concurrently with other calls to testAndSet.
+   */
+  bool testAndSet(uintptr_t index);
   void setWord(uintptr_t wordIndex, uintptr_t value);
   void clear();
 
+  /** Clears bits with indices in [begin, end). */
+  void clearRange(uintptr_t begin, uintptr_t end);
+
+  /** Returns whether any bit with an index in [begin, end) is set. */
+  bool anyInRange(uintptr_t begin, uintptr_t end) const { return findNextSet(begin, end) != end; }
+
+  /** Returns the number of set bits with indices in [begin, end). */
+  uintptr_t countRange(uintptr_t begin, uintptr_t end) const;
+
+  /**
+   * Returns the index of the first set bit in [begin, end), or end if none
+   * of those bits are set.
+   */
+  uintptr_t findNextSet(uintptr_t begin, uintptr_t end) const;
+
   void copyFrom(Bitmap bitmap);
 
  private:
@@ -35,6 +79,30 @@ class Bitmap {
   uintptr_t* base_;
   uintptr_t bitCount_;
 };
+
+inline bool Bitmap::testAndSet(uintptr_t index) {
+  uintptr_t wordIndex = wordIndexForBit(index);
+  uintptr_t mask = static_cast<uintptr_t>(1) << bitIndexForBit(index);
+
+  // Most blocks reached during marking are already marked, so check before
+  // paying for an atomic read-modify-write.
+  if ((__atomic_load_n(base_ + wordIndex, __ATOMIC_RELAXED) & mask) != 0) {
+    return true;
+  }
+  uintptr_t old = __atomic_fetch_or(base_ + wordIndex, mask, __ATOMIC_RELAXED);
+  return (old & mask) != 0;
+}
+
+inline uintptr_t Bitmap::wordIndexForBit(uintptr_t index) const {
+  ASSERT(index < bitCount_);
+  return index / kBitsInWord;
+}
+
+inline uintptr_t Bitmap::bitIndexForBit(uintptr_t index) const {
+  ASSERT(index < bitCount_);
+  return index % kBitsInWord;
+}
+
 }  // namespace codeswitch
 
 #endif
@@ -0,0 +1,79 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+// bitmap_bench times Bitmap's range operations on a bitmap the size of a
+// chunk's pointer bitmap with each kernel the CPU supports.
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <vector>
+#include "bitmap.h"
+#include "chunk.h"
+
+using namespace codeswitch;
+
+namespace {
+
+const char* kernelName(BitmapKernel kernel) {
+  switch (kernel) {
+    case BitmapKernel::SCALAR:
+      return "scalar";
+    case BitmapKernel::SSE2:
+      return "sse2";
+    case BitmapKernel::AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+/** Runs f repeatedly for about half a second and prints the time per call. */
+void bench(const char* name, BitmapKernel kernel, const std::function<uintptr_t()>& f) {
+  const auto kMinTime = std::chrono::milliseconds(500);
+  uintptr_t sink = 0;
+  uintptr_t n = 1;
+  while (true) {
+    auto begin = std::chrono::steady_clock::now();
+    for (uintptr_t i = 0; i < n; i++) {
+      sink += f();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    if (elapsed >= kMinTime) {
+      auto ns = std::chrono::duration<double, std::nano>(elapsed).count() / n;
+      printf("Bitmap%s/%s\t%10lu\t%10.1f ns/op\t(%lu)\n", name, kernelName(kernel), n, ns, sink % 2);
+      return;
+    }
+    n *= 2;
+  }
+}
+
+}  // namespace
+
+int main() {
+  const uintptr_t kBitCount = Chunk::kSize / kPointerSize;
+  std::vector<uintptr_t> data(kBitCount / kBitsInWord);
+  std::vector<uintptr_t> sparse(data.size());
+  sparse.back() = 1;
+  for (auto& w : data) {
+    w = 0x0123456789abcdefULL;
+  }
+
+  for (auto kernel : {BitmapKernel::SCALAR, BitmapKernel::SSE2, BitmapKernel::AVX2}) {
+    if (!setBitmapKernel(kernel)) {
+      continue;
+    }
+    bench("ClearRange", kernel, [&] {
+      Bitmap(data.data(), kBitCount).clearRange(3, kBitCount - 3);
+      return data[0];
+    });
+    bench("CountRange", kernel, [&] { return Bitmap(sparse.data(), kBitCount).countRange(3, kBitCount); });
+    bench("FindNextSet", kernel, [&] { return Bitmap(sparse.data(), kBitCount).findNextSet(3, kBitCount); });
+    bench("AnyInRange", kernel, [&] {
+      return static_cast<uintptr_t>(Bitmap(sparse.data(), kBitCount).anyInRange(0, kBitCount - 1));
+    });
+  }
+  setBitmapKernel(bestBitmapKernel());
+  return 0;
+}
@@ -5,6 +5,8 @@
 
 #include "test/test.h"
 
+#include <algorithm>
+#include <vector>
 #include "bitmap.h"
 #include "common/common.h"
 
@@ -40,4 +42,58 @@ TEST(BitmapMutation) {
   }
 }
 
+TEST(BitmapRanges) {
+  // Check each range operation under every kernel this CPU supports against
+  // a bit-at-a-time reference, with ranges that start and end in the middle
+  // of words and cover runs long enough for vector loops.
+  const uintptr_t kBitCount = 21 * kBitsInWord;
+  std::vector<uintptr_t> data(kBitCount / kBitsInWord);
+  uintptr_t x = 88172645463325252ULL;
+  auto fill = [&](int density) {
+    for (auto& w : data) {
+      w = 0;
+      for (int i = 0; i < density; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        w |= static_cast<uintptr_t>(1) << (x % kBitsInWord);
+      }
+    }
+  };
+  const uintptr_t ranges[][2] = {{0, 0}, {0, kBitCount}, {3, 5}, {1, kBitsInWord}, {7, 10 * kBitsInWord + 3},
+                                 {kBitsInWord, 17 * kBitsInWord}, {5 * kBitsInWord + 9, kBitCount - 1}};
+
+  auto saved = bitmapKernel();
+  for (auto kernel : {BitmapKernel::SCALAR, BitmapKernel::SSE2, BitmapKernel::AVX2}) {
+    if (!setBitmapKernel(kernel)) {
+      continue;
+    }
+    for (int density : {0, 1, 40}) {
+      for (auto& range : ranges) {
+        auto begin = range[0], end = range[1];
+        fill(density);
+        Bitmap bitmap(data.data(), kBitCount);
+        uintptr_t count = 0, next = end;
+        for (auto i = begin; i < end; i++) {
+          if (bitmap[i]) {
+            count++;
+            next = std::min(next, i);
+          }
+        }
+        ASSERT_EQ(count, bitmap.countRange(begin, end));
+        ASSERT_EQ(next, bitmap.findNextSet(begin, end));
+        ASSERT_EQ(count != 0, bitmap.anyInRange(begin, end));
+
+        auto before = data;
+        bitmap.clearRange(begin, end);
+        for (uintptr_t i = 0; i < kBitCount; i++) {
+          auto expected = i >= begin && i < end ? false : Bitmap(before.data(), kBitCount)[i];
+          ASSERT_EQ(expected, bitmap[i]);
+        }
+      }
+    }
+  }
+  setBitmapKernel(saved);
+}
+
 }  // namespace codeswitch
@@ -0,0 +1,76 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_cage_h
+#define memory_cage_h
+
+#include <cstdint>
+#include "common/common.h"
+
+namespace codeswitch {
+
+/**
+ * When CODESWITCH_COMPRESSED_POINTERS is defined, the whole heap (chunks and
+ * large objects) lives in one reservation of kCageSize bytes, the cage, and
+ * pointers stored in blocks are 32-bit offsets from its base. This halves
+ * the size of pointer fields, at the cost of a compare and an add on each
+ * load. Otherwise, pointers in blocks are plain addresses.
+ *
+ * Pointers to blocks may be interior and aren't necessarily aligned (slices
+ * of byte arrays point anywhere), so offsets aren't shifted, and the cage
+ * can be at most 4 GiB.
+ *
+ * The first kCageGuardSize bytes of the cage never hold blocks. Compressed
+ * values below that are stored as they are, so null and kZeroAllocAddress
+ * don't need to be in the cage.
+ */
+#ifdef CODESWITCH_COMPRESSED_POINTERS
+constexpr bool kCompressedPointers = true;
+typedef uint32_t PointerSlot;
+#else
+constexpr bool kCompressedPointers = false;
+typedef uintptr_t PointerSlot;
+#endif
+
+/** Size in bytes of a pointer stored in a block. */
+const uintptr_t kPointerSize = sizeof(PointerSlot);
+
+const uintptr_t kCageSize = 4 * GB;
+const uintptr_t kCageGuardSize = 2 * MB;
+
+/** Address of the beginning of the cage. Set when the heap is created. */
+extern uintptr_t cageBase;
+
+inline PointerSlot compressPointer(uintptr_t p) {
+  if (!kCompressedPointers || p < kCageGuardSize) {
+    return static_cast<PointerSlot>(p);
+  }
+  ASSERT(p - cageBase < kCageSize);
+  return static_cast<PointerSlot>(p - cageBase);
+}
+
+inline uintptr_t decompressPointer(PointerSlot v) {
+  if (!kCompressedPointers || v < kCageGuardSize) {
+    return v;
+  }
+  return cageBase + v;
+}
+
+/**
+ * Loads the pointer stored in a pointer slot of a block. The load is atomic,
+ * so the garbage collector may read slots while they're being written.
+ */
+inline uintptr_t loadPointer(uintptr_t slot) {
+  return decompressPointer(__atomic_load_n(reinterpret_cast<PointerSlot*>(slot), __ATOMIC_RELAXED));
+}
+
+/** Stores a pointer in a pointer slot of a block, without a write barrier. */
+inline void storePointer(uintptr_t slot, uintptr_t p) {
+  __atomic_store_n(reinterpret_cast<PointerSlot*>(slot), compressPointer(p), __ATOMIC_RELAXED);
+}
+
+}  // namespace codeswitch
+
+#endif
@@ -5,81 +5,308 @@
 
 #include "chunk.h"
 
+#include <algorithm>
+#include <new>
+#include <vector>
 #include "heap.h"
 #include "platform/platform.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace codeswitch {
 
-void* Chunk::operator new(size_t size) {
-  ASSERT(size == sizeof(Chunk));
-  return reinterpret_cast<void*>(allocateChunk(size, size));
+namespace {
+
+/**
+ * Zeroes n words with non-temporal stores where the CPU has them, so a big
+ * run of dead blocks doesn't evict everything else from the cache.
+ */
+void zeroNonTemporal(uintptr_t* words, uintptr_t n) {
+#if defined(__x86_64__)
+  // SSE2 is part of x86-64. Streaming stores need 16-byte alignment.
+  uintptr_t i = 0;
+  if (n > 0 && !isAligned(reinterpret_cast<uintptr_t>(words), 16)) {
+    words[i++] = 0;
+  }
+  auto zero = _mm_setzero_si128();
+  for (; i + 2 <= n; i += 2) {
+    _mm_stream_si128(reinterpret_cast<__m128i*>(words + i), zero);
+  }
+  for (; i < n; i++) words[i] = 0;
+  _mm_sfence();
+#else
+  std::fill(words, words + n, 0);
+#endif
+}
+
+}  // namespace
+
+ChunkGeometry ChunkGeometry::make(uintptr_t blockSize, uintptr_t size) {
+  // The mark bitmap is sized for as many blocks as would fit if the chunk
+  // had no metadata, which is only a little more than actually fit.
+  ChunkGeometry g;
+  g.size = size;
+  g.blockSize = blockSize;
+  g.markBitmapOffset = Bitmap::sizeFor(size / kPointerSize);
+  g.cardTableOffset = g.markBitmapOffset + Bitmap::sizeFor(size / blockSize);
+  g.dataOffset = align(g.cardTableOffset + g.cardCount(), kBlockAlignment);
+  g.blockCount = (size - g.dataOffset) / blockSize;
+  return g;
+}
+
+ChunkGeometry ChunkGeometry::forBlockSize(uintptr_t blockSize) {
+  ASSERT(isAligned(blockSize, kBlockAlignment) && blockSize <= kMaxBlockSize);
+  auto best = make(blockSize, Chunk::kSize);
+  for (auto size = Chunk::kSize; size <= kMaxChunkSize; size *= 2) {
+    auto g = make(blockSize, size);
+    if (g.wasteSize() * kChunkWasteDivisor <= size) {
+      return g;
+    }
+    if (g.wasteSize() * best.size < best.wasteSize() * size) {
+      best = g;
+    }
+  }
+  return best;
+}
+
+Chunk* Chunk::create(uintptr_t blockSize, const Layout* layout) {
+  auto geometry = ChunkGeometry::forBlockSize(blockSize);
+  return new (heap->chunkCache()->allocate(geometry.size)) Chunk(geometry, layout);
 }
 
 void Chunk::operator delete(void* addr) {
-  freeChunk(addr, sizeof(Chunk));
+  heap->chunkCache()->free(addr);
+}
+
+uint32_t Chunk::currentMarkEpoch_ = 1;
+bool Chunk::lazyZeroing_ = false;
+uintptr_t Chunk::slotOffsetsBase_;
+const uint8_t* Chunk::slotOffsets_;
+
+Chunk::Chunk(const ChunkGeometry& geometry, const Layout* layout) :
+    geometry_(geometry),
+    blockSizeReciprocal_(UINT64_MAX / geometry.blockSize + 1),
+    bytesAllocated_(0),
+    freeList_(0),
+    freeSpace_(dataBegin()),
+    dirtyEnd_(0),
+    layout_(layout),
+    markEpoch_(currentMarkEpoch()),
+    needsSweep_(false),
+    freeListDirty_(false) {
+  ASSERT(isAligned(geometry_.blockSize, kBlockAlignment));
+
+  // Chunks come from the cache zeroed, so only pointer bits need to be set.
+  if (layout_ != nullptr && layout_->hasPointers()) {
+    auto base = reinterpret_cast<uintptr_t>(this);
+    auto ptr = pointerBitmapLocked();
+    auto blockSize = geometry_.blockSize;
+    for (auto block = dataBegin(); block < dataEnd(); block += blockSize) {
+      layout_->forEachPointerSlot(block, blockSize, [&](uintptr_t slot) { ptr.set((slot - base) / kPointerSize, true); });
+    }
+  }
+}
+
+void Chunk::setSlotOffsets(uintptr_t base, const uint8_t* offsets) {
+  slotOffsetsBase_ = base;
+  slotOffsets_ = offsets;
 }
 
-Chunk::Chunk(uintptr_t blockSize) :
-    blockSize_(blockSize), freeList_(0), freeSpace_(reinterpret_cast<uintptr_t>(this) + kDataOffset) {
-  ASSERT(isAligned(blockSize, kBlockAlignment));
+void Chunk::advanceMarkEpoch() {
+  __atomic_add_fetch(&currentMarkEpoch_, 1, __ATOMIC_RELEASE);
+}
+
+void Chunk::syncMarkEpoch() {
+  std::lock_guard lock(mu_);
+  markBitmapLocked();
 }
 
 bool Chunk::hasMark() {
   std::lock_guard lock(mu_);
+  if (!isMarkEpochCurrent()) {
+    return false;
+  }
   auto m = markBitmapLocked();
-  for (uintptr_t i = 0, n = m.wordCount(); i < n; i++) {
-    if (m.wordAt(i) != 0) {
-      return true;
-    }
+  return m.anyInRange(0, m.bitCount());
+}
+
+uintptr_t Chunk::markedBytes() {
+  std::lock_guard lock(mu_);
+  if (!isMarkEpochCurrent()) {
+    return 0;
   }
-  return false;
+  auto m = markBitmapLocked();
+  return m.countRange(0, m.bitCount()) * geometry_.blockSize;
 }
 
-void Chunk::sweep() {
+uintptr_t Chunk::scanDirtyCards(std::vector<uintptr_t>* slots) {
   std::lock_guard lock(mu_);
-  auto mark = markBitmapLocked();
+  auto cards = cardTable();
   auto ptr = pointerBitmapLocked();
-  auto words = reinterpret_cast<uintptr_t*>(this);
+  auto mark = markBitmapLocked();
+  auto base = reinterpret_cast<uintptr_t>(this);
+  auto begin = dataBegin();
+  const auto slotsPerCard = kCardSize / kPointerSize;
 
-  // Try to expand the free space at the end of the chunk.
-  auto beginIndex = kDataOffset / kWordSize;
-  auto origFreeIndex = (freeSpace_ - reinterpret_cast<uintptr_t>(this)) / kWordSize;
-  auto freeIndex = origFreeIndex;
-  auto wordsPerBlock = blockSize_ / kWordSize;
-  while (freeIndex > beginIndex) {
-    auto prevIndex = freeIndex - wordsPerBlock;
-    if (mark[prevIndex]) {
-      break;
+  uintptr_t dirtyCount = 0;
+  for (uintptr_t card = 0, n = geometry_.cardCount(); card < n; card++) {
+    if (cards[card] == 0) {
+      continue;
+    }
+    cards[card] = 0;
+    dirtyCount++;
+
+    // Each card covers a whole number of pointer bitmap words, so pointer
+    // slots can be found a word at a time.
+    for (auto wordIndex = card * slotsPerCard / kBitsInWord, n = wordIndex + slotsPerCard / kBitsInWord;
+         wordIndex < n; wordIndex++) {
+      auto bits = ptr.wordAt(wordIndex);
+      while (bits != 0) {
+        auto slot = base + (wordIndex * kBitsInWord + __builtin_ctzl(bits)) * kPointerSize;
+        bits &= bits - 1;
+        if (slot < begin || slot >= freeSpace_) {
+          continue;
+        }
+        if (mark[blockIndex(slot)]) {
+          slots->push_back(slot);
+        }
+      }
+    }
+  }
+  return dirtyCount;
+}
+
+void Chunk::forEachMarkedPointerSlot(const std::function<void(uintptr_t)>& f) {
+  std::lock_guard lock(mu_);
+  auto ptr = pointerBitmapLocked();
+  auto mark = markBitmapLocked();
+  auto base = reinterpret_cast<uintptr_t>(this);
+  auto begin = dataBegin();
+  for (auto wordIndex = (begin - base) / kPointerSize / kBitsInWord,
+            n = align((freeSpace_ - base) / kPointerSize, kBitsInWord) / kBitsInWord;
+       wordIndex < n; wordIndex++) {
+    auto bits = ptr.wordAt(wordIndex);
+    while (bits != 0) {
+      auto slot = base + (wordIndex * kBitsInWord + __builtin_ctzl(bits)) * kPointerSize;
+      bits &= bits - 1;
+      if (slot < begin || slot >= freeSpace_) {
+        continue;
+      }
+      if (mark[blockIndex(slot)]) {
+        f(slot);
+      }
     }
-    freeIndex = prevIndex;
   }
-  std::fill(words + freeIndex, words + origFreeIndex, 0);
-  for (uintptr_t i = freeIndex; i < origFreeIndex; i++) {
-    ptr.set(i, false);
+}
+
+void Chunk::forEachMarkedBlock(const std::function<void(uintptr_t)>& f) {
+  std::lock_guard lock(mu_);
+  auto mark = markBitmapLocked();
+  auto endIndex = blockIndex(freeSpace_);
+  for (auto index = mark.findNextSet(0, endIndex); index < endIndex; index = mark.findNextSet(index + 1, endIndex)) {
+    f(dataBegin() + index * geometry_.blockSize);
+  }
+}
+
+void Chunk::clearCards() {
+  std::lock_guard lock(mu_);
+  std::fill(cardTable(), cardTable() + geometry_.cardCount(), 0);
+}
+
+void Chunk::setNeedsSweep() {
+  std::lock_guard lock(mu_);
+  needsSweep_ = true;
+}
+
+bool Chunk::sweepIfNeeded() {
+  std::lock_guard lock(mu_);
+  if (!needsSweep_) {
+    return false;
   }
-  freeSpace_ = reinterpret_cast<uintptr_t>(words + freeIndex);
+  sweepLocked();
+  return true;
+}
 
-  // Rebuild the free list.
+void Chunk::sweepLocked() {
+  needsSweep_ = false;
+  auto lazy = lazyZeroing();
+  auto mark = markBitmapLocked();
+  auto ptr = pointerBitmapLocked();
+  auto base = reinterpret_cast<uintptr_t>(this);
+  auto blockSize = geometry_.blockSize;
+  auto origFreeIndex = blockIndex(freeSpace_);
+  auto blockAt = [this, blockSize](uintptr_t index) { return dataBegin() + index * blockSize; };
+
+  // Each live block has one mark bit, so the next mark bit is the next live
+  // block. Every block before it is dead. Each run of dead blocks is cleared
+  // at once (unless zeroing is lazy), then its blocks are linked into the
+  // free list in address order.
   bytesAllocated_ = 0;
   freeList_ = 0;
-  for (auto blockIndex = freeIndex - wordsPerBlock; blockIndex >= beginIndex; blockIndex -= wordsPerBlock) {
-    if (mark[blockIndex]) {
-      bytesAllocated_ += blockSize_;
-      continue;
+  freeListDirty_ = lazy;
+  auto tail = &freeList_;
+  uintptr_t index = 0;
+  while (true) {
+    auto liveIndex = mark.findNextSet(index, origFreeIndex);
+    if (liveIndex == origFreeIndex) {
+      break;
     }
-    ptr.set(blockIndex, false);
-    words[blockIndex] = freeList_;
-    freeList_ = reinterpret_cast<uintptr_t>(&words[blockIndex]);
-    for (uintptr_t i = 1; i < wordsPerBlock; i++) {
-      ptr.set(blockIndex + i, false);
-      words[blockIndex + i] = 0;
+    if (liveIndex > index) {
+      auto begin = blockAt(index), end = blockAt(liveIndex);
+      if (!lazy) {
+        zeroWordsLocked((begin - base) / kWordSize, (end - base) / kWordSize);
+      }
+      if (layout_ == nullptr) {
+        ptr.clearRange((begin - base) / kPointerSize, (end - base) / kPointerSize);
+      }
+      for (auto block = begin; block < end; block += blockSize) {
+        *tail = block;
+        tail = reinterpret_cast<uintptr_t*>(block);
+      }
     }
+    bytesAllocated_ += blockSize;
+    index = liveIndex + 1;
+  }
+  *tail = 0;
+
+  // Dead blocks after the last live block join the free space at the end
+  // of the chunk instead.
+  auto freeBegin = blockAt(index);
+  if (lazy) {
+    dirtyEnd_ = std::max(dirtyEnd_, freeSpace_);
+  } else {
+    zeroWordsLocked((freeBegin - base) / kWordSize, (freeSpace_ - base) / kWordSize);
+  }
+  if (layout_ == nullptr) {
+    ptr.clearRange((freeBegin - base) / kPointerSize, (freeSpace_ - base) / kPointerSize);
   }
+  freeSpace_ = freeBegin;
 
-  // Clear the mark bits.
-  // Pointer bits in freed blocks have already been cleared. Bits in live blocks
-  // stay set.
-  mark.clear();
+  // Pointer bits in freed blocks have already been cleared, unless they
+  // came from the layout. Pointer and mark bits in live blocks stay set.
+}
+
+void Chunk::zeroWordsLocked(uintptr_t begin, uintptr_t end) {
+  auto words = reinterpret_cast<uintptr_t*>(this);
+  auto size = (end - begin) * kWordSize;
+  if (size < kNonTemporalZeroSize) {
+    std::fill(words + begin, words + end, 0);
+    return;
+  }
+
+  auto addr = reinterpret_cast<uintptr_t>(words + begin);
+  auto limit = addr + size;
+  auto pageBegin = align(addr, kPageSize);
+  auto pageEnd = alignDown(limit, kPageSize);
+  if (size >= kMinReleaseZeroSize && pageEnd > pageBegin &&
+      releaseChunk(reinterpret_cast<void*>(pageBegin), pageEnd - pageBegin)) {
+    zeroNonTemporal(words + begin, (pageBegin - addr) / kWordSize);
+    zeroNonTemporal(reinterpret_cast<uintptr_t*>(pageEnd), (limit - pageEnd) / kWordSize);
+    return;
+  }
+  zeroNonTemporal(words + begin, end - begin);
 }
 
 void Chunk::validate() {
@@ -87,61 +314,60 @@ void Chunk::validate() {
 
   // Validate blocks before free space.
   auto words = reinterpret_cast<uintptr_t*>(this);
-  auto wordsPerBlock = blockSize_ / kWordSize;
-  auto freeSpaceIndex = (freeSpace_ - reinterpret_cast<uintptr_t>(this)) / kWordSize;
+  auto blockSize = geometry_.blockSize;
+  auto wordsPerBlock = blockSize / kWordSize;
   auto free = freeList_;
   uintptr_t bytesAllocated = 0;
-  for (auto index = kDataOffset / kWordSize; index < freeSpaceIndex; index += wordsPerBlock) {
-    auto block = reinterpret_cast<uintptr_t>(&words[index]);
+  for (auto block = dataBegin(); block < freeSpace_; block += blockSize) {
+    auto index = (block - reinterpret_cast<uintptr_t>(this)) / kWordSize;
     if (isMarkedLocked(block)) {
       // Allocated block.
-      // Each word with pointer bit set must either be 0 or an address
-      // inside another marked block on the heap.
-      bytesAllocated += blockSize_;
-      for (uintptr_t i = 0; i < wordsPerBlock; i++) {
-        auto slot = reinterpret_cast<uintptr_t>(&words[index + i]);
-        if (isPointerLocked(slot) && words[index + i] != 0) {
-          auto p = words[index + i];
+      // Each slot with pointer bit set must either be 0, kZeroAllocAddress,
+      // or an address inside another marked block on the heap.
+      bytesAllocated += blockSize;
+      for (auto slot = block; slot < block + blockSize; slot += kPointerSize) {
+        auto p = loadPointer(slot);
+        if (isPointerLocked(slot) && p != 0 && p != kZeroAllocAddress) {
           ASSERT(heap->isOnHeap(p));
+          if (heap->largeObjectContaining(p) != nullptr) {
+            ASSERT(Heap::isMarked(Heap::blockContaining(p)));
+            continue;
+          }
           auto c = Chunk::fromAddress(p);
-          auto caddr = reinterpret_cast<uintptr_t>(c);
-          ASSERT(caddr + Chunk::kDataOffset <= p && p <= c->freeSpace_);
-          ASSERT(c->isMarked(c->blockContaining(p)));
+          ASSERT(c->dataBegin() <= p && p <= c->freeSpace_);
+          ASSERT(c == this ? isMarkedLocked(blockContaining(p)) : c->isMarked(c->blockContaining(p)));
         }
       }
     } else if (free == block) {
       // Free block.
       // Must be on free list.
       // First word should be next element of free list.
-      // Other words should be 0.
-      // Pointer and other mark bits should be 0.
+      // Other words should be 0 unless the free list is dirty.
+      // Pointer bits should be 0 unless the chunk is typed.
       free = words[index];
-      ASSERT(!isPointerLocked(block));
+      ASSERT(layout_ != nullptr || !isPointerLocked(block));
       for (uintptr_t i = 1; i < wordsPerBlock; i++) {
-        ASSERT(words[index + i] == 0);
+        ASSERT(freeListDirty_ || words[index + i] == 0);
         auto addr = reinterpret_cast<uintptr_t>(&words[index + i]);
-        ASSERT(!isPointerLocked(addr));
-        ASSERT(!isMarkedLocked(addr));
+        ASSERT(layout_ != nullptr || !isPointerLocked(addr));
       }
     } else {
-      // Dead block.
-      // Other mark bits should be 0.
-      // Nothing else checked.
-      for (uintptr_t i = 1; i < wordsPerBlock; i++) {
-        auto addr = reinterpret_cast<uintptr_t>(&words[index + i]);
-        ASSERT(!isMarkedLocked(addr));
-      }
-      bytesAllocated += blockSize_;
+      // Dead block. Nothing checked.
+      bytesAllocated += blockSize;
     }
   }
   ASSERT(bytesAllocated == bytesAllocated_);
 
-  // Validate free space. Should be zeroes, no mark bits, no pointer bits.
-  for (auto index = freeSpaceIndex; index < kSize / kWordSize; index++) {
-    ASSERT(words[index] == 0);
+  // Validate free space. Should be zeroes past the dirty part, no mark
+  // bits, no pointer bits unless the chunk is typed. The space at the end
+  // of the chunk that's too small for a block should be zero, too.
+  auto mark = markBitmapLocked();
+  ASSERT(!mark.anyInRange(blockIndex(freeSpace_), geometry_.blockCount));
+  for (auto index = (freeSpace_ - reinterpret_cast<uintptr_t>(this)) / kWordSize; index < geometry_.size / kWordSize;
+       index++) {
+    ASSERT(reinterpret_cast<uintptr_t>(&words[index]) < dirtyEnd_ || words[index] == 0);
     auto addr = reinterpret_cast<uintptr_t>(&words[index]);
-    ASSERT(!isPointerLocked(addr));
-    ASSERT(!isMarkedLocked(addr));
+    ASSERT(layout_ != nullptr || !isPointerLocked(addr));
   }
 }
 
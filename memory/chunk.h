@@ -7,12 +7,16 @@
 #define memory_chunk_h
 
 #include <cstddef>
+#include <cstring>
+#include <functional>
 #include <iterator>
 #include <mutex>
+#include <vector>
 
 #include "common/common.h"
 
 #include "bitmap.h"
+#include "layout.h"
 
 namespace codeswitch {
 
@@ -28,24 +32,93 @@ class VM;
 const uintptr_t kBlockAlignment = 8;
 
 /**
- * The maximum block size is set so there isn't too much waste at the end of a
- * chunk.
- *
- * TODO: support larger allocations in mmap'd blocks with their own pointer
- * maps.
+ * The maximum block size is set so chunks for the largest blocks don't need
+ * to be too large (see kMaxChunkSize). Larger blocks are allocated as
+ * LargeObjects.
  */
 const uintptr_t kMaxBlockSize = 128 * KB;
 
+/**
+ * Chunks for large blocks span several Chunk::kSize slots, so the space at
+ * the end of each chunk, too small for another block, is a small part of
+ * it. Each block size gets the smallest chunk (a power of two multiple of
+ * Chunk::kSize, up to kMaxChunkSize) that wastes at most 1/kChunkWasteDivisor
+ * of its size. See ChunkGeometry::forBlockSize.
+ */
+const uintptr_t kMaxChunkSize = 4 * MB;
+const uintptr_t kChunkWasteDivisor = 32;
+
+/**
+ * Each chunk has a card table with one byte for each kCardSize bytes of the
+ * chunk. The write barrier dirties the card containing each pointer slot
+ * written, so minor collections only need to scan dirty cards to find
+ * pointers from old blocks to young blocks.
+ *
+ * Each card must cover a whole number of words in the pointer bitmap.
+ */
+const uintptr_t kCardSize = 512;
+
+/**
+ * When sweep zeroes a run of dead blocks at least this large, it uses
+ * non-temporal stores, which don't pull the run into the cache. Such runs
+ * are usually reused long after the stores would have been evicted anyway.
+ */
+const uintptr_t kNonTemporalZeroSize = 16 * KB;
+
+/**
+ * When sweep zeroes a run of dead blocks at least this large, the whole
+ * pages in it are returned to the kernel instead, which maps zero pages in
+ * when they're touched again.
+ */
+const uintptr_t kMinReleaseZeroSize = 64 * KB;
+
+/**
+ * ChunkGeometry describes how a chunk holding blocks of one size is laid out.
+ * Offsets are from the beginning of the chunk. See Chunk for what each
+ * section holds.
+ */
+struct ChunkGeometry {
+  /** Size of the whole chunk in bytes. A multiple of Chunk::kSize. */
+  uintptr_t size = 0;
+
+  uintptr_t blockSize = 0;
+  uintptr_t markBitmapOffset = 0;
+  uintptr_t cardTableOffset = 0;
+  uintptr_t dataOffset = 0;
+
+  /** Number of blocks that fit in the data section. */
+  uintptr_t blockCount = 0;
+
+  uintptr_t cardCount() const { return size / kCardSize; }
+
+  /** Bytes of blocks in the data section. */
+  uintptr_t dataSize() const { return blockCount * blockSize; }
+
+  /** Bytes at the end of the chunk that are too small to hold a block. */
+  uintptr_t wasteSize() const { return size - dataOffset - dataSize(); }
+
+  /** Lays out a chunk of size bytes. */
+  static ChunkGeometry make(uintptr_t blockSize, uintptr_t size);
+
+  /**
+   * Lays out a chunk for blocks of blockSize bytes, choosing its size as
+   * described at kChunkWasteDivisor. If no size up to kMaxChunkSize is good
+   * enough, the one wasting the smallest fraction is used.
+   */
+  static ChunkGeometry forBlockSize(uintptr_t blockSize);
+};
+
 /**
  * A Chunk is an aligned region of memory allocated from the kernel using mmap
  * or a similar mechanism. A chunk holds blocks of the same size, which may
  * be allocated by the heap.
  *
  * The heap is composed of chunks. Each chunk contains a header, a pointer
- * bitmap (one bit per word) indicating which words contain pointers, a
- * marking bitmap (one bit per word, though only the first bit for each
- * block is used) used by the garbage collector, and a contiguous data
- * section comprising blocks of the same size.
+ * bitmap (one bit per pointer-sized slot) indicating which slots contain
+ * pointers, a marking bitmap (one bit per block) used by the garbage
+ * collector, a card table, and a contiguous data section comprising blocks
+ * of the same size. Most chunks are Chunk::kSize bytes, but chunks for
+ * large blocks may be a few times that (see ChunkGeometry).
  * 
  * Within the data section, each chunk has a free list and a free section.
  * The free list is a singly linked list of free blocks. The first word in
@@ -56,30 +129,64 @@ const uintptr_t kMaxBlockSize = 128 * KB;
  * are clear. When a chunk is initially allocated, the free section takes up
  * the whole data section. Ideally, it doesn't even need physical pages
  * backing it.
+ *
+ * With lazy zeroing (see setLazyZeroing), sweep doesn't zero dead blocks.
+ * Blocks on the free list and the beginning of the free section may hold
+ * garbage, and allocate zeroes each one as it's handed out.
+ *
+ * A chunk may be typed with a Layout, in which case all its blocks hold
+ * elements of the same type. The pointer bitmap of a typed chunk is filled
+ * in from the layout when the chunk is created and never changes, so pointer
+ * bits are set in free blocks and the free section, too.
  */
 class Chunk {
  public:
   NON_COPYABLE(Chunk)
 
+  /**
+   * Chunks are aligned to kSize, and their sizes are multiples of it. The
+   * heap reservation is divided into slots of this size.
+   */
   static const uintptr_t kSize = 1 * MB;
-  void* operator new(size_t size);
+
+  /**
+   * Allocates memory for a chunk holding blocks of blockSize bytes, laid
+   * out by ChunkGeometry::forBlockSize, and constructs the chunk in it.
+   */
+  static Chunk* create(uintptr_t blockSize, const Layout* layout = nullptr);
   void operator delete(void* addr);
-  explicit Chunk(uintptr_t blockSize);
 
   static Chunk* fromAddress(const void* p) { return fromAddress(reinterpret_cast<uintptr_t>(p)); }
 
   /**
    * Returns the chunk containing a given address, assuming it belongs to
    * a chunk. Chunks are aligned in memory, so this works by masking off
-   * the low bits of the address.
+   * the low bits of the address, then stepping back to the chunk's first
+   * slot if the chunk spans several.
    */
   static Chunk* fromAddress(uintptr_t addr);
 
+  /**
+   * Sets the table fromAddress uses to find the first slot of a chunk. base
+   * is the address of the first slot, and offsets has a byte for each
+   * slot. See HeapReservation::slotOffsets.
+   */
+  static void setSlotOffsets(uintptr_t base, const uint8_t* offsets);
+
+  /** Returns the layout of this chunk's sections. */
+  const ChunkGeometry& geometry() const { return geometry_; }
+
   /**
    * Returns the size of blocks allocated from this chunk. All blocks within
    * the chunk are the same size.
    */
-  uintptr_t blockSize() const { return blockSize_; }
+  uintptr_t blockSize() const { return geometry_.blockSize; }
+
+  /**
+   * Returns the layout of blocks allocated from this chunk, or nullptr if
+   * the chunk is untyped.
+   */
+  const Layout* layout() const { return layout_; }
 
   /** Returns the address of a block containing a given address. */
   uintptr_t blockContaining(uintptr_t addr);
@@ -93,25 +200,28 @@ class Chunk {
 
   /**
    * Allocates an unused block, either from the free list or free section
-   * and returns it. Returns 0 if there are no unallocated blocks.
+   * and returns it. Returns 0 if there are no unallocated blocks. If the
+   * chunk needs to be swept, it's swept first.
    */
   uintptr_t allocate();
 
   /**
    * Returns whether an address has been marked as a pointer
-   * with setPointer. addr must be a word-aligned address on this chunk.
+   * with setPointer. addr must be a kPointerSize-aligned address on this chunk.
    */
   bool isPointer(uintptr_t addr);
 
   /**
-   * Marks an address as a pointer. addr must be a word-aligned address
-   * on this chunk.
+   * Marks an address as a pointer. addr must be a kPointerSize-aligned
+   * address on this chunk. On a typed chunk, this only checks that the layout
+   * already says addr is a pointer.
    */
   void setPointer(uintptr_t addr);
 
   /**
    * Returns whether an address has been marked as live with setMarked. addr
-   * must be the address of a block on this chunk.
+   * must be the address of a block on this chunk. There's one mark bit per
+   * block, found by dividing the address's offset by the block size.
    */
   bool isMarked(uintptr_t addr);
 
@@ -121,53 +231,167 @@ class Chunk {
    */
   void setMarked(uintptr_t addr);
 
-  /** Returns whether any block on this chunk has been marked as live. */
+  /**
+   * Marks an address as live and returns whether it was already marked.
+   * addr must be the address of a block on this chunk. This does not lock
+   * the chunk, so GC workers may call it concurrently.
+   */
+  bool testAndSetMarked(uintptr_t addr);
+
+  /**
+   * Returns whether any block on this chunk has been marked as live. This
+   * doesn't need to scan the mark bitmap if nothing on the chunk has been
+   * marked since the mark epoch last advanced.
+   */
   bool hasMark();
 
+  /** Returns the total size of blocks on this chunk marked as live. */
+  uintptr_t markedBytes();
+
+  /**
+   * Returns the current mark epoch. Mark bits on a chunk are only valid if
+   * they were set during the current epoch.
+   */
+  static uint32_t currentMarkEpoch() { return __atomic_load_n(&currentMarkEpoch_, __ATOMIC_ACQUIRE); }
+
+  /**
+   * Advances the mark epoch, which logically clears every chunk's mark
+   * bits. Each chunk's mark bitmap is actually cleared the first time it's
+   * accessed in the new epoch, so chunks where nothing is marked are never
+   * written. Must not be called while marking or while any chunk is waiting
+   * to be swept.
+   */
+  static void advanceMarkEpoch();
+
   /**
-   * Frees blocks on this chunk not marked as live. Any blocks not marked
-   * with setMarked are added to the free list or the free section at the end.
-   * Their contents are zeroed, and their pointer bits are cleared.
-   * All mark bits are cleared. The number of bytes allocated is recalculated.
+   * Enables or disables lazy zeroing for all chunks. When enabled, sweep
+   * leaves the contents of dead blocks alone, and allocate zeroes each
+   * block instead. That moves the cost of zeroing out of sweeping (which
+   * may happen in a pause) and into allocation, where the block is about
+   * to be written anyway. Blocks left dirty are still zeroed if this is
+   * disabled later.
    */
-  void sweep();
+  static void setLazyZeroing(bool enabled) { __atomic_store_n(&lazyZeroing_, enabled, __ATOMIC_RELAXED); }
+
+  static bool lazyZeroing() { return __atomic_load_n(&lazyZeroing_, __ATOMIC_RELAXED); }
+
+  /**
+   * Calls f with the address of each pointer slot in the block at addr.
+   * On a typed chunk, slots are found with the layout. Otherwise, the
+   * pointer bitmap is read a word at a time without locking the chunk.
+   * If setPointer is called concurrently, f may or may not see the new slot.
+   */
+  template <class F>
+  void forEachPointerSlotInBlock(uintptr_t addr, F f);
+
+  /**
+   * Marks the card containing addr as dirty. addr must be a word-aligned
+   * address on this chunk.
+   */
+  void dirtyCard(uintptr_t addr);
+
+  /**
+   * Finds pointer slots in marked blocks within dirty cards, appends them to
+   * slots, and cleans the cards. Returns the number of dirty cards found.
+   */
+  uintptr_t scanDirtyCards(std::vector<uintptr_t>* slots);
+
+  /**
+   * Calls f with the address of each pointer slot in each marked block.
+   * The chunk is locked while f runs, so f must not call methods on this
+   * chunk.
+   */
+  void forEachMarkedPointerSlot(const std::function<void(uintptr_t)>& f);
+
+  /**
+   * Calls f with the address of each marked block. The chunk is locked while
+   * f runs, so f must not call methods on this chunk.
+   */
+  void forEachMarkedBlock(const std::function<void(uintptr_t)>& f);
+
+  /** Marks all cards on this chunk as clean. */
+  void clearCards();
+
+  /**
+   * Flags the chunk as needing to be swept. This is called after marking
+   * instead of sweeping right away. The chunk is swept by sweepIfNeeded or
+   * before the next allocation, whichever comes first. Mark bits must not
+   * be cleared until then.
+   */
+  void setNeedsSweep();
+
+  /**
+   * Frees blocks on this chunk not marked as live if setNeedsSweep was
+   * called since the chunk was last swept. Any blocks not marked with
+   * setMarked are added to the free list or the free section at the end.
+   * Their contents are zeroed (unless lazy zeroing is enabled), and their
+   * pointer bits are cleared unless the chunk is typed.
+   * Mark bits of live blocks stay set, so they may be treated as old blocks
+   * in the next minor collection. The number of bytes allocated is
+   * recalculated. Returns whether the chunk was swept.
+   */
+  bool sweepIfNeeded();
 
   /** Checks heap invariants on this chunk. Used for debugging and testing. */
   void validate();
 
-  // Bitmap and data constants.
+  // Sections of a chunk, laid out by geometry_.
+  //
+  // The header is followed by two bitmaps. Actually the first bitmap overlaps
+  // with the header: each bit corresponds to a slot in the chunk, and the
+  // bits corresponding to the bitmap itself are not used.
   //
-  // The header is followed by two bitmaps, taking the first 32 KiB of the
-  // chunk. Actually the bitmaps overlap with the header: each bit corresponds
-  // to a word in the chunk, and the bits corresponding to the words of the
-  // bitmaps themselves are not used.
+  // The first bitmap contains bits indicating which pointer-sized slots in
+  // the chunk are pointers. These are set by write barriers, or by the
+  // constructor if the chunk is typed. With compressed pointers, slots are
+  // half a word, so this bitmap is twice as large.
   //
-  // The first bitmap contains bits indicating which words in the chunk are
-  // pointers. These are set by write barriers.
+  // The second bitmap contains marking bits set by the garbage collector,
+  // one per block. sweep frees unmarked blocks.
   //
-  // The second bitmap contains marking bits set by the garbage collector.
-  // sweep frees unmarked blocks.
-  static const uintptr_t kWordsInChunk = kSize / kWordSize;
-  static const uintptr_t kBitmapSizeInBytes = kWordsInChunk * 2 / 8;
-  static const uintptr_t kDataOffset = kBitmapSizeInBytes;
-  static const uintptr_t kDataSize = kSize - kDataOffset;
+  // The bitmaps are followed by the card table, which has one byte per card.
+  // Cards covering the bitmaps and the card table itself are not used.
+  static const uintptr_t kSlotsInWord = kWordSize / kPointerSize;
+
+  static_assert(kCardSize % (kBitsInWord * kPointerSize) == 0, "card must cover whole pointer bitmap words");
 
  private:
+  Chunk(const ChunkGeometry& geometry, const Layout* layout);
+
   Bitmap pointerBitmapLocked();
   Bitmap markBitmapLocked();
+  bool isMarkEpochCurrent() const;
+  void syncMarkEpoch();
+  uint8_t* cardTable() { return reinterpret_cast<uint8_t*>(this) + geometry_.cardTableOffset; }
+  uintptr_t dataBegin() const { return reinterpret_cast<uintptr_t>(this) + geometry_.dataOffset; }
+  uintptr_t dataEnd() const { return dataBegin() + geometry_.dataSize(); }
+
+  /** Returns the index of the block containing addr, which must be in the data section. */
+  uintptr_t blockIndex(uintptr_t addr) const;
   bool isPointerLocked(uintptr_t addr);
   bool isMarkedLocked(uintptr_t addr);
+  void sweepLocked();
+  void zeroWordsLocked(uintptr_t begin, uintptr_t end);
 
-  // Header section. Make sure kHeaderSize matches.
+  // Header section.
 
   /** mu_ guards the header and bitmap. */
   std::mutex mu_;
 
   /**
-   * Size in bytes of all blocks on this chunk. Must be a multiple of
-   * kBlockAlignment.
+   * Sizes and offsets of this chunk's sections. The block size must be a
+   * multiple of kBlockAlignment. Set by the constructor and never changed,
+   * so it may be read without mu_.
+   */
+  const ChunkGeometry geometry_;
+
+  /**
+   * ceil(2^64 / block size). Multiplying an offset within the chunk by this
+   * and keeping the high 64 bits divides it by the block size exactly, since
+   * offsets are less than 2^32. That's faster than dividing, and the mark
+   * bit of every block reached by the collector is found this way.
    */
-  uintptr_t blockSize_;
+  const uint64_t blockSizeReciprocal_;
 
   /**
    * Bytes allocated on this chunk. Used for the garbage collector's accounting.
@@ -182,45 +406,97 @@ class Chunk {
 
   /**
    * Address of a contiguous set of free blocks at the end of the chunk.
-   * Initially, this takes up the entire chunk. Always contains zeroes with
-   * no pointer or mark bits set.
+   * Initially, this takes up the entire chunk. Contains no pointer or mark
+   * bits, and contains zeroes from dirtyEnd_ on.
    */
   uintptr_t freeSpace_;
 
-  static const uintptr_t kHeaderSize =
-      sizeof(mu_) + sizeof(blockSize_) + sizeof(bytesAllocated_) + sizeof(freeList_) + sizeof(freeSpace_);
+  /**
+   * End of the part of the free section left dirty by lazy zeroing. Blocks
+   * allocated below this must be zeroed.
+   */
+  uintptr_t dirtyEnd_;
+
+  /**
+   * Layout of blocks on this chunk, or nullptr if the chunk is untyped.
+   * Set by the constructor and never changed, so it may be read without mu_.
+   */
+  const Layout* layout_;
 
-  uint8_t pad_[kSize - kHeaderSize];
+  /**
+   * Mark epoch the mark bitmap belongs to. If this is behind
+   * currentMarkEpoch_, the bitmap is stale, and no block is marked.
+   * Written while mu_ is held; read atomically without it.
+   */
+  uint32_t markEpoch_;
+
+  /**
+   * Whether unmarked blocks need to be freed before the next allocation.
+   * Set by setNeedsSweep, cleared by sweepLocked.
+   */
+  bool needsSweep_;
+
+  /**
+   * Whether blocks on the free list were left dirty by lazy zeroing. The
+   * free list is rebuilt by each sweep, so all its blocks are either dirty
+   * or zeroed.
+   */
+  bool freeListDirty_;
+
+  static uint32_t currentMarkEpoch_;
+  static bool lazyZeroing_;
+
+  static uintptr_t slotOffsetsBase_;
+  static const uint8_t* slotOffsets_;
 };
 
-static_assert(sizeof(Chunk) == Chunk::kSize, "Chunk does not have expected size");
+// The header overlaps the pointer bitmap, so its bits must only cover the
+// bitmap itself.
+static_assert(sizeof(Chunk) * 8 * kPointerSize <= Chunk::kSize / kPointerSize / 8, "Chunk header is too large");
+static_assert(kMaxChunkSize / Chunk::kSize <= 256, "slot offsets must fit in a byte");
+static_assert(kMaxChunkSize < (static_cast<uint64_t>(1) << 32), "offsets must fit in 32 bits for division");
 
 inline Chunk* Chunk::fromAddress(uintptr_t addr) {
-  return reinterpret_cast<Chunk*>(addr & ~(kSize - 1));
+  auto slot = addr & ~(kSize - 1);
+  return reinterpret_cast<Chunk*>(slot - slotOffsets_[(slot - slotOffsetsBase_) / kSize] * kSize);
+}
+
+inline uintptr_t Chunk::blockIndex(uintptr_t addr) const {
+  auto offset = static_cast<uint64_t>(addr - dataBegin());
+  return static_cast<uintptr_t>((static_cast<unsigned __int128>(blockSizeReciprocal_) * offset) >> 64);
 }
 
 inline uintptr_t Chunk::blockContaining(uintptr_t p) {
-  auto base = reinterpret_cast<uintptr_t>(this) + kDataOffset;
-  auto offset = p - base;
-  return base + (offset / blockSize_ * blockSize_);
+  return dataBegin() + blockIndex(p) * geometry_.blockSize;
 }
 
 /** Attempts to allocate a free block. Returns 0 if no blocks are free. */
 inline uintptr_t Chunk::allocate() {
   std::lock_guard<std::mutex> lock(mu_);
+  if (needsSweep_) {
+    sweepLocked();
+  }
+  auto blockSize = geometry_.blockSize;
   if (freeList_ != 0) {
     auto block = freeList_;
     auto next = reinterpret_cast<uintptr_t*>(freeList_);
     freeList_ = *next;
-    *next = 0;
-    bytesAllocated_ += blockSize_;
+    if (freeListDirty_) {
+      memset(next, 0, blockSize);
+    } else {
+      *next = 0;
+    }
+    bytesAllocated_ += blockSize;
     return block;
   }
 
-  if (freeSpace_ + blockSize_ <= reinterpret_cast<uintptr_t>(this) + kSize) {
+  if (freeSpace_ < dataEnd()) {
     auto block = freeSpace_;
-    freeSpace_ += blockSize_;
-    bytesAllocated_ += blockSize_;
+    freeSpace_ += blockSize;
+    if (block < dirtyEnd_) {
+      memset(reinterpret_cast<void*>(block), 0, blockSize);
+    }
+    bytesAllocated_ += blockSize;
     return block;
   }
 
@@ -229,12 +505,25 @@ inline uintptr_t Chunk::allocate() {
 
 inline Bitmap Chunk::pointerBitmapLocked() {
   auto base = reinterpret_cast<uintptr_t*>(this);
-  return Bitmap(base, kBitmapSizeInBytes * 8 / 2);
+  return Bitmap(base, geometry_.size / kPointerSize);
 }
 
+/**
+ * Returns the mark bitmap, first clearing it if it's from an earlier epoch.
+ * Everything that reads or writes mark bits must get the bitmap from here.
+ */
 inline Bitmap Chunk::markBitmapLocked() {
-  auto base = reinterpret_cast<uintptr_t*>(reinterpret_cast<uintptr_t>(this) + kBitmapSizeInBytes / 2);
-  return Bitmap(base, kBitmapSizeInBytes * 8 / 2);
+  auto base = reinterpret_cast<uintptr_t*>(reinterpret_cast<uintptr_t>(this) + geometry_.markBitmapOffset);
+  Bitmap bitmap(base, geometry_.blockCount);
+  if (!isMarkEpochCurrent()) {
+    bitmap.clear();
+    __atomic_store_n(&markEpoch_, currentMarkEpoch(), __ATOMIC_RELEASE);
+  }
+  return bitmap;
+}
+
+inline bool Chunk::isMarkEpochCurrent() const {
+  return __atomic_load_n(&markEpoch_, __ATOMIC_ACQUIRE) == currentMarkEpoch();
 }
 
 inline bool Chunk::isPointer(uintptr_t addr) {
@@ -243,8 +532,15 @@ inline bool Chunk::isPointer(uintptr_t addr) {
 }
 
 inline void Chunk::setPointer(uintptr_t addr) {
+  auto index = (addr - reinterpret_cast<uintptr_t>(this)) / kPointerSize;
+  if (layout_ != nullptr) {
+    // The bitmap of a typed chunk never changes, so it's safe to read
+    // without the lock. A pointer stored anywhere else would be missed by
+    // the garbage collector.
+    ASSERT(pointerBitmapLocked()[index]);
+    return;
+  }
   std::lock_guard lock(mu_);
-  auto index = (addr - reinterpret_cast<uintptr_t>(this)) / kWordSize;
   pointerBitmapLocked().set(index, true);
 }
 
@@ -255,18 +551,59 @@ inline bool Chunk::isMarked(uintptr_t addr) {
 
 inline void Chunk::setMarked(uintptr_t addr) {
   std::lock_guard lock(mu_);
-  auto index = (addr - reinterpret_cast<uintptr_t>(this)) / kWordSize;
-  markBitmapLocked().set(index, true);
+  markBitmapLocked().set(blockIndex(addr), true);
+}
+
+inline bool Chunk::testAndSetMarked(uintptr_t addr) {
+  // The bitmap must be cleared by one thread before any are marked. Once
+  // the epoch is current, the bitmap can be used without the lock.
+  if (!isMarkEpochCurrent()) {
+    syncMarkEpoch();
+  }
+  auto base = reinterpret_cast<uintptr_t*>(reinterpret_cast<uintptr_t>(this) + geometry_.markBitmapOffset);
+  return Bitmap(base, geometry_.blockCount).testAndSet(blockIndex(addr));
+}
+
+template <class F>
+void Chunk::forEachPointerSlotInBlock(uintptr_t addr, F f) {
+  if (layout_ != nullptr) {
+    layout_->forEachPointerSlot(addr, geometry_.blockSize, f);
+    return;
+  }
+  auto base = reinterpret_cast<uintptr_t>(this);
+  auto words = reinterpret_cast<const uintptr_t*>(this);
+  auto begin = (addr - base) / kPointerSize;
+  auto end = begin + geometry_.blockSize / kPointerSize;
+  for (auto wordIndex = begin / kBitsInWord; wordIndex * kBitsInWord < end; wordIndex++) {
+    auto first = wordIndex * kBitsInWord;
+    auto bits = __atomic_load_n(&words[wordIndex], __ATOMIC_RELAXED);
+    if (first < begin) {
+      bits &= ~static_cast<uintptr_t>(0) << (begin - first);
+    }
+    if (end - first < kBitsInWord) {
+      bits &= (static_cast<uintptr_t>(1) << (end - first)) - 1;
+    }
+    while (bits != 0) {
+      auto index = first + __builtin_ctzl(bits);
+      bits &= bits - 1;
+      f(base + index * kPointerSize);
+    }
+  }
+}
+
+inline void Chunk::dirtyCard(uintptr_t addr) {
+  // Cards are only cleaned while the world is stopped, and a byte store
+  // can't tear, so no lock is needed.
+  cardTable()[(addr - reinterpret_cast<uintptr_t>(this)) / kCardSize] = 1;
 }
 
 inline bool Chunk::isPointerLocked(uintptr_t addr) {
-  auto index = (addr - reinterpret_cast<uintptr_t>(this)) / kWordSize;
+  auto index = (addr - reinterpret_cast<uintptr_t>(this)) / kPointerSize;
   return pointerBitmapLocked()[index];
 }
 
 inline bool Chunk::isMarkedLocked(uintptr_t addr) {
-  auto index = (addr - reinterpret_cast<uintptr_t>(this)) / kWordSize;
-  return markBitmapLocked()[index];
+  return markBitmapLocked()[blockIndex(addr)];
 }
 
 }  // namespace codeswitch
@@ -0,0 +1,241 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include "chunkcache.h"
+
+#include <cerrno>
+#include <cstring>
+#include "chunk.h"
+#include "platform/platform.h"
+
+namespace codeswitch {
+
+ChunkCache::~ChunkCache() {
+  {
+    std::lock_guard lock(mu_);
+    scavengerStop_ = true;
+  }
+  if (scavenger_.joinable()) {
+    scavengerCv_.notify_one();
+    scavenger_.join();
+  }
+  // Cached chunks are freed along with the rest of the reservation.
+}
+
+void* ChunkCache::allocate(uintptr_t size) {
+  std::unique_lock lock(mu_);
+  if (size > Chunk::kSize) {
+    // Cached chunks are scattered, so they aren't gathered into spans.
+    auto count = size / Chunk::kSize;
+    auto addr = reservation_.take(count, Chunk::kSize);
+    if (addr == 0) {
+      throw SystemAllocationError{ENOMEM};
+    }
+    commitMemory(reinterpret_cast<void*>(addr), size);
+    stats_.mapCount++;
+    for (uintptr_t i = 0; i < count; i++) {
+      reservation_.setState(addr + i * Chunk::kSize, ChunkState::ACTIVE);
+    }
+    reservation_.setSpan(addr, count);
+    return reinterpret_cast<void*>(addr);
+  }
+
+  if (entries_.empty()) {
+    stats_.mapCount++;
+    auto addr = commitLocked();
+    reservation_.setState(reinterpret_cast<uintptr_t>(addr), ChunkState::ACTIVE);
+    return addr;
+  }
+
+  auto e = entries_.back();
+  entries_.pop_back();
+  stats_.reuseCount++;
+  reservation_.setState(reinterpret_cast<uintptr_t>(e.addr), ChunkState::ACTIVE);
+  lock.unlock();
+
+  // Zeroed chunks already read as zero. Others still hold whatever the
+  // last chunk left behind, including bitmaps and the card table.
+  if (!e.zeroed) {
+    memset(e.addr, 0, Chunk::kSize);
+  }
+  return e.addr;
+}
+
+void ChunkCache::free(void* addr) {
+  std::lock_guard lock(mu_);
+  auto begin = reinterpret_cast<uintptr_t>(addr);
+  auto count = reservation_.clearSpan(begin);
+  for (uintptr_t i = 0; i < count; i++) {
+    freeSlotLocked(begin + i * Chunk::kSize);
+  }
+}
+
+void ChunkCache::freeSlotLocked(uintptr_t addr) {
+  auto hugetlb = isHugetlbLocked(reinterpret_cast<void*>(addr));
+  if (entries_.size() >= kChunkCacheCapacity && !hugetlb) {
+    stats_.unmapCount++;
+    reservation_.give(addr);
+    return;
+  }
+
+  reservation_.setState(addr, ChunkState::CACHED);
+  entries_.push_back(Entry{reinterpret_cast<void*>(addr), std::chrono::steady_clock::now(), false, false, hugetlb, false});
+  if (!scavenger_.joinable()) {
+    scavenger_ = std::thread(&ChunkCache::scavenge, this);
+  }
+  scavengerCv_.notify_one();
+}
+
+void* ChunkCache::allocateLarge(uintptr_t size) {
+  std::lock_guard lock(mu_);
+  auto count = align(size, Chunk::kSize) / Chunk::kSize;
+  auto addr = reservation_.take(count, Chunk::kSize);
+  if (addr == 0) {
+    throw SystemAllocationError{ENOMEM};
+  }
+  commitMemory(reinterpret_cast<void*>(addr), size);
+  for (uintptr_t i = 0; i < count; i++) {
+    reservation_.setState(addr + i * Chunk::kSize, ChunkState::LARGE);
+  }
+  return reinterpret_cast<void*>(addr);
+}
+
+void ChunkCache::freeLarge(void* addr, uintptr_t size) {
+  std::lock_guard lock(mu_);
+  auto begin = reinterpret_cast<uintptr_t>(addr);
+  for (auto slot = begin; slot < begin + size; slot += Chunk::kSize) {
+    reservation_.give(slot);
+  }
+}
+
+void ChunkCache::prefault(uintptr_t bytes) {
+  std::lock_guard lock(mu_);
+  auto count = align(bytes, Chunk::kSize) / Chunk::kSize;
+  while (count > 0) {
+    // With huge pages, commitLocked caches the rest of each group, so
+    // those chunks become part of the warm region, too.
+    auto first = entries_.size();
+    auto addr = commitLocked();
+    stats_.mapCount++;
+    reservation_.setState(reinterpret_cast<uintptr_t>(addr), ChunkState::CACHED);
+    entries_.push_back(Entry{addr, std::chrono::steady_clock::now(), true, false, isHugetlbLocked(addr), false});
+    for (auto i = first; i < entries_.size(); i++) {
+      prefaultMemory(entries_[i].addr, Chunk::kSize);
+      entries_[i].warm = true;
+      if (count > 0) {
+        count--;
+      }
+    }
+  }
+}
+
+void ChunkCache::setReleaseDelay(std::chrono::milliseconds delay) {
+  {
+    std::lock_guard lock(mu_);
+    releaseDelay_ = delay;
+  }
+  scavengerCv_.notify_one();
+}
+
+void ChunkCache::setHugePages(bool enabled) {
+  std::lock_guard lock(mu_);
+  hugePages_ = enabled;
+}
+
+ChunkCacheStats ChunkCache::stats() {
+  std::lock_guard lock(mu_);
+  auto stats = stats_;
+  stats.cachedCount = entries_.size();
+  for (auto& e : entries_) {
+    if (e.released) {
+      stats.releasedCount++;
+    }
+  }
+  stats.residentBytes = residentMemorySize();
+  return stats;
+}
+
+void* ChunkCache::commitLocked() {
+  if (hugePages_) {
+    // Commit a whole group. Keep the first chunk and cache the rest. They're
+    // fresh, so they already read as zero.
+    auto group = reservation_.take(kHugePageSize / Chunk::kSize, kHugePageSize);
+    if (group == 0) {
+      throw SystemAllocationError{ENOMEM};
+    }
+    bool hugetlb;
+    commitHugeMemory(reinterpret_cast<void*>(group), kHugePageSize, &hugetlb);
+    stats_.hugePageGroupCount++;
+    if (hugetlb) {
+      stats_.hugetlbGroupCount++;
+      hugetlbGroups_.insert(group);
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (auto addr = group + kHugePageSize - Chunk::kSize; addr > group; addr -= Chunk::kSize) {
+      reservation_.setState(addr, ChunkState::CACHED);
+      entries_.push_back(Entry{reinterpret_cast<void*>(addr), now, true, false, hugetlb, false});
+    }
+    return reinterpret_cast<void*>(group);
+  }
+
+  auto addr = reservation_.take(1, Chunk::kSize);
+  if (addr == 0) {
+    throw SystemAllocationError{ENOMEM};
+  }
+  commitMemory(reinterpret_cast<void*>(addr), Chunk::kSize);
+  return reinterpret_cast<void*>(addr);
+}
+
+void ChunkCache::releaseCached() {
+  std::lock_guard lock(mu_);
+  for (auto& e : entries_) {
+    if (!e.released && !e.hugetlb && !e.warm) {
+      releaseLocked(&e);
+    }
+  }
+}
+
+void ChunkCache::releaseLocked(Entry* e) {
+  // The lock is held across the system call, so allocate can't take the
+  // chunk while it's being released.
+  if (releaseChunk(e->addr, Chunk::kSize)) {
+    e->zeroed = true;
+    e->released = true;
+    stats_.releaseCount++;
+  }
+}
+
+bool ChunkCache::isHugetlbLocked(void* addr) {
+  auto group = reinterpret_cast<uintptr_t>(addr) & ~(kHugePageSize - 1);
+  return hugetlbGroups_.count(group) != 0;
+}
+
+void ChunkCache::scavenge() {
+  std::unique_lock lock(mu_);
+  while (!scavengerStop_) {
+    // Release every chunk that has been idle long enough. Entries are
+    // ordered by the time they were freed, so the first unreleased entry
+    // that's too new determines when to wake up next.
+    auto now = std::chrono::steady_clock::now();
+    auto wake = std::chrono::steady_clock::time_point::max();
+    for (auto& e : entries_) {
+      if (e.released || e.hugetlb || e.warm) {
+        continue;
+      }
+      if (now - e.freedAt < releaseDelay_) {
+        wake = e.freedAt + releaseDelay_;
+        break;
+      }
+      releaseLocked(&e);
+    }
+    if (wake == std::chrono::steady_clock::time_point::max()) {
+      scavengerCv_.wait(lock);
+    } else {
+      scavengerCv_.wait_until(lock, wake);
+    }
+  }
+}
+
+}  // namespace codeswitch
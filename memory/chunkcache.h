@@ -0,0 +1,204 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_chunkcache_h
+#define memory_chunkcache_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "chunk.h"
+#include "common/common.h"
+#include "reservation.h"
+
+namespace codeswitch {
+
+/** Maximum number of free chunks kept by ChunkCache. More are unmapped. */
+const size_t kChunkCacheCapacity = 64;
+
+/**
+ * Default time a chunk may sit unused in ChunkCache before its pages are
+ * returned to the kernel.
+ */
+const std::chrono::milliseconds kDefaultChunkReleaseDelay(1000);
+
+/** Counters for ChunkCache, used to check how much memory is really in use. */
+struct ChunkCacheStats {
+  /** Number of chunks committed from the heap reservation. */
+  uintptr_t mapCount = 0;
+
+  /**
+   * Number of huge page groups mapped while huge pages were enabled. Each
+   * group holds several chunks and counts as one mapping in mapCount.
+   */
+  uintptr_t hugePageGroupCount = 0;
+
+  /**
+   * Number of huge page groups backed by explicit huge pages (MAP_HUGETLB)
+   * rather than transparent huge pages.
+   */
+  uintptr_t hugetlbGroupCount = 0;
+
+  /** Number of chunks decommitted because the cache was full. */
+  uintptr_t unmapCount = 0;
+
+  /** Number of chunks handed out from the cache instead of being mapped. */
+  uintptr_t reuseCount = 0;
+
+  /** Number of times a cached chunk's pages were returned to the kernel. */
+  uintptr_t releaseCount = 0;
+
+  /** Number of chunks currently in the cache. */
+  uintptr_t cachedCount = 0;
+
+  /** Number of cached chunks whose pages have been returned to the kernel. */
+  uintptr_t releasedCount = 0;
+
+  /** Resident set size of the process in bytes, or 0 if unknown. */
+  uintptr_t residentBytes = 0;
+};
+
+/**
+ * ChunkCache keeps memory for recently freed chunks so it can be reused for
+ * new chunks of any size class without committing and decommitting it again.
+ * New chunks are carved out of a HeapReservation owned by the cache, which
+ * also tracks which chunks are in use.
+ *
+ * A background scavenger thread returns the pages of chunks that have been
+ * cached for longer than the release delay to the kernel. The chunks stay
+ * committed and may still be reused; they just need to be faulted in again.
+ * Chunks in the warm region set up by prefault are never released.
+ *
+ * Memory returned by allocate is always zeroed.
+ *
+ * When huge pages are enabled, new chunks are mapped in groups aligned to
+ * kHugePageSize so the kernel can back each group with a huge page. The
+ * rest of each group goes into the cache. Chunks backed by explicit huge
+ * pages can't be released or decommitted on their own, so the cache keeps
+ * them indefinitely.
+ */
+class ChunkCache {
+ public:
+  NON_COPYABLE(ChunkCache)
+  ChunkCache() = default;
+  ~ChunkCache();
+
+  /**
+   * Returns zeroed, aligned memory for a chunk of size bytes, which must be
+   * a multiple of Chunk::kSize. Chunks larger than Chunk::kSize are
+   * committed fresh from the reservation, and their span is recorded so
+   * Chunk::fromAddress can find their first slot.
+   *
+   * @throws SystemAllocationError if the reservation is exhausted or memory
+   *     couldn't be committed.
+   */
+  void* allocate(uintptr_t size = Chunk::kSize);
+
+  /**
+   * Adds memory for a chunk to the cache, decommitting it if the cache is
+   * full. Chunks spanning several slots are cached one slot at a time.
+   */
+  void free(void* addr);
+
+  /**
+   * Commits a zeroed region of size bytes for a large object, starting at
+   * a chunk boundary in the reservation. Only used with compressed
+   * pointers, since every block must be in the cage. The region's slots
+   * aren't cached when it's freed.
+   *
+   * @throws SystemAllocationError if the reservation is exhausted or memory
+   *     couldn't be committed.
+   */
+  void* allocateLarge(uintptr_t size);
+
+  /** Decommits a region returned by allocateLarge. */
+  void freeLarge(void* addr, uintptr_t size);
+
+  /**
+   * Commits and faults in at least the given number of bytes of chunks and
+   * adds them to the cache, so the first chunks the heap allocates don't
+   * page fault. This warm region is kept resident; the scavenger doesn't
+   * release it. The cache's capacity doesn't apply.
+   */
+  void prefault(uintptr_t bytes);
+
+  /**
+   * Returns the pages of all cached chunks to the kernel now, rather than
+   * waiting for the scavenger. The warm region and chunks backed by explicit
+   * huge pages are kept.
+   */
+  void releaseCached();
+
+  /** Returns the address range chunks are allocated from. */
+  HeapReservation* reservation() { return &reservation_; }
+
+  /**
+   * Sets how long a chunk may sit unused in the cache before its pages are
+   * returned to the kernel.
+   */
+  void setReleaseDelay(std::chrono::milliseconds delay);
+
+  /**
+   * Enables or disables mapping new chunks in huge page groups. Chunks
+   * already mapped aren't affected.
+   */
+  void setHugePages(bool enabled);
+
+  ChunkCacheStats stats();
+
+ private:
+  struct Entry {
+    void* addr;
+    std::chrono::steady_clock::time_point freedAt;
+
+    /** Whether the chunk reads as zero, either because it's fresh or released. */
+    bool zeroed;
+
+    /** Whether the chunk's pages were returned to the kernel. */
+    bool released;
+
+    bool hugetlb;
+
+    /** Whether the chunk is part of the warm region and shouldn't be released. */
+    bool warm;
+  };
+
+  void* commitLocked();
+  void freeSlotLocked(uintptr_t addr);
+  void scavenge();
+  void releaseLocked(Entry* e);
+  bool isHugetlbLocked(void* addr);
+
+  std::mutex mu_;
+
+  /** Address range chunks are carved from. Guarded by mu_, except for state. */
+  HeapReservation reservation_;
+
+  /**
+   * Cached chunks, ordered by the time they were freed. allocate takes the
+   * most recently freed chunk, since it's most likely to still be resident.
+   */
+  std::vector<Entry> entries_;
+
+  std::chrono::milliseconds releaseDelay_ = kDefaultChunkReleaseDelay;
+  bool hugePages_ = false;
+  ChunkCacheStats stats_;
+
+  /** Base addresses of groups backed by explicit huge pages. */
+  std::unordered_set<uintptr_t> hugetlbGroups_;
+
+  /** Background thread that releases idle chunks. Started lazily by free. */
+  std::thread scavenger_;
+  std::condition_variable scavengerCv_;
+  bool scavengerStop_ = false;
+};
+
+}  // namespace codeswitch
+
+#endif
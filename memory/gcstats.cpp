@@ -0,0 +1,112 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include "gcstats.h"
+
+#include <algorithm>
+#include <iomanip>
+
+namespace codeswitch {
+
+const char* gcKindName(GCKind kind) {
+  switch (kind) {
+    case GCKind::FULL:
+      return "full";
+    case GCKind::YOUNG:
+      return "young";
+    case GCKind::COMPACT:
+      return "compact";
+  }
+  UNREACHABLE();
+  return "";
+}
+
+void writeJSONLine(std::ostream& os, const GCCycleStats& cycle) {
+  os << "{\"id\":" << cycle.id << ",\"kind\":\"" << gcKindName(cycle.kind) << '"'
+     << ",\"concurrent\":" << (cycle.concurrent ? "true" : "false") << ",\"start_ns\":" << cycle.startTime.count()
+     << ",\"root_scan_ns\":" << cycle.rootScanTime.count() << ",\"mark_ns\":" << cycle.markTime.count()
+     << ",\"sweep_ns\":" << cycle.sweepTime.count() << ",\"pause_ns\":" << cycle.pauseTime.count()
+     << ",\"bytes_before\":" << cycle.bytesBefore << ",\"bytes_after\":" << cycle.bytesAfter
+     << ",\"heap_bytes\":" << cycle.heapBytes << ",\"chunks_allocated\":" << cycle.chunksAllocated
+     << ",\"chunks_freed\":" << cycle.chunksFreed << ",\"fragmentation\":" << cycle.fragmentation() << "}\n";
+}
+
+void PauseWindow::record(std::chrono::nanoseconds pause) {
+  if (pauses_.size() < kPauseWindowSize) {
+    pauses_.push_back(pause);
+  } else {
+    pauses_[next_] = pause;
+  }
+  next_ = (next_ + 1) % kPauseWindowSize;
+  count_++;
+  max_ = std::max(max_, pause);
+}
+
+PauseSummary PauseWindow::summary() const {
+  PauseSummary summary;
+  summary.count = count_;
+  summary.max = max_;
+  if (pauses_.empty()) {
+    return summary;
+  }
+  auto sorted = pauses_;
+  std::sort(sorted.begin(), sorted.end());
+  auto at = [&sorted](double p) { return sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5)]; };
+  summary.p50 = at(0.5);
+  summary.p99 = at(0.99);
+  return summary;
+}
+
+double GCStats::fragmentation() const {
+  uintptr_t allocated = 0, capacity = 0;
+  for (auto& c : sizeClasses) {
+    allocated += c.bytesAllocated;
+    capacity += c.capacity;
+  }
+  return capacity == 0 ? 0.0 : 1.0 - static_cast<double>(allocated) / capacity;
+}
+
+namespace {
+
+double toMicroseconds(std::chrono::nanoseconds d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+void printPauses(std::ostream& os, const char* name, const PauseSummary& pauses) {
+  os << "  " << name << " pauses: " << pauses.count << ", p50 " << toMicroseconds(pauses.p50) << " us, p99 "
+     << toMicroseconds(pauses.p99) << " us, max " << toMicroseconds(pauses.max) << " us\n";
+}
+
+}  // namespace
+
+void printSummary(std::ostream& os, const GCStats& stats) {
+  auto flags = os.flags();
+  os << std::fixed << std::setprecision(1);
+  os << "gc: " << stats.fullCount << " full, " << stats.youngCount << " young, " << stats.compactCount
+     << " compacting collections; " << toMicroseconds(stats.totalPauseTime) << " us paused\n";
+  printPauses(os, "young", stats.youngPauses);
+  printPauses(os, "full", stats.fullPauses);
+  if (stats.lastCycle.id != 0) {
+    auto& c = stats.lastCycle;
+    os << "  last cycle: #" << c.id << " " << gcKindName(c.kind) << ", roots " << toMicroseconds(c.rootScanTime)
+       << " us, mark " << toMicroseconds(c.markTime) << " us, sweep " << toMicroseconds(c.sweepTime) << " us, "
+       << c.bytesBefore << " -> " << c.bytesAfter << " bytes\n";
+  }
+  os << "  heap: " << stats.bytesAllocated << " bytes allocated, " << stats.totalChunksAllocated
+     << " chunks allocated, " << stats.totalChunksFreed << " freed, " << 100 * stats.fragmentation()
+     << "% fragmented\n";
+  for (auto& c : stats.sizeClasses) {
+    auto chunkBytes = static_cast<double>(c.chunkCount * c.chunkSize);
+    os << "  size " << c.blockSize << (c.typed ? " (typed)" : "") << ": " << c.chunkCount << " chunks of "
+       << c.chunkSize / KB << " KB, " << 100 * c.occupancy() << "% occupied, " << 100 * c.metadataBytes / chunkBytes
+       << "% metadata, " << 100 * c.wasteBytes / chunkBytes << "% waste\n";
+  }
+  if (stats.largeObjectCount > 0) {
+    os << "  large objects: " << stats.largeObjectCount << ", " << stats.largeObjectBytes << " bytes\n";
+  }
+  os.flags(flags);
+}
+
+}  // namespace codeswitch
@@ -0,0 +1,190 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_gcstats_h
+#define memory_gcstats_h
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "common/common.h"
+
+namespace codeswitch {
+
+/** Kinds of garbage collection cycles. */
+enum class GCKind {
+  /** Traces and sweeps the whole heap. May be marked concurrently. */
+  FULL,
+
+  /** Traces and sweeps only young blocks. */
+  YOUNG,
+
+  /** A full collection that also evacuates sparse chunks (Heap::compact). */
+  COMPACT,
+};
+
+const char* gcKindName(GCKind kind);
+
+/**
+ * Statistics about a single garbage collection cycle.
+ *
+ * Phase timings only cover work done while the world is stopped. For a
+ * cycle marked concurrently or incrementally, mark time only includes the
+ * final remark, and the cycle has two pauses: one to start marking and one
+ * to finish.
+ */
+struct GCCycleStats {
+  /** Sequence number of the cycle, starting at 1. */
+  uint64_t id = 0;
+
+  GCKind kind = GCKind::FULL;
+
+  /** Whether the cycle was marked concurrently or incrementally. */
+  bool concurrent = false;
+
+  /** Time the cycle started, relative to when the heap was created. */
+  std::chrono::nanoseconds startTime{0};
+
+  /**
+   * Time spent scanning roots. For young collections, this includes
+   * scanning dirty cards.
+   */
+  std::chrono::nanoseconds rootScanTime{0};
+
+  /** Time spent tracing from the roots. */
+  std::chrono::nanoseconds markTime{0};
+
+  /**
+   * Time spent sweeping, including finishing the previous cycle's lazy
+   * sweep. Most chunks are swept later, outside the pause.
+   */
+  std::chrono::nanoseconds sweepTime{0};
+
+  /** Total time the world was stopped for this cycle. */
+  std::chrono::nanoseconds pauseTime{0};
+
+  /** Bytes allocated in blocks when the cycle started and ended. */
+  uintptr_t bytesBefore = 0;
+  uintptr_t bytesAfter = 0;
+
+  /**
+   * Bytes of chunk data sections and large object blocks when the cycle
+   * ended. This is what bytesAfter occupies.
+   */
+  uintptr_t heapBytes = 0;
+
+  /** Chunks created since the previous cycle ended, including this one. */
+  uintptr_t chunksAllocated = 0;
+
+  /** Chunks freed by this cycle. */
+  uintptr_t chunksFreed = 0;
+
+  /** Fraction of heapBytes not occupied by live blocks after the cycle. */
+  double fragmentation() const { return heapBytes == 0 ? 0.0 : 1.0 - static_cast<double>(bytesAfter) / heapBytes; }
+};
+
+/** Writes a cycle's statistics as a single line of JSON, ending with a newline. */
+void writeJSONLine(std::ostream& os, const GCCycleStats& cycle);
+
+/** Summary of a rolling window of pause times. */
+struct PauseSummary {
+  /** Number of pauses recorded since the heap was created. */
+  uintptr_t count = 0;
+
+  /** Median and 99th percentile pause times within the window. */
+  std::chrono::nanoseconds p50{0};
+  std::chrono::nanoseconds p99{0};
+
+  /** Longest pause since the heap was created. */
+  std::chrono::nanoseconds max{0};
+};
+
+/** Number of recent pauses PauseWindow computes percentiles over. */
+const size_t kPauseWindowSize = 1024;
+
+/**
+ * PauseWindow keeps the most recent kPauseWindowSize pause times, so
+ * percentiles reflect recent behavior rather than the whole run.
+ *
+ * PauseWindow is not synchronized.
+ */
+class PauseWindow {
+ public:
+  void record(std::chrono::nanoseconds pause);
+  PauseSummary summary() const;
+
+ private:
+  std::vector<std::chrono::nanoseconds> pauses_;
+  size_t next_ = 0;
+  uintptr_t count_ = 0;
+  std::chrono::nanoseconds max_{0};
+};
+
+/** Occupancy of chunks holding blocks of one size and layout. */
+struct SizeClassStats {
+  uintptr_t blockSize = 0;
+
+  /** Whether blocks have a static layout (see Layout). */
+  bool typed = false;
+
+  uintptr_t chunkCount = 0;
+  uintptr_t bytesAllocated = 0;
+
+  /** Size of each chunk. Classes with large blocks have larger chunks. */
+  uintptr_t chunkSize = 0;
+
+  /** Bytes of blocks that fit in the chunks' data sections. */
+  uintptr_t capacity = 0;
+
+  /** Bytes of the chunks' headers, bitmaps, and card tables. */
+  uintptr_t metadataBytes = 0;
+
+  /** Bytes at the ends of the chunks that are too small to hold a block. */
+  uintptr_t wasteBytes = 0;
+
+  double occupancy() const { return capacity == 0 ? 0.0 : static_cast<double>(bytesAllocated) / capacity; }
+};
+
+/** Statistics about the garbage collector since the heap was created. */
+struct GCStats {
+  /** Number of cycles of each kind. */
+  uintptr_t fullCount = 0;
+  uintptr_t youngCount = 0;
+  uintptr_t compactCount = 0;
+
+  /** Total time the world was stopped for garbage collection. */
+  std::chrono::nanoseconds totalPauseTime{0};
+
+  /** Pauses for young collections, and for full collections and compaction. */
+  PauseSummary youngPauses;
+  PauseSummary fullPauses;
+
+  /** The most recently finished cycle. Its id is 0 if there hasn't been one. */
+  GCCycleStats lastCycle;
+
+  uintptr_t bytesAllocated = 0;
+  uintptr_t totalChunksAllocated = 0;
+  uintptr_t totalChunksFreed = 0;
+
+  /** Chunk occupancy, sorted by block size. */
+  std::vector<SizeClassStats> sizeClasses;
+
+  uintptr_t largeObjectCount = 0;
+  uintptr_t largeObjectBytes = 0;
+
+  /**
+   * Fraction of chunk capacity not occupied by allocated blocks. Large
+   * objects aren't counted, since each holds exactly one block.
+   */
+  double fragmentation() const;
+};
+
+/** Writes a human-readable summary of stats. */
+void printSummary(std::ostream& os, const GCStats& stats);
+
+}  // namespace codeswitch
+
+#endif
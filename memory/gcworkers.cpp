@@ -0,0 +1,83 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include "gcworkers.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace codeswitch {
+
+GCWorkerPool::GCWorkerPool(size_t count) {
+  ASSERT(count > 0);
+  for (size_t i = 1; i < count; i++) {
+    threads_.emplace_back(&GCWorkerPool::work, this, i);
+  }
+}
+
+GCWorkerPool::~GCWorkerPool() {
+  {
+    std::lock_guard lock(mu_);
+    stop_ = true;
+  }
+  startCv_.notify_all();
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+void GCWorkerPool::run(const std::function<void(size_t)>& task) {
+  {
+    std::lock_guard lock(mu_);
+    task_ = &task;
+    running_ = threads_.size();
+    generation_++;
+  }
+  startCv_.notify_all();
+
+  task(0);
+
+  std::unique_lock lock(mu_);
+  doneCv_.wait(lock, [this] { return running_ == 0; });
+  task_ = nullptr;
+}
+
+void GCWorkerPool::forEach(size_t count, const std::function<void(size_t, size_t)>& task) {
+  std::atomic<size_t> next{0};
+  run([&](size_t index) {
+    for (auto i = next.fetch_add(1, std::memory_order_relaxed); i < count;
+         i = next.fetch_add(1, std::memory_order_relaxed)) {
+      task(index, i);
+    }
+  });
+}
+
+void GCWorkerPool::work(size_t index) {
+  uint64_t generation = 0;
+  while (true) {
+    const std::function<void(size_t)>* task;
+    {
+      std::unique_lock lock(mu_);
+      startCv_.wait(lock, [this, generation] { return stop_ || generation_ != generation; });
+      if (stop_) {
+        return;
+      }
+      generation = generation_;
+      task = task_;
+    }
+
+    (*task)(index);
+
+    {
+      std::lock_guard lock(mu_);
+      running_--;
+    }
+    doneCv_.notify_one();
+  }
+}
+
+}  // namespace codeswitch
@@ -0,0 +1,61 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_gcworkers_h
+#define memory_gcworkers_h
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "common/common.h"
+
+namespace codeswitch {
+
+/**
+ * GCWorkerPool is a fixed set of threads that perform garbage collection
+ * work in parallel while the world is stopped.
+ *
+ * The thread that calls run participates as worker 0, so a pool with
+ * a count of N has N-1 background threads.
+ */
+class GCWorkerPool {
+ public:
+  NON_COPYABLE(GCWorkerPool)
+  explicit GCWorkerPool(size_t count);
+  ~GCWorkerPool();
+
+  size_t count() const { return threads_.size() + 1; }
+
+  /**
+   * Calls task on every worker with the index of the worker, then waits
+   * for all calls to return.
+   */
+  void run(const std::function<void(size_t)>& task);
+
+  /**
+   * Calls task for each item index in [0, count), spreading calls across
+   * workers. Workers claim items from a shared atomic counter, so uneven
+   * items balance out. task receives the worker index and the item index.
+   */
+  void forEach(size_t count, const std::function<void(size_t, size_t)>& task);
+
+ private:
+  void work(size_t index);
+
+  std::mutex mu_;
+  std::condition_variable startCv_;
+  std::condition_variable doneCv_;
+  std::vector<std::thread> threads_;
+  const std::function<void(size_t)>* task_ = nullptr;
+  uint64_t generation_ = 0;
+  size_t running_ = 0;
+  bool stop_ = false;
+};
+
+}  // namespace codeswitch
+
+#endif
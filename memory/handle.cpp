@@ -5,9 +5,9 @@
 
 #include "handle.h"
 
-#include <deque>
-#include <functional>
+#include <memory>
 #include <mutex>
+#include <vector>
 #include "common/common.h"
 
 namespace codeswitch {
@@ -16,7 +16,7 @@ HandleStorage* handleStorage;
 
 HandleStorage::HandleStorage() {
   heap->setGCLock(true);
-  heap->registerRoots(std::bind(&HandleStorage::accept, this, std::placeholders::_1));
+  heap->registerRoots(this, "HandleStorage");
   heap->setGCLock(false);
 }
 
@@ -29,8 +29,11 @@ uintptr_t HandleStorage::allocSlot() {
     *reinterpret_cast<uintptr_t*>(slot) = 0;
     return slot;
   }
-  slots_.push_back(0);
-  return reinterpret_cast<uintptr_t>(&slots_.back());
+  if (lastBlockUsed_ == kHandleBlockSize) {
+    blocks_.emplace_back(new uintptr_t[kHandleBlockSize]());
+    lastBlockUsed_ = 0;
+  }
+  return reinterpret_cast<uintptr_t>(&blocks_.back()[lastBlockUsed_++]);
 }
 
 void HandleStorage::freeSlot(uintptr_t slot) {
@@ -39,11 +42,11 @@ void HandleStorage::freeSlot(uintptr_t slot) {
   free_ = slot;
 }
 
-void HandleStorage::accept(std::function<void(uintptr_t)> accept) {
-  for (auto slot : slots_) {
-    if ((slot & 1) == 0) {
-      accept(slot);
-    }
+void HandleStorage::appendRootSpans(std::vector<RootSpan>* spans) {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (size_t i = 0; i < blocks_.size(); i++) {
+    auto count = i + 1 < blocks_.size() ? kHandleBlockSize : lastBlockUsed_;
+    spans->push_back(RootSpan{blocks_[i].get(), count});
   }
 }
 
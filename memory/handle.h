@@ -6,11 +6,12 @@
 #ifndef memory_handle_h
 #define memory_handle_h
 
-#include <deque>
-#include <functional>
+#include <memory>
 #include <mutex>
+#include <vector>
 #include "common/common.h"
 #include "ptr.h"
+#include "rootset.h"
 
 namespace codeswitch {
 
@@ -50,25 +51,37 @@ Handle<T> handle(T* block) {
   return Handle<T>(block);
 }
 
+/** Number of slots in each block of HandleStorage. */
+const size_t kHandleBlockSize = 256;
+
 /**
  * HandleStorage tracks all live handles.
  *
  * Each handle is given a word-sized slot. When allocated, a slot contains a
  * pointer to the tracked block. When free, a slot contains the uintptr_t of
- * another slot on the free list with the low bit set.
+ * another slot on the free list with the low bit set, so the garbage
+ * collector skips it.
+ *
+ * Slots are allocated in fixed-size blocks that never move, and each block
+ * is scanned as a single RootSpan.
  */
-class HandleStorage {
+class HandleStorage : public RootSet {
  public:
   HandleStorage();
+  NON_COPYABLE(HandleStorage)
 
   uintptr_t allocSlot();
   void freeSlot(uintptr_t slot);
 
-  void accept(std::function<void(uintptr_t)> visit);
+  void appendRootSpans(std::vector<RootSpan>* spans) override;
 
  private:
   std::mutex mu_;
-  std::deque<uintptr_t> slots_;
+  std::vector<std::unique_ptr<uintptr_t[]>> blocks_;
+
+  /** Number of slots handed out from the last block. */
+  size_t lastBlockUsed_ = kHandleBlockSize;
+
   uintptr_t free_ = 0;
 };
 
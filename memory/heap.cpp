@@ -5,8 +5,18 @@
 
 #include "heap.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <limits>
 #include <mutex>
+#include <thread>
+#include <unordered_set>
 #include "common/common.h"
+#include "common/error.h"
+#include "platform/platform.h"
+#include "workqueue.h"
 
 namespace codeswitch {
 
@@ -19,7 +29,35 @@ namespace codeswitch {
  */
 Heap* heap;
 
-void* Heap::allocate(size_t size) {
+uintptr_t cageBase;
+
+Heap::Heap() {
+  cageBase = chunkCache_.reservation()->begin();
+  Chunk::setSlotOffsets(chunkCache_.reservation()->begin(), chunkCache_.reservation()->slotOffsets());
+  gcWorkerCount_ = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), kMaxDefaultGCWorkerCount));
+  memoryLimit_ = static_cast<uintptr_t>(cgroupMemoryLimit() * kCgroupMemoryLimitRatio);
+}
+
+Heap::~Heap() {
+  {
+    std::lock_guard lock(mu_);
+    markerStop_ = true;
+    sweeperStop_ = true;
+  }
+  if (marker_.joinable()) {
+    markerCv_.notify_one();
+    marker_.join();
+  }
+  if (sweeper_.joinable()) {
+    sweeperCv_.notify_one();
+    sweeper_.join();
+  }
+  for (auto& entry : largeObjects_) {
+    LargeObject::destroy(entry.second);
+  }
+}
+
+void* Heap::allocate(size_t size, const Layout* layout) {
   // Align the requested size.
   // OPT: limit the number of chunk sizes by increasing the alignment with
   // block size.
@@ -27,56 +65,142 @@ void* Heap::allocate(size_t size) {
     return reinterpret_cast<void*>(kZeroAllocAddress);
   }
   auto blockSize = align(size, kBlockAlignment);
-  if (blockSize > kMaxBlockSize) {
-    // TODO: support large allocations.
-    throw AllocationError(false);
-  }
 
   // If we've reached the allocation threshold, collect garbage first.
+  // Most blocks die young, so a minor collection is usually enough.
+  // If the heap is being marked concurrently, finish once the marking
+  // thread runs out of work. If it's being marked incrementally, do a slice
+  // of marking first. Either way, finish if the heap has grown too much.
   std::lock_guard<std::mutex> lock(mu_);
-  if (bytesAllocated_ + blockSize >= allocationLimit_) {
-    collectGarbageLocked();
+  switch (gcPhase_) {
+    case GCPhase::NONE:
+      if (bytesAllocated_ + blockSize >= allocationLimit_) {
+        if (concurrentMarking_ || incrementalMarking_) {
+          startMarkLocked();
+        } else {
+          collectGarbageLocked();
+        }
+      } else if (youngBytesAllocated_ + blockSize >= kYoungAllocationLimit) {
+        collectYoungGarbageLocked();
+      }
+      break;
+
+    case GCPhase::MARKING:
+      if (markerDone_ || bytesAllocated_ + blockSize >= 2 * allocationLimit_) {
+        finishMarkLocked();
+      } else if (concurrentMarking_) {
+        if (!markStack_.empty()) {
+          markerCv_.notify_one();
+        }
+      } else if (markIncrementalLocked(kIncrementalMarkRatio * blockSize)) {
+        finishMarkLocked();
+      }
+      break;
   }
-  bytesAllocated_ += blockSize;
+  uintptr_t block = 0;
+  if (blockSize > kMaxBlockSize) {
+    block = allocateLargeLocked(blockSize, layout);
+  } else {
+    // Try to allocate from each chunk of the correct size and layout.
+    // OPT: track which chunks have free space.
+    auto& chunks_ = chunksByClass_[ChunkClass{blockSize, layout}];
+    for (auto& c : chunks_) {
+      block = c->allocate();
+      if (block != 0) {
+        break;
+      }
+    }
 
-  // Try to allocate from each chunk of the correct size.
-  // OPT: track which chunks have free space.
-  auto& chunks_ = chunksBySize_[blockSize];
-  for (auto& c : chunks_) {
-    auto block = c->allocate();
-    if (block != 0) {
-      return reinterpret_cast<void*>(block);
+    // Create a new chunk, add it to the list, then allocate from that.
+    if (block == 0) {
+      chunks_.emplace_back(Chunk::create(blockSize, layout));
+      chunksAllocated_++;
+      block = chunks_.back()->allocate();
     }
   }
+  bytesAllocated_ += blockSize;
+  youngBytesAllocated_ += blockSize;
 
-  // Create a new chunk, add it to the list, then allocate from that.
-  chunks_.emplace_back(new Chunk(blockSize));
-  auto block = chunks_.back()->allocate();
+  // Blocks allocated while marking are live for this cycle. The marking
+  // thread may be setting bits in the same bitmap word, so this must be
+  // atomic.
+  if (gcPhase_ == GCPhase::MARKING) {
+    testAndSetMarked(block);
+  }
+  if (allocationSampler_.shouldSample(blockSize)) {
+    allocationSampler_.record(block, blockSize);
+  }
   return reinterpret_cast<void*>(block);
 }
 
 void Heap::recordWrite(uintptr_t from, uintptr_t to) {
   // OPT: don't lock the heap here. This will be extremely slow.
   std::lock_guard lock(heap->mu_);
+
+  // Temporary Ptr values on the C++ stack run the write barrier too. There's
+  // nothing to record for them.
+  if (!isOnHeap(from)) {
+    return;
+  }
+
+  // Untyped blocks need the slot recorded in the pointer bitmap. Typed
+  // blocks already have it from their layout, so setPointer only checks.
   setPointer(from);
+
+  // Old blocks aren't traced during minor collections, so dirty the card
+  // in case the slot is in an old block and points to a young block.
+  if (to != 0) {
+    if (auto obj = heap->largeObjectContaining(from)) {
+      obj->dirtyCard(from);
+    } else {
+      Chunk::fromAddress(from)->dirtyCard(from);
+    }
+  }
+
+  // While marking, the slot may be in a block that was already
+  // scanned, so mark the stored block too (an incremental update barrier).
+  if (gcPhase_ == GCPhase::MARKING && to != 0 && to != kZeroAllocAddress) {
+    markStack_.push(to);
+  }
 }
 
 bool Heap::isPointer(uintptr_t addr) {
+  if (auto obj = heap->largeObjectContaining(addr)) {
+    return obj->isPointer(addr);
+  }
   return Chunk::fromAddress(addr)->isPointer(addr);
 }
 
 void Heap::setPointer(uintptr_t addr) {
+  if (auto obj = heap->largeObjectContaining(addr)) {
+    obj->setPointer(addr);
+    return;
+  }
   Chunk::fromAddress(addr)->setPointer(addr);
 }
 
 bool Heap::isMarked(uintptr_t addr) {
+  if (auto obj = heap->largeObjectContaining(addr)) {
+    return obj->isMarked();
+  }
   return Chunk::fromAddress(addr)->isMarked(addr);
 }
 
 void Heap::setMarked(uintptr_t addr) {
+  if (auto obj = heap->largeObjectContaining(addr)) {
+    obj->setMarked();
+    return;
+  }
   return Chunk::fromAddress(addr)->setMarked(addr);
 }
 
+bool Heap::testAndSetMarked(uintptr_t addr) {
+  if (auto obj = heap->largeObjectContaining(addr)) {
+    return obj->testAndSetMarked();
+  }
+  return Chunk::fromAddress(addr)->testAndSetMarked(addr);
+}
+
 void Heap::checkBound(uintptr_t base, uintptr_t offset) {
   auto block = blockContaining(base);
   auto size = blockSize(block);
@@ -89,6 +213,9 @@ uintptr_t Heap::blockContaining(uintptr_t p) {
   if (p == kZeroAllocAddress) {
     return kZeroAllocAddress;
   }
+  if (auto obj = heap->largeObjectContaining(p)) {
+    return obj->block();
+  }
   return Chunk::fromAddress(p)->blockContaining(p);
 }
 
@@ -96,115 +223,1302 @@ uintptr_t Heap::blockSize(uintptr_t p) {
   if (p == kZeroAllocAddress) {
     return 0;
   }
+  if (auto obj = heap->largeObjectContaining(p)) {
+    return obj->blockSize();
+  }
   return Chunk::fromAddress(p)->blockSize();
 }
 
 void Heap::collectGarbage() {
   std::lock_guard lock(mu_);
+  if (gcPhase_ == GCPhase::MARKING) {
+    finishMarkLocked();
+  }
   collectGarbageLocked();
 }
 
+void Heap::collectYoungGarbage() {
+  std::lock_guard lock(mu_);
+  collectYoungGarbageLocked();
+}
+
 void Heap::setGCLock(bool locked) {
   std::lock_guard lock(mu_);
-  if (locked) {
-    ASSERT(gcPhase_ == GCPhase::NONE);
-    gcPhase_ = GCPhase::LOCKED;
-  } else {
-    ASSERT(gcPhase_ == GCPhase::LOCKED);
-    gcPhase_ = GCPhase::NONE;
+  ASSERT(gcLocked_ != locked);
+  gcLocked_ = locked;
+}
+
+void Heap::setGCWorkerCount(size_t count) {
+  ASSERT(count > 0);
+  std::lock_guard lock(mu_);
+  gcWorkerCount_ = count;
+}
+
+size_t Heap::gcWorkerCount() {
+  std::lock_guard lock(mu_);
+  return gcWorkerCount_;
+}
+
+void Heap::setConcurrentMarking(bool enabled) {
+  std::lock_guard lock(mu_);
+  concurrentMarking_ = enabled;
+}
+
+void Heap::setIncrementalMarking(bool enabled) {
+  std::lock_guard lock(mu_);
+  incrementalMarking_ = enabled;
+}
+
+void Heap::setLazyZeroing(bool enabled) {
+  Chunk::setLazyZeroing(enabled);
+}
+
+void Heap::setGCPercent(int percent) {
+  std::lock_guard lock(mu_);
+  gcPercent_ = percent;
+  updateAllocationLimitLocked();
+}
+
+int Heap::gcPercent() {
+  std::lock_guard lock(mu_);
+  return gcPercent_;
+}
+
+void Heap::setMemoryLimit(uintptr_t bytes) {
+  std::lock_guard lock(mu_);
+  memoryLimit_ = bytes;
+  updateAllocationLimitLocked();
+}
+
+uintptr_t Heap::memoryLimit() {
+  std::lock_guard lock(mu_);
+  return memoryLimit_;
+}
+
+uintptr_t Heap::allocationLimit() {
+  std::lock_guard lock(mu_);
+  return allocationLimit_;
+}
+
+void Heap::registerRoots(RootSet* roots, const std::string& name) {
+  std::lock_guard lock(mu_);
+  rootSets_.push_back(roots);
+  rootNames_.push_back(name);
+}
+
+void Heap::rootSpansLocked(std::vector<RootSpan>* spans) {
+  for (auto roots : rootSets_) {
+    roots->appendRootSpans(spans);
   }
 }
 
-void Heap::registerRoots(std::function<void(std::function<void(uintptr_t)>)> accept) {
+/**
+ * Calls visit with each pointer held in the slots of spans. A second cursor
+ * runs kMarkPrefetchDistance slots ahead, prefetching the blocks it finds,
+ * so blocks are likely in cache by the time visit sees them. Spans are often
+ * short (two slots for a stack frame), so the cursor crosses spans.
+ */
+template <class Visit>
+static void forEachRoot(const std::vector<RootSpan>& spans, Visit visit) {
+  size_t aheadSpan = 0, aheadSlot = 0;
+  auto prefetchNext = [&spans, &aheadSpan, &aheadSlot]() {
+    while (aheadSpan < spans.size() && aheadSlot == spans[aheadSpan].count) {
+      aheadSpan++;
+      aheadSlot = 0;
+    }
+    if (aheadSpan < spans.size()) {
+      // Prefetching doesn't fault, so non-pointers don't need to be skipped.
+      __builtin_prefetch(reinterpret_cast<const void*>(spans[aheadSpan].slots[aheadSlot]));
+      aheadSlot++;
+    }
+  };
+  for (size_t i = 0; i < kMarkPrefetchDistance; i++) {
+    prefetchNext();
+  }
+  for (auto& span : spans) {
+    for (auto slot = span.slots, end = span.slots + span.count; slot != end; slot++) {
+      prefetchNext();
+      auto p = *slot;
+      if (p > kZeroAllocAddress && (p & 1) == 0) {
+        visit(p);
+      }
+    }
+  }
+}
+
+void Heap::writeSnapshot(std::ostream& os) {
   std::lock_guard lock(mu_);
-  rootAcceptors_.push_back(accept);
+  ASSERT(!gcLocked_);
+  if (gcPhase_ == GCPhase::MARKING) {
+    finishMarkLocked();
+  }
+  collectGarbageLocked();
+
+  // Pointers may be interior, so edges and roots are recorded as the start
+  // of the block they point into.
+  auto blockOf = [this](uintptr_t p) -> uintptr_t {
+    if (chunkCache_.reservation()->mayHoldChunk(p)) {
+      return Chunk::fromAddress(p)->blockContaining(p);
+    }
+    auto obj = largeObjectContaining(p);
+    ASSERT(obj != nullptr);
+    return obj->block();
+  };
+  HeapSnapshotWriter writer(os, rootNames_);
+  std::vector<RootSpan> spans;
+  for (uintptr_t i = 0; i < rootSets_.size(); i++) {
+    spans.clear();
+    rootSets_[i]->appendRootSpans(&spans);
+    forEachRoot(spans, [&writer, &blockOf, i](uintptr_t p) { writer.writeRoot(i, blockOf(p)); });
+  }
+
+  // After a full collection, the marked blocks are exactly the live ones.
+  std::vector<uintptr_t> blocks, edges;
+  auto visitSlot = [&edges, &blockOf](uintptr_t slot) {
+    auto q = loadPointer(slot);
+    if (q != 0 && q != kZeroAllocAddress) {
+      edges.push_back(blockOf(q));
+    }
+  };
+  for (auto& cls : chunksByClass_) {
+    for (auto& chunk : cls.second) {
+      blocks.clear();
+      chunk->forEachMarkedBlock([&blocks](uintptr_t block) { blocks.push_back(block); });
+      for (auto block : blocks) {
+        edges.clear();
+        chunk->forEachPointerSlotInBlock(block, visitSlot);
+        writer.writeBlock(block, chunk->blockSize(), edges);
+      }
+    }
+  }
+  for (auto& entry : largeObjects_) {
+    auto obj = entry.second;
+    if (obj->isMarked()) {
+      edges.clear();
+      obj->forEachPointerSlot(visitSlot);
+      writer.writeBlock(obj->block(), obj->blockSize(), edges);
+    }
+  }
+  writer.finish();
+}
+
+void Heap::writeImage(std::ostream& os, const std::vector<uintptr_t>& roots) {
+  std::lock_guard lock(mu_);
+
+  // Find the blocks reachable from roots, numbering them in the order
+  // they're found, and group them into runs by size and layout.
+  std::vector<uintptr_t> blocks;
+  std::unordered_map<uintptr_t, size_t> blockIndex;
+  auto visit = [&blocks, &blockIndex](uintptr_t p) {
+    if (p != 0 && p != kZeroAllocAddress) {
+      auto block = blockContaining(p);
+      if (blockIndex.emplace(block, blocks.size()).second) {
+        blocks.push_back(block);
+      }
+    }
+  };
+  auto visitSlot = [&visit](uintptr_t slot) { visit(loadPointer(slot)); };
+  for (auto root : roots) {
+    visit(root);
+  }
+  HeapImage image;
+  std::unordered_map<ChunkClass, size_t, ChunkClassHash> runIndex;
+  std::vector<size_t> blockRun;
+  std::vector<uintptr_t> blockPos;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    ChunkClass cls;
+    if (chunkCache_.reservation()->mayHoldChunk(blocks[i])) {
+      auto chunk = Chunk::fromAddress(blocks[i]);
+      cls = ChunkClass{chunk->blockSize(), chunk->layout()};
+      chunk->forEachPointerSlotInBlock(blocks[i], visitSlot);
+    } else {
+      auto obj = largeObjectContaining(blocks[i]);
+      ASSERT(obj != nullptr);
+      cls = ChunkClass{obj->blockSize(), obj->layout()};
+      obj->forEachPointerSlot(visitSlot);
+    }
+    auto it = runIndex.emplace(cls, image.runs.size());
+    if (it.second) {
+      image.runs.emplace_back();
+      image.runs.back().blockSize = cls.blockSize;
+      image.runs.back().layout = cls.layout;
+    }
+    blockRun.push_back(it.first->second);
+    blockPos.push_back(image.runs[it.first->second].blockCount++);
+  }
+  std::vector<uintptr_t> runBegin;
+  uintptr_t imageSize = 0;
+  for (auto& run : image.runs) {
+    runBegin.push_back(imageSize);
+    imageSize += run.size();
+  }
+  if (imageSize > std::numeric_limits<PointerSlot>::max() - kHeapImagePointerBias) {
+    throw errorstr("heap image would be too large: ", imageSize, " bytes");
+  }
+  auto encode = [&](uintptr_t p) -> uintptr_t {
+    if (p == 0 || p == kZeroAllocAddress) {
+      return p;
+    }
+    auto block = blockContaining(p);
+    auto i = blockIndex[block];
+    auto offset = runBegin[blockRun[i]] + blockPos[i] * image.runs[blockRun[i]].blockSize + (p - block);
+    return kHeapImagePointerBias + offset;
+  };
+  for (auto root : roots) {
+    image.roots.push_back(encode(root));
+  }
+
+  // Copy each block into its run, replacing pointers with image offsets.
+  // Blocks within a run are copied in order, so slots are listed in order.
+  std::vector<std::vector<uint8_t>> data(image.runs.size());
+  for (size_t r = 0; r < image.runs.size(); r++) {
+    data[r].resize(image.runs[r].size());
+    image.runs[r].data = data[r].data();
+  }
+  for (size_t i = 0; i < blocks.size(); i++) {
+    auto& run = image.runs[blockRun[i]];
+    auto copy = data[blockRun[i]].data() + blockPos[i] * run.blockSize;
+    memcpy(copy, reinterpret_cast<void*>(blocks[i]), run.blockSize);
+    auto encodeSlot = [&](uintptr_t slot) {
+      auto p = loadPointer(slot);
+      if (p == 0 || p == kZeroAllocAddress) {
+        return;
+      }
+      auto offset = slot - blocks[i];
+      *reinterpret_cast<PointerSlot*>(copy + offset) = static_cast<PointerSlot>(encode(p));
+      if (run.layout == nullptr) {
+        run.slots.push_back((blockPos[i] * run.blockSize + offset) / kPointerSize);
+      }
+    };
+    if (chunkCache_.reservation()->mayHoldChunk(blocks[i])) {
+      Chunk::fromAddress(blocks[i])->forEachPointerSlotInBlock(blocks[i], encodeSlot);
+    } else {
+      largeObjectContaining(blocks[i])->forEachPointerSlot(encodeSlot);
+    }
+  }
+  writeHeapImage(os, image);
+}
+
+std::vector<uintptr_t> Heap::loadImage(const HeapImage& image) {
+  // Check every pointer before anything is copied. A block left with an
+  // unrelocated pointer would crash the collector.
+  auto imageSize = image.size();
+  auto check = [imageSize](uintptr_t p) {
+    if (p != 0 && p != kZeroAllocAddress && (p < kHeapImagePointerBias || p - kHeapImagePointerBias >= imageSize)) {
+      throw errorstr("heap image has an invalid pointer: ", p);
+    }
+  };
+  auto checkSlot = [&check](uintptr_t slot) {
+    PointerSlot p;
+    memcpy(&p, reinterpret_cast<const void*>(slot), sizeof(p));
+    check(p);
+  };
+  for (auto root : image.roots) {
+    check(root);
+  }
+  for (auto& run : image.runs) {
+    auto data = reinterpret_cast<uintptr_t>(run.data);
+    if (run.layout != nullptr) {
+      for (uintptr_t i = 0; i < run.blockCount; i++) {
+        run.layout->forEachPointerSlot(data + i * run.blockSize, run.blockSize, checkSlot);
+      }
+    } else {
+      for (auto slot : run.slots) {
+        checkSlot(data + slot * kPointerSize);
+      }
+    }
+  }
+
+  std::lock_guard lock(mu_);
+  if (gcPhase_ == GCPhase::MARKING) {
+    finishMarkLocked();
+  }
+
+  // Copy each run into fresh chunks. Blocks allocated from a fresh chunk
+  // are contiguous, so each chunk's share of the run is one copy. groups
+  // holds the address of the first block in each chunk (or large object);
+  // every group but the last holds groupSize blocks.
+  struct Placement {
+    uintptr_t begin;
+    uintptr_t groupSize;
+    std::vector<uintptr_t> groups;
+
+    uintptr_t address(const HeapImageRun& run, uintptr_t offset) const {
+      auto index = offset / run.blockSize;
+      return groups[index / groupSize] + (index % groupSize) * run.blockSize + offset % run.blockSize;
+    }
+  };
+  std::vector<Placement> placements(image.runs.size());
+  uintptr_t begin = 0;
+  for (size_t r = 0; r < image.runs.size(); r++) {
+    auto& run = image.runs[r];
+    auto& placement = placements[r];
+    placement.begin = begin;
+    begin += run.size();
+    if (run.blockSize > kMaxBlockSize) {
+      placement.groupSize = 1;
+      for (uintptr_t i = 0; i < run.blockCount; i++) {
+        auto block = allocateLargeLocked(run.blockSize, run.layout);
+        memcpy(reinterpret_cast<void*>(block), run.data + i * run.blockSize, run.blockSize);
+        placement.groups.push_back(block);
+      }
+    } else {
+      auto& chunks = chunksByClass_[ChunkClass{run.blockSize, run.layout}];
+      for (uintptr_t copied = 0; copied < run.blockCount;) {
+        chunks.emplace_back(Chunk::create(run.blockSize, run.layout));
+        chunksAllocated_++;
+        auto chunk = chunks.back().get();
+        auto first = chunk->allocate();
+        uintptr_t n = 1;
+        while (copied + n < run.blockCount && chunk->allocate() != 0) {
+          n++;
+        }
+        memcpy(reinterpret_cast<void*>(first), run.data + copied * run.blockSize, n * run.blockSize);
+        if (placement.groups.empty()) {
+          placement.groupSize = n;
+        }
+        placement.groups.push_back(first);
+        copied += n;
+      }
+    }
+    bytesAllocated_ += run.size();
+    youngBytesAllocated_ += run.size();
+  }
+
+  // Relocate pointers. Typed blocks are relocated through their layouts,
+  // like the collector scans them. Untyped blocks list their pointer slots,
+  // which also need their pointer bits set.
+  auto relocate = [&](uintptr_t p) -> uintptr_t {
+    if (p == 0 || p == kZeroAllocAddress) {
+      return p;
+    }
+    auto offset = p - kHeapImagePointerBias;
+    auto it = std::upper_bound(placements.begin(), placements.end(), offset,
+                               [](uintptr_t offset, const Placement& p) { return offset < p.begin; });
+    auto r = it - placements.begin() - 1;
+    return placements[r].address(image.runs[r], offset - placements[r].begin);
+  };
+  auto relocateSlot = [&relocate](uintptr_t slot) {
+    storePointer(slot, relocate(*reinterpret_cast<PointerSlot*>(slot)));
+  };
+  for (size_t r = 0; r < image.runs.size(); r++) {
+    auto& run = image.runs[r];
+    auto& placement = placements[r];
+    if (run.layout != nullptr) {
+      for (size_t g = 0; g < placement.groups.size(); g++) {
+        auto count = std::min(placement.groupSize, run.blockCount - g * placement.groupSize);
+        for (uintptr_t i = 0; i < count; i++) {
+          run.layout->forEachPointerSlot(placement.groups[g] + i * run.blockSize, run.blockSize, relocateSlot);
+        }
+      }
+    } else {
+      for (auto slot : run.slots) {
+        auto addr = placement.address(run, slot * kPointerSize);
+        relocateSlot(addr);
+        setPointer(addr);
+      }
+    }
+  }
+
+  std::vector<uintptr_t> roots;
+  for (auto root : image.roots) {
+    roots.push_back(relocate(root));
+  }
+  return roots;
 }
 
 void Heap::validate() {
   std::lock_guard lock(mu_);
+  if (gcPhase_ == GCPhase::MARKING) {
+    finishMarkLocked();
+  }
+  finishSweepingLocked();
 
   // Completely mark the heap.
-  scanRootsLocked();
-  markLocked();
+  traceLocked();
 
   // Iterate over all blocks in all chunks.
   uintptr_t bytesAllocated = 0;
-  for (auto& sizes : chunksBySize_) {
-    for (auto& chunk : sizes.second) {
+  for (auto& cls : chunksByClass_) {
+    for (auto& chunk : cls.second) {
       chunk->validate();
       bytesAllocated += chunk->bytesAllocated();
     }
   }
+  for (auto& entry : largeObjects_) {
+    auto obj = entry.second;
+    obj->validate();
+    if (obj->isMarked()) {
+      bytesAllocated += obj->blockSize();
+    }
+  }
   ASSERT(bytesAllocated == bytesAllocated_);
 }
 
 bool Heap::isOnHeap(uintptr_t addr) {
-  for (auto& size : chunksBySize_) {
-    for (auto& chunk : size.second) {
-      if (Chunk::fromAddress(addr) == chunk.get()) {
-        return true;
+  auto reservation = chunkCache_.reservation();
+  if (reservation->contains(addr)) {
+    auto state = reservation->state(addr);
+    if (state != ChunkState::LARGE) {
+      return state == ChunkState::ACTIVE;
+    }
+  }
+  return largeObjectContaining(addr) != nullptr;
+}
+
+LargeObject* Heap::largeObjectContaining(uintptr_t addr) {
+  // With compressed pointers, large objects are interleaved with chunks in
+  // the cage, so the range check alone doesn't rule out many addresses.
+  if (kCompressedPointers && chunkCache_.reservation()->mayHoldChunk(addr)) {
+    return nullptr;
+  }
+  if (addr < largeObjectsBegin_.load(std::memory_order_relaxed) ||
+      addr >= largeObjectsEnd_.load(std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  std::shared_lock lock(largeObjectsMu_);
+  auto it = largeObjects_.upper_bound(addr);
+  if (it == largeObjects_.begin()) {
+    return nullptr;
+  }
+  --it;
+  return it->second->regionContains(addr) ? it->second : nullptr;
+}
+
+uintptr_t Heap::allocateLargeLocked(uintptr_t size, const Layout* layout) {
+  LargeObject* obj;
+  try {
+    obj = LargeObject::create(size, layout);
+  } catch (SystemAllocationError& err) {
+    throw AllocationError(false);
+  }
+
+  std::lock_guard lock(largeObjectsMu_);
+  auto begin = reinterpret_cast<uintptr_t>(obj);
+  largeObjects_.emplace(begin, obj);
+  if (begin < largeObjectsBegin_.load(std::memory_order_relaxed)) {
+    largeObjectsBegin_.store(begin, std::memory_order_relaxed);
+  }
+  if (obj->end() > largeObjectsEnd_.load(std::memory_order_relaxed)) {
+    largeObjectsEnd_.store(obj->end(), std::memory_order_relaxed);
+  }
+  return obj->block();
+}
+
+CardTableStats Heap::cardTableStats() {
+  std::lock_guard lock(mu_);
+  return cardTableStats_;
+}
+
+GCStats Heap::gcStats() {
+  std::lock_guard lock(mu_);
+  finishSweepingLocked();
+  GCStats stats;
+  stats.fullCount = fullCount_;
+  stats.youngCount = youngCount_;
+  stats.compactCount = compactCount_;
+  stats.totalPauseTime = totalPauseTime_;
+  stats.youngPauses = youngPauses_.summary();
+  stats.fullPauses = fullPauses_.summary();
+  stats.lastCycle = lastCycle_;
+  stats.bytesAllocated = bytesAllocated_;
+  stats.totalChunksAllocated = chunksAllocated_;
+  stats.totalChunksFreed = chunksFreed_;
+  for (auto& cls : chunksByClass_) {
+    if (cls.second.empty()) {
+      continue;
+    }
+    SizeClassStats c;
+    c.blockSize = cls.first.blockSize;
+    c.typed = cls.first.layout != nullptr;
+    c.chunkCount = cls.second.size();
+    for (auto& chunk : cls.second) {
+      c.bytesAllocated += chunk->bytesAllocated();
+    }
+    auto& geometry = cls.second.front()->geometry();
+    c.chunkSize = geometry.size;
+    c.capacity = c.chunkCount * geometry.dataSize();
+    c.metadataBytes = c.chunkCount * geometry.dataOffset;
+    c.wasteBytes = c.chunkCount * geometry.wasteSize();
+    stats.sizeClasses.push_back(c);
+  }
+  std::sort(stats.sizeClasses.begin(), stats.sizeClasses.end(), [](auto& a, auto& b) {
+    return a.blockSize != b.blockSize ? a.blockSize < b.blockSize : a.typed < b.typed;
+  });
+  for (auto& entry : largeObjects_) {
+    stats.largeObjectCount++;
+    stats.largeObjectBytes += entry.second->blockSize();
+  }
+  return stats;
+}
+
+void Heap::setGCEventListener(std::function<void(const GCCycleStats&)> listener) {
+  std::lock_guard lock(mu_);
+  gcEventListener_ = listener;
+}
+
+void Heap::setAllocationSampleInterval(uintptr_t interval) {
+  std::lock_guard lock(mu_);
+  allocationSampler_.setInterval(interval);
+}
+
+uintptr_t Heap::allocationSampleInterval() {
+  std::lock_guard lock(mu_);
+  return allocationSampler_.interval();
+}
+
+AllocationProfile Heap::allocationProfile() {
+  std::lock_guard lock(mu_);
+  return allocationSampler_.profile();
+}
+
+CompactionStats Heap::compact() {
+  std::lock_guard lock(mu_);
+  if (gcPhase_ == GCPhase::MARKING) {
+    finishMarkLocked();
+  }
+  return compactLocked();
+}
+
+CompactionStats Heap::compactLocked() {
+  CompactionStats stats;
+  if (gcLocked_) {
+    return stats;
+  }
+  ASSERT(gcPhase_ == GCPhase::NONE);
+  auto begin = std::chrono::steady_clock::now();
+  beginCycleLocked(GCKind::COMPACT);
+
+  // Mark the whole heap. Chunks holding blocks referenced by roots are
+  // pinned, since roots can't be updated.
+  auto sweepBegin = std::chrono::steady_clock::now();
+  clearMarksLocked();
+  cycle_.sweepTime += std::chrono::steady_clock::now() - sweepBegin;
+  std::unordered_set<Chunk*> pinned;
+  std::vector<RootSpan> spans;
+  rootSpansLocked(&spans);
+  forEachRoot(spans, [this, &pinned](uintptr_t p) {
+    if (largeObjectContaining(p) == nullptr) {
+      pinned.insert(Chunk::fromAddress(p));
+    }
+  });
+  traceLocked();
+
+  // Pick sparse, unpinned chunks. Only evacuate a size class if its blocks
+  // fit in fewer fresh chunks than they occupy now.
+  std::unordered_set<Chunk*> evacuated;
+  std::vector<std::unique_ptr<Chunk>> fresh;
+  for (auto& cls : chunksByClass_) {
+    std::vector<Chunk*> candidates;
+    uintptr_t liveBytes = 0;
+    for (auto& chunk : cls.second) {
+      auto bytes = chunk->markedBytes();
+      if (bytes > 0 && bytes < kEvacuationOccupancyThreshold * chunk->geometry().dataSize() &&
+          pinned.count(chunk.get()) == 0) {
+        candidates.push_back(chunk.get());
+        liveBytes += bytes;
+      }
+    }
+    auto blockSize = cls.first.blockSize;
+    auto blocksPerChunk = ChunkGeometry::forBlockSize(blockSize).blockCount;
+    auto freshCount = (liveBytes / blockSize + blocksPerChunk - 1) / blocksPerChunk;
+    if (freshCount >= candidates.size()) {
+      continue;
+    }
+
+    // Copy each live block and its pointer bits into a fresh chunk, then
+    // leave the new address in the old block's first word. Fresh chunks
+    // have the same layout, so typed blocks' pointer bits are already set.
+    Chunk* to = nullptr;
+    for (auto from : candidates) {
+      evacuated.insert(from);
+      std::vector<uintptr_t> blocks;
+      from->forEachMarkedBlock([&blocks](uintptr_t block) { blocks.push_back(block); });
+      for (auto block : blocks) {
+        auto copy = to != nullptr ? to->allocate() : 0;
+        if (copy == 0) {
+          fresh.emplace_back(Chunk::create(blockSize, cls.first.layout));
+          chunksAllocated_++;
+          to = fresh.back().get();
+          copy = to->allocate();
+        }
+        memcpy(reinterpret_cast<void*>(copy), reinterpret_cast<void*>(block), blockSize);
+        if (to->layout() == nullptr) {
+          for (uintptr_t offset = 0; offset < blockSize; offset += kPointerSize) {
+            if (from->isPointer(block + offset)) {
+              to->setPointer(copy + offset);
+            }
+          }
+        }
+        to->setMarked(copy);
+        *reinterpret_cast<uintptr_t*>(block) = copy;
+        stats.blocksMoved++;
+      }
+    }
+  }
+  if (evacuated.empty()) {
+    sweepBegin = std::chrono::steady_clock::now();
+    sweepLocked();
+    cycle_.sweepTime += std::chrono::steady_clock::now() - sweepBegin;
+    updateAllocationLimitLocked();
+    youngBytesAllocated_ = 0;
+    endPauseLocked(begin);
+    endCycleLocked();
+    return stats;
+  }
+
+  // Update pointer slots in live blocks that point into evacuated chunks,
+  // keeping the offset of interior pointers. Blocks in fresh chunks have
+  // slots to update too, but blocks in evacuated chunks don't matter.
+  auto update = [&evacuated, &stats](uintptr_t slot) {
+    auto p = loadPointer(slot);
+    if (p == 0 || p == kZeroAllocAddress || heap->largeObjectContaining(p) != nullptr) {
+      return;
+    }
+    auto chunk = Chunk::fromAddress(p);
+    if (evacuated.count(chunk) == 0) {
+      return;
+    }
+    auto block = chunk->blockContaining(p);
+    storePointer(slot, *reinterpret_cast<uintptr_t*>(block) + (p - block));
+    stats.slotsUpdated++;
+  };
+  for (auto& chunk : fresh) {
+    chunk->forEachMarkedPointerSlot(update);
+  }
+  for (auto& cls : chunksByClass_) {
+    for (auto& chunk : cls.second) {
+      if (evacuated.count(chunk.get()) == 0) {
+        chunk->forEachMarkedPointerSlot(update);
       }
     }
   }
-  return false;
+  for (auto& entry : largeObjects_) {
+    if (entry.second->isMarked()) {
+      entry.second->forEachPointerSlot(update);
+    }
+  }
+
+  // Sampled blocks in evacuated chunks were moved, or they're dead if they
+  // weren't marked. The rest are checked by sweepLocked.
+  allocationSampler_.update([&evacuated](uintptr_t block) {
+    if (heap->largeObjectContaining(block) != nullptr || evacuated.count(Chunk::fromAddress(block)) == 0) {
+      return block;
+    }
+    return isMarked(block) ? *reinterpret_cast<uintptr_t*>(block) : 0;
+  });
+
+  // Free the evacuated chunks and add the fresh ones.
+  stats.chunksEvacuated = evacuated.size();
+  stats.chunksCreated = fresh.size();
+  for (auto& cls : chunksByClass_) {
+    cls.second.erase(std::remove_if(cls.second.begin(), cls.second.end(),
+                                    [&evacuated](auto& chunk) { return evacuated.count(chunk.get()) != 0; }),
+                     cls.second.end());
+  }
+  chunksFreed_ += evacuated.size();
+  for (auto& chunk : fresh) {
+    auto cls = ChunkClass{chunk->blockSize(), chunk->layout()};
+    chunksByClass_[cls].push_back(std::move(chunk));
+  }
+
+  // Everything live is marked, so the rest is an ordinary sweep. Cards
+  // may point to moved blocks, but all survivors are old now.
+  sweepBegin = std::chrono::steady_clock::now();
+  sweepLocked();
+  cycle_.sweepTime += std::chrono::steady_clock::now() - sweepBegin;
+  clearCardsLocked();
+  updateAllocationLimitLocked();
+  youngBytesAllocated_ = 0;
+  endPauseLocked(begin);
+  endCycleLocked();
+  return stats;
+}
+
+/**
+ * Allocation limit when neither the growth target nor the soft memory limit
+ * applies. allocate doubles the limit while marking, so this must not
+ * overflow when doubled.
+ */
+const uintptr_t kNoAllocationLimit = UINTPTR_MAX / 2;
+
+void Heap::updateAllocationLimitLocked() {
+  // Grow in proportion to live bytes, but not below a minimum, so small
+  // heaps aren't collected constantly.
+  auto live = bytesAllocated_;
+  auto limit = kNoAllocationLimit;
+  if (gcPercent_ >= 0) {
+    auto percent = static_cast<uintptr_t>(gcPercent_);
+    limit = std::max(live + live * percent / 100, kInitialAllocationLimit * percent / 100);
+  }
+
+  // Memory the process uses besides live blocks (bitmaps, fragmentation,
+  // cached chunks, native memory) isn't freed by collecting, so only the
+  // rest of the soft limit is available for the heap to grow into. Near
+  // the limit, this keeps collections frequent, but not continuous.
+  if (memoryLimit_ != 0) {
+    auto resident = residentMemorySize();
+    if (resident > memoryLimit_) {
+      chunkCache_.releaseCached();
+      resident = residentMemorySize();
+    }
+    auto overhead = resident > live ? resident - live : 0;
+    auto available = memoryLimit_ > overhead ? memoryLimit_ - overhead : 0;
+    auto minLimit = live + std::max(live / kMinHeadroomDivisor, kMinHeadroom);
+    limit = std::min(limit, std::max(available, minLimit));
+  }
+  allocationLimit_ = limit;
 }
 
 void Heap::collectGarbageLocked() {
+  if (gcLocked_) {
+    return;
+  }
   switch (gcPhase_) {
-    case GCPhase::LOCKED:
+    case GCPhase::MARKING:
+      UNREACHABLE();
+
+    case GCPhase::NONE: {
+      // Mark bits are sticky: blocks that survive a collection stay marked
+      // so minor collections can treat them as old. A full collection
+      // starts by clearing them so that everything is traced.
+      auto begin = std::chrono::steady_clock::now();
+      beginCycleLocked(GCKind::FULL);
+      clearMarksLocked();
+      auto traceBegin = std::chrono::steady_clock::now();
+      cycle_.sweepTime += traceBegin - begin;
+      traceLocked();
+      auto sweepBegin = std::chrono::steady_clock::now();
+      sweepLocked();
+      cycle_.sweepTime += std::chrono::steady_clock::now() - sweepBegin;
+      updateAllocationLimitLocked();
+      youngBytesAllocated_ = 0;
+      endPauseLocked(begin);
+      endCycleLocked();
+      break;
+    }
+  }
+}
+
+void Heap::collectYoungGarbageLocked() {
+  if (gcLocked_) {
+    return;
+  }
+  switch (gcPhase_) {
+    case GCPhase::MARKING:
+      // Blocks allocated while marking are already marked, and the whole
+      // heap will be swept when marking finishes.
       return;
 
-    case GCPhase::NONE:
-      scanRootsLocked();
-      markLocked();
+    case GCPhase::NONE: {
+      // Chunks left unswept by the last collection aren't touched by
+      // marking, but sweepLocked may free them.
+      auto begin = std::chrono::steady_clock::now();
+      beginCycleLocked(GCKind::YOUNG);
+      finishSweepingLocked();
+      auto scanBegin = std::chrono::steady_clock::now();
+      cycle_.sweepTime += scanBegin - begin;
+
+      // Old blocks are already marked, so marking only traces young blocks
+      // reachable from roots and dirty cards. Sweeping frees unmarked
+      // (young, unreachable) blocks. Survivors stay marked, which promotes
+      // them to the old generation in place. scanCardsLocked cleans the
+      // cards it scans, since all survivors are old afterward.
+      scanCardsLocked();
+      cycle_.rootScanTime += std::chrono::steady_clock::now() - scanBegin;
+      traceLocked();
+      auto sweepBegin = std::chrono::steady_clock::now();
       sweepLocked();
-      allocationLimit_ = 2 * bytesAllocated_;
+      cycle_.sweepTime += std::chrono::steady_clock::now() - sweepBegin;
+      youngBytesAllocated_ = 0;
+      endPauseLocked(begin);
+      endCycleLocked();
       break;
+    }
   }
 }
 
-void Heap::scanRootsLocked() {
-  auto visit = [this](uintptr_t p) {
-    if (!isMarked(p)) {
-      markStack_.push_back(p);
+void Heap::startMarkLocked() {
+  if (gcLocked_) {
+    return;
+  }
+  ASSERT(gcPhase_ == GCPhase::NONE);
+
+  // Clear mark bits and push the roots during a short pause. The marking
+  // thread or later allocations take it from there.
+  auto begin = std::chrono::steady_clock::now();
+  beginCycleLocked(GCKind::FULL);
+  cycle_.concurrent = true;
+  clearMarksLocked();
+  auto scanBegin = std::chrono::steady_clock::now();
+  cycle_.sweepTime += scanBegin - begin;
+  scanRootsLocked();
+  cycle_.rootScanTime += std::chrono::steady_clock::now() - scanBegin;
+  endPauseLocked(begin);
+  gcPhase_ = GCPhase::MARKING;
+  markerDone_ = false;
+  if (concurrentMarking_) {
+    if (!marker_.joinable()) {
+      marker_ = std::thread(&Heap::concurrentMarkLoop, this);
+    }
+    markerCv_.notify_one();
+  }
+}
+
+void Heap::finishMarkLocked() {
+  if (gcLocked_) {
+    return;
+  }
+  ASSERT(gcPhase_ == GCPhase::MARKING);
+  auto begin = std::chrono::steady_clock::now();
+
+  // Wait for the marking thread to finish its batch, then take whatever it
+  // didn't get to.
+  {
+    std::lock_guard markerLock(markerMu_);
+    markStack_.takeAll(&markerStack_);
+  }
+
+  // Remark: roots aren't covered by the write barrier, so rescan them, then
+  // finish marking from anything the barrier or the roots turned up. Blocks
+  // allocated since marking started are already marked.
+  traceLocked();
+  auto sweepBegin = std::chrono::steady_clock::now();
+  sweepLocked();
+  cycle_.sweepTime += std::chrono::steady_clock::now() - sweepBegin;
+  clearCardsLocked();
+  updateAllocationLimitLocked();
+  youngBytesAllocated_ = 0;
+  gcPhase_ = GCPhase::NONE;
+  markerDone_ = false;
+  endPauseLocked(begin);
+  endCycleLocked();
+}
+
+template <class Visit>
+uintptr_t Heap::scanBlock(uintptr_t p, Visit visit) {
+  // Check the reservation first: it's cheaper than the large object
+  // registry, and most blocks are on chunks.
+  auto visitSlot = [&visit](uintptr_t slot) {
+    auto q = loadPointer(slot);
+    if (q != 0 && q != kZeroAllocAddress) {
+      visit(q);
     }
   };
-  for (auto& accept : rootAcceptors_) {
-    accept(visit);
+  if (chunkCache_.reservation()->mayHoldChunk(p)) {
+    auto chunk = Chunk::fromAddress(p);
+    auto begin = chunk->blockContaining(p);
+    if (chunk->testAndSetMarked(begin)) {
+      return 0;
+    }
+    chunk->forEachPointerSlotInBlock(begin, visitSlot);
+    return chunk->blockSize();
+  }
+
+  auto obj = largeObjectContaining(p);
+  ASSERT(obj != nullptr);
+  if (obj->testAndSetMarked()) {
+    return 0;
+  }
+  obj->forEachPointerSlot(visitSlot);
+  return obj->blockSize();
+}
+
+void Heap::concurrentMarkLoop() {
+  std::unique_lock lock(mu_);
+  while (true) {
+    markerCv_.wait(lock, [this] { return markerStop_ || (gcPhase_ == GCPhase::MARKING && !markStack_.empty()); });
+    if (markerStop_) {
+      return;
+    }
+
+    // Take a batch of work, then scan it without holding the heap lock.
+    // markerMu_ is acquired before mu_ is released so that
+    // finishMarkLocked can't miss blocks in the batch.
+    std::unique_lock markerLock(markerMu_);
+    for (size_t i = 0; i < kConcurrentMarkBatchSize && !markStack_.empty(); i++) {
+      markerStack_.push(markStack_.pop());
+    }
+    lock.unlock();
+    markConcurrently();
+    markerLock.unlock();
+
+    // Return anything left over to the shared mark stack.
+    lock.lock();
+    markerLock.lock();
+    markStack_.takeAll(&markerStack_);
+    markerLock.unlock();
+    if (gcPhase_ == GCPhase::MARKING && markStack_.empty()) {
+      markerDone_ = true;
+    }
+  }
+}
+
+void Heap::markConcurrently() {
+  // The program is running, so slots may be written while they're scanned.
+  // Either the old or the new value is fine: the new value was pushed by
+  // the write barrier.
+  auto visit = [this](uintptr_t q) { markerStack_.push(q); };
+  for (size_t n = 0; n < kConcurrentMarkBatchSize && !markerStack_.empty();) {
+    if (scanBlock(markerStack_.pop(), visit) != 0) {
+      n++;
+    }
+  }
+}
+
+void Heap::scanRootsLocked() {
+  // Roots are pushed without checking their mark bits: that takes each
+  // chunk's lock, and scanBlock skips marked blocks anyway.
+  std::vector<RootSpan> spans;
+  rootSpansLocked(&spans);
+  forEachRoot(spans, [this](uintptr_t p) { markStack_.push(p); });
+}
+
+void Heap::scanCardsLocked() {
+  auto begin = std::chrono::steady_clock::now();
+  CardTableStats stats;
+  std::vector<uintptr_t> slots;
+  for (auto& chunks : chunksByClass_) {
+    for (auto& chunk : chunks.second) {
+      stats.cardCount += chunk->geometry().cardCount();
+      stats.dirtyCardCount += chunk->scanDirtyCards(&slots);
+    }
+  }
+  for (auto& entry : largeObjects_) {
+    auto obj = entry.second;
+    stats.cardCount += obj->cardCount();
+    if (obj->isMarked()) {
+      stats.dirtyCardCount += obj->scanDirtyCards(&slots);
+    } else {
+      obj->clearCards();
+    }
+  }
+  for (auto slot : slots) {
+    auto p = loadPointer(slot);
+    if (p != 0 && p != kZeroAllocAddress && !isMarked(blockContaining(p))) {
+      markStack_.push(p);
+    }
+  }
+  stats.slotCount = slots.size();
+  stats.scanTime = std::chrono::steady_clock::now() - begin;
+  cardTableStats_ = stats;
+}
+
+void Heap::traceLocked() {
+  if (gcWorkerCount_ > 1) {
+    markParallelLocked();
+  } else {
+    auto begin = std::chrono::steady_clock::now();
+    scanRootsLocked();
+    auto markBegin = std::chrono::steady_clock::now();
+    markLocked();
+    cycle_.rootScanTime += markBegin - begin;
+    cycle_.markTime += std::chrono::steady_clock::now() - markBegin;
   }
 }
 
 void Heap::markLocked() {
   while (!markStack_.empty()) {
-    auto slot = markStack_.back();
-    markStack_.pop_back();
-    auto begin = blockContaining(slot);
-    auto end = begin + blockSize(begin);
-    setMarked(begin);
-    for (auto slot = begin; slot < end; slot += kWordSize) {
-      if (isPointer(slot)) {
-        auto p = *reinterpret_cast<uintptr_t*>(slot);
-        if (!isMarked(p)) {
-          markStack_.push_back(p);
+    markBlockLocked(markStack_.pop());
+  }
+}
+
+bool Heap::markIncrementalLocked(uintptr_t bytes) {
+  // Reading the clock isn't free, so only check it every few blocks.
+  const int kBlocksPerClockCheck = 32;
+  auto deadline = std::chrono::steady_clock::now() + kIncrementalMarkSliceTime;
+  uintptr_t scanned = 0;
+  for (int n = 1; !markStack_.empty(); n++) {
+    scanned += markBlockLocked(markStack_.pop());
+    if (scanned >= bytes ||
+        (n % kBlocksPerClockCheck == 0 && std::chrono::steady_clock::now() >= deadline)) {
+      break;
+    }
+  }
+  return markStack_.empty();
+}
+
+uintptr_t Heap::markBlockLocked(uintptr_t p) {
+  return scanBlock(p, [this](uintptr_t q) { markStack_.push(q); });
+}
+
+GCWorkerPool* Heap::gcWorkersLocked() {
+  if (!gcWorkers_ || gcWorkers_->count() != gcWorkerCount_) {
+    gcWorkers_.reset(new GCWorkerPool(gcWorkerCount_));
+  }
+  return gcWorkers_.get();
+}
+
+void Heap::markParallelLocked() {
+  auto pool = gcWorkersLocked();
+  auto n = pool->count();
+
+  // Each worker has its own mark stack. Addresses already on markStack_
+  // (for example, from dirty cards) go to worker 0. Other workers steal them.
+  std::vector<std::unique_ptr<WorkStealingQueue<uintptr_t>>> queues;
+  for (size_t i = 0; i < n; i++) {
+    queues.emplace_back(new WorkStealingQueue<uintptr_t>);
+  }
+  while (!markStack_.empty()) {
+    queues[0]->push(markStack_.pop());
+  }
+
+  // Root spans are partitioned across workers.
+  std::atomic<size_t> idleCount{0};
+  std::vector<std::chrono::nanoseconds> rootScanTimes(n);
+  auto begin = std::chrono::steady_clock::now();
+  std::vector<RootSpan> spans;
+  rootSpansLocked(&spans);
+  std::vector<std::vector<RootSpan>> workerSpans(n);
+  for (size_t i = 0; i < spans.size(); i++) {
+    workerSpans[i % n].push_back(spans[i]);
+  }
+  gcWorkers_->run([this, n, &queues, &idleCount, &rootScanTimes, &workerSpans](size_t index) {
+    auto& queue = *queues[index];
+
+    auto scanBegin = std::chrono::steady_clock::now();
+    forEachRoot(workerSpans[index], [&queue](uintptr_t p) { queue.push(p); });
+    rootScanTimes[index] = std::chrono::steady_clock::now() - scanBegin;
+
+    while (true) {
+      // Take work from our own stack first, then try to steal from others.
+      uintptr_t p;
+      auto found = queue.pop(&p);
+      for (size_t i = 1; !found && i < n; i++) {
+        found = queues[(index + i) % n]->steal(&p);
+      }
+      if (found) {
+        // Whichever worker sets the mark bit first scans the block.
+        scanBlock(p, [&queue](uintptr_t q) { queue.push(q); });
+        continue;
+      }
+
+      // No work found. Marking is done when all workers are idle: an idle
+      // worker's stack is empty, and only its owner can push to it.
+      idleCount++;
+      while (true) {
+        if (idleCount.load() == n) {
+          return;
+        }
+        auto hasWork = false;
+        for (size_t i = 0; !hasWork && i < n; i++) {
+          hasWork = !queues[i]->empty();
+        }
+        if (hasWork) {
+          idleCount--;
+          break;
         }
+        std::this_thread::yield();
       }
     }
+  });
+
+  // Workers scan roots at the same time, so the slowest one bounds how long
+  // root scanning held up marking.
+  auto total = std::chrono::steady_clock::now() - begin;
+  auto rootScanTime = *std::max_element(rootScanTimes.begin(), rootScanTimes.end());
+  cycle_.rootScanTime += rootScanTime;
+  cycle_.markTime += total - rootScanTime;
+}
+
+void Heap::beginCycleLocked(GCKind kind) {
+  cycle_ = GCCycleStats();
+  cycle_.kind = kind;
+  cycle_.startTime = std::chrono::steady_clock::now() - createTime_;
+  cycle_.bytesBefore = bytesAllocated_;
+}
+
+void Heap::endPauseLocked(std::chrono::steady_clock::time_point begin) {
+  std::chrono::nanoseconds pause = std::chrono::steady_clock::now() - begin;
+  cycle_.pauseTime += pause;
+  totalPauseTime_ += pause;
+  if (cycle_.kind == GCKind::YOUNG) {
+    youngPauses_.record(pause);
+  } else {
+    fullPauses_.record(pause);
+  }
+}
+
+void Heap::endCycleLocked() {
+  cycle_.bytesAfter = bytesAllocated_;
+  for (auto& cls : chunksByClass_) {
+    if (!cls.second.empty()) {
+      cycle_.heapBytes += cls.second.size() * cls.second.front()->geometry().dataSize();
+    }
+  }
+  for (auto& entry : largeObjects_) {
+    cycle_.heapBytes += entry.second->blockSize();
+  }
+  cycle_.chunksAllocated = chunksAllocated_ - chunksAllocatedAtLastCycle_;
+  cycle_.chunksFreed = chunksFreed_ - chunksFreedAtLastCycle_;
+  chunksAllocatedAtLastCycle_ = chunksAllocated_;
+  chunksFreedAtLastCycle_ = chunksFreed_;
+  cycle_.id = ++cycleCount_;
+  switch (cycle_.kind) {
+    case GCKind::FULL:
+      fullCount_++;
+      break;
+    case GCKind::YOUNG:
+      youngCount_++;
+      break;
+    case GCKind::COMPACT:
+      compactCount_++;
+      break;
+  }
+  lastCycle_ = cycle_;
+  if (gcEventListener_) {
+    gcEventListener_(lastCycle_);
   }
 }
 
 void Heap::sweepLocked() {
+  ASSERT(sweepQueue_.empty());
+
+  // Marking is done, so unmarked sampled blocks are dead. Check them before
+  // empty chunks and large objects are freed.
+  allocationSampler_.update([](uintptr_t block) { return isMarked(block) ? block : 0; });
+
+  // Count live bytes on each chunk. Garbage is cleaned out later, either
+  // when allocate needs a block from the chunk or by the background
+  // sweeper. Only live blocks are counted, so the sweeper doesn't need to
+  // report back. Each chunk has its own bitmaps, so workers can count
+  // chunks in parallel. Each worker keeps its own total.
+  std::vector<Chunk*> chunks;
+  for (auto& cls : chunksByClass_) {
+    for (auto& chunk : cls.second) {
+      chunks.push_back(chunk.get());
+    }
+  }
+  auto parallel = gcWorkerCount_ > 1 && chunks.size() > 1;
+  auto workerCount = parallel ? gcWorkersLocked()->count() : 1;
+  std::vector<uintptr_t> workerBytes(workerCount);
+  std::vector<uint8_t> empty(chunks.size());
+  auto count = [&](size_t worker, size_t i) {
+    auto bytes = chunks[i]->markedBytes();
+    if (bytes == 0) {
+      empty[i] = 1;
+    } else {
+      chunks[i]->setNeedsSweep();
+      workerBytes[worker] += bytes;
+    }
+  };
+  if (parallel) {
+    gcWorkers_->forEach(chunks.size(), count);
+  } else {
+    for (size_t i = 0; i < chunks.size(); i++) {
+      count(0, i);
+    }
+  }
   uintptr_t bytesAllocated = 0;
-  for (auto& chunks : chunksBySize_) {
-    // Free chunks with no blocks allocated.
-    std::remove_if(chunks.second.begin(), chunks.second.end(), [](auto& chunk) { return !chunk->hasMark(); });
+  for (auto bytes : workerBytes) {
+    bytesAllocated += bytes;
+  }
 
-    // Clean out garbage from remaining chunks.
-    for (auto& chunk : chunks.second) {
-      chunk->sweep();
-      bytesAllocated += chunk->bytesAllocated();
+  // Unmap large objects that weren't marked. This is cheap enough to do
+  // right away.
+  {
+    std::lock_guard lock(largeObjectsMu_);
+    for (auto it = largeObjects_.begin(); it != largeObjects_.end();) {
+      auto obj = it->second;
+      if (obj->isMarked()) {
+        bytesAllocated += obj->blockSize();
+        ++it;
+      } else {
+        LargeObject::destroy(obj);
+        it = largeObjects_.erase(it);
+      }
     }
   }
   bytesAllocated_ = bytesAllocated;
+
+  // Free chunks with no blocks allocated. Chunks are visited in the same
+  // order as above.
+  size_t i = 0;
+  for (auto& flag : empty) {
+    chunksFreed_ += flag;
+  }
+  for (auto& cls : chunksByClass_) {
+    cls.second.erase(
+        std::remove_if(cls.second.begin(), cls.second.end(), [&](auto&) { return empty[i++] != 0; }),
+        cls.second.end());
+    for (auto& chunk : cls.second) {
+      sweepQueue_.push_back(chunk.get());
+    }
+  }
+
+  if (!sweepQueue_.empty()) {
+    if (!sweeper_.joinable()) {
+      sweeper_ = std::thread(&Heap::backgroundSweepLoop, this);
+    }
+    sweeperCv_.notify_one();
+  }
+}
+
+void Heap::finishSweepingLocked() {
+  std::lock_guard sweeperLock(sweeperMu_);
+  auto sweep = [this](size_t, size_t i) { sweepQueue_[i]->sweepIfNeeded(); };
+  if (gcWorkerCount_ > 1 && sweepQueue_.size() > 1) {
+    gcWorkersLocked()->forEach(sweepQueue_.size(), sweep);
+  } else {
+    for (size_t i = 0; i < sweepQueue_.size(); i++) {
+      sweep(0, i);
+    }
+  }
+  sweepQueue_.clear();
+}
+
+void Heap::backgroundSweepLoop() {
+  std::unique_lock lock(mu_);
+  while (true) {
+    sweeperCv_.wait(lock, [this] { return sweeperStop_ || !sweepQueue_.empty(); });
+    if (sweeperStop_) {
+      return;
+    }
+
+    // Take a chunk and sweep it without holding the heap lock. sweeperMu_
+    // is acquired before mu_ is released, so finishSweepingLocked waits
+    // for the chunk to be swept before any chunk can be freed.
+    std::unique_lock sweeperLock(sweeperMu_);
+    auto chunk = sweepQueue_.back();
+    sweepQueue_.pop_back();
+    lock.unlock();
+    chunk->sweepIfNeeded();
+    sweeperLock.unlock();
+    lock.lock();
+  }
+}
+
+void Heap::clearCardsLocked() {
+  for (auto& chunks : chunksByClass_) {
+    for (auto& chunk : chunks.second) {
+      chunk->clearCards();
+    }
+  }
+  for (auto& entry : largeObjects_) {
+    entry.second->clearCards();
+  }
+}
+
+void Heap::clearMarksLocked() {
+  // Unswept chunks rely on mark bits to tell live blocks from garbage.
+  finishSweepingLocked();
+
+  // Chunk mark bits are cleared lazily when each chunk is next accessed.
+  // Chunks where nothing is marked again are freed by sweepLocked without
+  // their bitmaps being touched.
+  Chunk::advanceMarkEpoch();
+
+  // Cards only need to track pointers from old blocks. After clearing mark
+  // bits, there are no old blocks.
+  for (auto& chunks : chunksByClass_) {
+    for (auto& chunk : chunks.second) {
+      chunk->clearCards();
+    }
+  }
+  for (auto& entry : largeObjects_) {
+    entry.second->clearMark();
+    entry.second->clearCards();
+  }
 }
 
 }  // namespace codeswitch
@@ -6,14 +6,30 @@
 #ifndef memory_heap_h
 #define memory_heap_h
 
-#include <deque>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
+#include "allocprofile.h"
 #include "chunk.h"
+#include "chunkcache.h"
 #include "common/common.h"
+#include "gcstats.h"
+#include "gcworkers.h"
+#include "heapimage.h"
+#include "heapsnapshot.h"
+#include "rootset.h"
+#include "largeobject.h"
+#include "layout.h"
+#include "markstack.h"
 
 namespace codeswitch {
 
@@ -26,9 +42,70 @@ const uintptr_t kMinAddress = 1 << 20;
 /** Address returned when a 0-byte allocation is requested. */
 const uintptr_t kZeroAllocAddress = kMinAddress;
 
-/** Initial allocation threshold for triggering the garbage collector. */
+static_assert(kZeroAllocAddress < kCageGuardSize, "compressed pointers can't hold kZeroAllocAddress");
+
+/**
+ * Maximum number of GC worker threads used by default. More may be requested
+ * with Heap::setGCWorkerCount.
+ */
+const size_t kMaxDefaultGCWorkerCount = 8;
+
+/**
+ * Initial allocation threshold for triggering the garbage collector. The
+ * pacer never sets the threshold lower than this, scaled by the GC percent,
+ * so small heaps aren't collected constantly.
+ */
 const uintptr_t kInitialAllocationLimit = 1 * MB;
 
+/**
+ * Default growth target for the pacer: a full collection is triggered when
+ * the heap has grown by this percentage over the bytes live after the last
+ * one. See Heap::setGCPercent.
+ */
+const int kDefaultGCPercent = 100;
+
+/**
+ * If the process is in a cgroup with a memory limit, the heap's default
+ * soft memory limit is this fraction of it. The rest is left for memory the
+ * heap doesn't manage.
+ */
+const double kCgroupMemoryLimitRatio = 0.9;
+
+/**
+ * Minimum room for growth the pacer leaves above live bytes when a soft
+ * memory limit is set, as a fraction of live bytes, and in absolute terms.
+ * Without this, a heap whose live bytes approach the limit would be
+ * collected on nearly every allocation.
+ */
+const uintptr_t kMinHeadroomDivisor = 16;
+const uintptr_t kMinHeadroom = 256 * KB;
+
+/**
+ * Number of bytes that may be allocated in the young generation before a
+ * minor collection is triggered.
+ */
+const uintptr_t kYoungAllocationLimit = 256 * KB;
+
+/**
+ * Maximum number of blocks the concurrent marking thread scans before
+ * checking in with the heap. This bounds how long the remark pause waits for
+ * the marking thread to stop.
+ */
+const size_t kConcurrentMarkBatchSize = 1024;
+
+/**
+ * When marking incrementally, each allocation scans blocks totaling at least
+ * this many times the size of the allocated block. This must be more than 1
+ * so marking finishes before the heap grows too much.
+ */
+const uintptr_t kIncrementalMarkRatio = 4;
+
+/**
+ * Maximum time an allocation may spend marking incrementally. The slice may
+ * run slightly over, since the clock is checked every few blocks.
+ */
+const std::chrono::microseconds kIncrementalMarkSliceTime(100);
+
 /**
  * Thrown when memory can't be allocated from the heap. Has a flag that
  * indicates whether allocation should be re-attempted after garbage collection.
@@ -51,19 +128,84 @@ class BoundsCheckError : public std::exception {
   virtual const char* what() const noexcept override { return "bounds check error"; }
 };
 
+/**
+ * Statistics about the most recent card table scan, performed at the
+ * beginning of each minor collection. Used to tune kCardSize.
+ */
+struct CardTableStats {
+  /** Total number of cards in all chunks. */
+  uintptr_t cardCount = 0;
+
+  /** Number of cards dirtied by the write barrier since the last collection. */
+  uintptr_t dirtyCardCount = 0;
+
+  /** Number of pointer slots in old blocks found within dirty cards. */
+  uintptr_t slotCount = 0;
+
+  /** Time spent scanning card tables. */
+  std::chrono::nanoseconds scanTime{0};
+
+  double dirtyRatio() const { return cardCount == 0 ? 0.0 : static_cast<double>(dirtyCardCount) / cardCount; }
+};
+
+/**
+ * Chunks with less than this fraction of their data section occupied by
+ * live blocks are candidates for evacuation by Heap::compact.
+ */
+const double kEvacuationOccupancyThreshold = 0.25;
+
+/** Results of the most recent call to Heap::compact. */
+struct CompactionStats {
+  /** Number of chunks whose live blocks were moved. These chunks are freed. */
+  uintptr_t chunksEvacuated = 0;
+
+  /** Number of fresh chunks the blocks were moved into. */
+  uintptr_t chunksCreated = 0;
+
+  /** Number of live blocks moved. */
+  uintptr_t blocksMoved = 0;
+
+  /** Number of pointer slots updated to point to moved blocks. */
+  uintptr_t slotsUpdated = 0;
+};
+
+/**
+ * Identifies a list of chunks in the heap. Every block in these chunks has
+ * the same size and layout.
+ */
+struct ChunkClass {
+  uintptr_t blockSize;
+  const Layout* layout;
+
+  bool operator==(const ChunkClass& other) const { return blockSize == other.blockSize && layout == other.layout; }
+};
+
+struct ChunkClassHash {
+  size_t operator()(const ChunkClass& c) const {
+    return std::hash<uintptr_t>()(c.blockSize) ^ std::hash<const Layout*>()(c.layout);
+  }
+};
+
 class Heap {
  public:
   NON_COPYABLE(Heap)
 
-  Heap() {}
+  Heap();
+  ~Heap();
 
   /**
    * Allocates a zero-initialized block of memory of the given size.
+   * Blocks larger than kMaxBlockSize are allocated in their own mapped
+   * regions (see LargeObject).
+   *
+   * If layout is not nullptr, the block holds elements described by it
+   * (see layoutOf), and it's allocated from a chunk typed with that layout.
+   * Pointers may only be stored in slots the layout says are pointers.
    *
    * @returns uintptr_t of the allocated memory.
    * @throws AllocationError if the block couldn't be allocated.
    */
-  void* allocate(uintptr_t size);
+  void* allocate(uintptr_t size, const Layout* layout = nullptr);
 
   /**
    * Notifies the garbage collector that a pointer was written into a block.
@@ -85,10 +227,17 @@ class Heap {
   static void setPointer(uintptr_t addr);
   static bool isMarked(uintptr_t addr);
   static void setMarked(uintptr_t addr);
+  static bool testAndSetMarked(uintptr_t addr);
 
   /** Reclaim memory used by blocks that are no longer reachable. */
   void collectGarbage();
 
+  /**
+   * Reclaim memory used by young blocks that are no longer reachable. Old
+   * blocks are not traced or freed.
+   */
+  void collectYoungGarbage();
+
   /**
    * Prevent (or allow) garbage collection. This shouldn't be used often, but
    * it may be useful when performing a sequence of unsafe allocations.
@@ -96,11 +245,104 @@ class Heap {
   void setGCLock(bool locked);
 
   /**
-   * Registers an "accept" function that may be called with a "visit" function.
-   * The "accept" function should call the "visit" function on a set of
-   * addresses that point into the heap, forming the roots of the pointer graph.
+   * Sets the number of threads used to mark the heap, including the thread
+   * that triggered the collection. With a count of 1, marking is done
+   * sequentially on that thread.
+   */
+  void setGCWorkerCount(size_t count);
+  size_t gcWorkerCount();
+
+  /**
+   * Enables or disables concurrent marking. When enabled, a full collection
+   * triggered by allocation marks the heap on a background thread while the
+   * program keeps running. Blocks allocated while marking are marked
+   * immediately, and recordWrite marks blocks written into the heap. The
+   * collection finishes with a short pause that rescans roots.
+   */
+  void setConcurrentMarking(bool enabled);
+
+  /**
+   * Enables or disables incremental marking. When enabled, a full collection
+   * triggered by allocation is spread across later allocations, each of which
+   * marks a bounded number of blocks (see kIncrementalMarkRatio and
+   * kIncrementalMarkSliceTime). recordWrite keeps newly stored blocks from
+   * being missed. Concurrent marking takes precedence if both are enabled.
+   */
+  void setIncrementalMarking(bool enabled);
+
+  /**
+   * Enables or disables lazy zeroing. When enabled, sweeping leaves dead
+   * blocks as they are, and each block is zeroed when it's allocated
+   * instead. This shortens the pauses that finish sweeping at the cost of
+   * slower allocation. See Chunk::setLazyZeroing.
    */
-  void registerRoots(std::function<void(std::function<void(uintptr_t)>)> accept);
+  void setLazyZeroing(bool enabled);
+
+  /**
+   * Sets the pacer's growth target. After a full collection, the next one
+   * is triggered when bytes allocated reach the live bytes plus this
+   * percentage of them. A negative value turns this off, so only the soft
+   * memory limit triggers full collections. Takes effect immediately.
+   */
+  void setGCPercent(int percent);
+  int gcPercent();
+
+  /**
+   * Sets a soft limit on the process's memory use in bytes, or 0 for no
+   * limit. As the resident set size approaches the limit, the pacer lowers
+   * the threshold for the next full collection, and cached chunks are
+   * returned to the kernel once it's exceeded. The heap may still grow past
+   * the limit if live bytes require it. Takes effect immediately.
+   *
+   * By default, the limit is derived from the memory limit of the process's
+   * cgroup, if there is one (see kCgroupMemoryLimitRatio).
+   */
+  void setMemoryLimit(uintptr_t bytes);
+  uintptr_t memoryLimit();
+
+  /**
+   * Returns the number of bytes that may be allocated before the next full
+   * collection is triggered, as set by the pacer.
+   */
+  uintptr_t allocationLimit();
+
+  /**
+   * Registers a set of slots holding pointers into the heap, forming the
+   * roots of the pointer graph. roots must stay alive as long as the heap.
+   * name identifies the roots in heap snapshots.
+   */
+  void registerRoots(RootSet* roots, const std::string& name = "");
+
+  /**
+   * Stops the world, collects garbage, then writes each live block with the
+   * blocks it points to, and each root with its source, in the format
+   * described in heapsnapshot.h. Blocks are streamed as they're found.
+   * Must not be called while garbage collection is locked, since marks
+   * are only exact after a collection.
+   */
+  void writeSnapshot(std::ostream& os);
+
+  /**
+   * Writes the blocks reachable from roots to an image in the format
+   * described in heapimage.h. The roots are written in order, and
+   * loadImage returns them relocated. Nothing reachable may be changed
+   * by another thread while this runs.
+   *
+   * @throws Error if the image would be too large for pointer slots.
+   */
+  void writeImage(std::ostream& os, const std::vector<uintptr_t>& roots);
+
+  /**
+   * Copies the blocks in an image onto the heap, relocates pointers between
+   * them, and returns the image's roots. Blocks are copied a chunk at a
+   * time into fresh chunks (or large objects), so this is much faster than
+   * allocating and filling them one by one. The blocks are only reachable
+   * through the returned addresses, so the caller must hold them in roots
+   * or handles before anything else is allocated.
+   *
+   * @throws Error if a pointer in the image is out of bounds.
+   */
+  std::vector<uintptr_t> loadImage(const HeapImage& image);
 
   /**
    * Completely marks the heap, then checks internal heap invariants.
@@ -110,24 +352,120 @@ class Heap {
 
   bool isOnHeap(uintptr_t addr);
 
+  /**
+   * Returns the large object whose region contains addr, or nullptr if addr
+   * isn't in a large object. The static block and bitmap methods above call
+   * this before assuming an address is in a chunk.
+   */
+  LargeObject* largeObjectContaining(uintptr_t addr);
+
+  /** Returns statistics from the most recent card table scan. */
+  CardTableStats cardTableStats();
+
+  /**
+   * Returns statistics about garbage collection since the heap was created,
+   * including the occupancy of each size class. Pending sweeping is
+   * finished first, so occupancy is exact.
+   */
+  GCStats gcStats();
+
+  /**
+   * Sets a function to be called with the statistics of each garbage
+   * collection cycle when it finishes. An empty function clears it. The
+   * listener is called with the heap locked, so it must not use the heap.
+   */
+  void setGCEventListener(std::function<void(const GCCycleStats&)> listener);
+
+  /**
+   * Sets the average number of bytes allocated between samples in the
+   * allocation profile. 0 turns sampling off. Samples already taken are
+   * discarded.
+   */
+  void setAllocationSampleInterval(uintptr_t interval);
+  uintptr_t allocationSampleInterval();
+
+  /**
+   * Returns sampled allocations grouped by site, with how many of them were
+   * live after the most recent collection. Write it with writeHeapProfile.
+   */
+  AllocationProfile allocationProfile();
+
+  /**
+   * Returns the cache that chunks are allocated from and freed into. Use it
+   * to check RSS and mmap counts or to change the release delay.
+   */
+  ChunkCache* chunkCache() { return &chunkCache_; }
+
+  /**
+   * Performs a full collection that also moves live blocks out of sparsely
+   * occupied chunks (see kEvacuationOccupancyThreshold) into fresh chunks,
+   * then frees the sparse chunks. Pointer slots in other blocks are updated
+   * using the pointer bitmaps.
+   *
+   * Roots are reported by value and can't be updated, so chunks holding
+   * blocks referenced by roots are pinned and never evacuated. Native code
+   * may also hold raw pointers to blocks that aren't roots, so this must
+   * only be called at points where no such pointers are live. The heap
+   * never calls it on its own.
+   */
+  CompactionStats compact();
+
  private:
+  uintptr_t allocateLargeLocked(uintptr_t size, const Layout* layout);
+  void updateAllocationLimitLocked();
+  void beginCycleLocked(GCKind kind);
+  void endPauseLocked(std::chrono::steady_clock::time_point begin);
+  void endCycleLocked();
   void collectGarbageLocked();
+  void collectYoungGarbageLocked();
+  CompactionStats compactLocked();
+  void startMarkLocked();
+  void finishMarkLocked();
+  void concurrentMarkLoop();
+  void markConcurrently();
+  void rootSpansLocked(std::vector<RootSpan>* spans);
   void scanRootsLocked();
+  void scanCardsLocked();
+  void traceLocked();
   void markLocked();
+  bool markIncrementalLocked(uintptr_t bytes);
+  uintptr_t markBlockLocked(uintptr_t p);
+
+  /**
+   * Marks the block containing p if it isn't marked yet, then calls visit
+   * with each non-zero pointer stored in the block and returns the block's
+   * size. Returns 0 if the block was already marked. This doesn't lock
+   * anything: mark bits are set atomically, and the pointer bitmap is read
+   * a word at a time, so GC workers and the marking thread may call it.
+   */
+  template <class Visit>
+  uintptr_t scanBlock(uintptr_t p, Visit visit);
+  void markParallelLocked();
+  GCWorkerPool* gcWorkersLocked();
   void sweepLocked();
+  void clearMarksLocked();
+  void finishSweepingLocked();
+  void backgroundSweepLoop();
+  void clearCardsLocked();
 
   enum class GCPhase : int {
     NONE,
-    LOCKED,
+    MARKING,
   };
 
   std::mutex mu_;
 
   /**
-   * Maps allocation sizes to lists of chunks holding blocks of those sizes.
-   * Every block in a chunk has the same size.
+   * Memory for freed chunks, kept for reuse. Declared before chunksByClass_
+   * so it's destroyed after the chunks are freed into it.
+   */
+  ChunkCache chunkCache_;
+
+  /**
+   * Maps block sizes and layouts to lists of chunks holding those blocks.
+   * Every block in a chunk has the same size and layout.
    */
-  std::unordered_map<size_t, std::vector<std::unique_ptr<Chunk>>> chunksBySize_;
+  std::unordered_map<ChunkClass, std::vector<std::unique_ptr<Chunk>>, ChunkClassHash> chunksByClass_;
 
   /**
    * Total number of bytes allocated in blocks on the heap. This only includes
@@ -139,24 +477,164 @@ class Heap {
   /**
    * When bytesAllocated_ exceeds this limit, collectGarbageLocked should
    * be called. That may perform part of an incremental collection, depending
-   * on the heap and GC state.
+   * on the heap and GC state. Set by updateAllocationLimitLocked after each
+   * full collection.
    */
   uintptr_t allocationLimit_ = kInitialAllocationLimit;
 
+  /** Growth target for the pacer. See setGCPercent. */
+  int gcPercent_ = kDefaultGCPercent;
+
+  /** Soft limit on resident memory in bytes, or 0. See setMemoryLimit. */
+  uintptr_t memoryLimit_ = 0;
+
+  /**
+   * Number of bytes allocated since the last collection. These blocks make up
+   * the young generation. When this exceeds kYoungAllocationLimit,
+   * collectYoungGarbageLocked should be called.
+   */
+  uintptr_t youngBytesAllocated_ = 0;
+
+  /** Statistics from the last call to scanCardsLocked. */
+  CardTableStats cardTableStats_;
+
   /**
-   * List of "accept" functions registered with registerRoots. scanRootsLocked
-   * calls these with a function that adds unmarked roots to markStack_.
+   * Statistics for the cycle in progress. Phase timings are added to it as
+   * each phase finishes. Copied to lastCycle_ by endCycleLocked.
    */
-  std::vector<std::function<void(std::function<void(uintptr_t)>)>> rootAcceptors_;
+  GCCycleStats cycle_;
+  GCCycleStats lastCycle_;
+  uint64_t cycleCount_ = 0;
+  uintptr_t fullCount_ = 0;
+  uintptr_t youngCount_ = 0;
+  uintptr_t compactCount_ = 0;
+  std::chrono::nanoseconds totalPauseTime_{0};
+  PauseWindow youngPauses_;
+  PauseWindow fullPauses_;
+
+  /** Time the heap was created. Cycle start times are relative to this. */
+  std::chrono::steady_clock::time_point createTime_ = std::chrono::steady_clock::now();
+
+  /** Number of chunks created and freed since the heap was created. */
+  uintptr_t chunksAllocated_ = 0;
+  uintptr_t chunksFreed_ = 0;
+
+  /** Values of chunksAllocated_ and chunksFreed_ when the last cycle ended. */
+  uintptr_t chunksAllocatedAtLastCycle_ = 0;
+  uintptr_t chunksFreedAtLastCycle_ = 0;
+
+  /** Called at the end of each cycle. See setGCEventListener. */
+  std::function<void(const GCCycleStats&)> gcEventListener_;
+
+  /** Samples allocations for allocationProfile. */
+  AllocationSampler allocationSampler_;
+
+  /** Root sets registered with registerRoots. */
+  std::vector<RootSet*> rootSets_;
+
+  /** Names of rootSets_, in the same order. */
+  std::vector<std::string> rootNames_;
 
   GCPhase gcPhase_ = GCPhase::NONE;
 
+  /**
+   * Set by setGCLock. While set, no collection may start or finish, though
+   * the concurrent marking thread may still make progress.
+   */
+  bool gcLocked_ = false;
+
+  /** Whether full collections should mark concurrently. */
+  bool concurrentMarking_ = false;
+
+  /** Whether full collections should mark incrementally during allocation. */
+  bool incrementalMarking_ = false;
+
+  /** Number of threads used for marking. See setGCWorkerCount. */
+  size_t gcWorkerCount_;
+
+  /**
+   * Threads used for parallel marking and sweeping. Created lazily by
+   * gcWorkersLocked with gcWorkerCount_ workers.
+   */
+  std::unique_ptr<GCWorkerPool> gcWorkers_;
+
   /**
    * Holds addresses on the heap that contain pointers to potentially unmarked
-   * blocks. recordWrite and scanRoots push pointers here. markIncremental
-   * pushes and pops pointers as it traverses the block graph.
+   * blocks. scanRootsLocked, scanCardsLocked, and recordWrite (while
+   * marking) push pointers here. markLocked and markIncrementalLocked push
+   * and pop pointers as they traverse the block graph.
+   */
+  MarkStack markStack_;
+
+  /**
+   * Background thread that marks the heap concurrently during the MARKING
+   * phase. Started lazily by startMarkLocked.
+   */
+  std::thread marker_;
+
+  /** Signaled when the marking thread may have work to do or should stop. */
+  std::condition_variable markerCv_;
+
+  /** Set to tell the marking thread to exit. */
+  bool markerStop_ = false;
+
+  /**
+   * Set by the marking thread when it found markStack_ empty after a batch.
+   * The next allocation finishes the collection.
+   */
+  bool markerDone_ = false;
+
+  /**
+   * markerMu_ is held by the marking thread while it scans a batch of
+   * blocks without holding mu_. It guards markerStack_. When both locks are
+   * needed, mu_ must be acquired first.
+   */
+  std::mutex markerMu_;
+
+  /**
+   * Registry of large objects, keyed by the address of each object's
+   * region. Guarded by largeObjectsMu_ rather than mu_, since GC workers
+   * and the marking thread look up objects without holding mu_. Objects
+   * are only added and removed while holding both.
+   */
+  std::map<uintptr_t, LargeObject*> largeObjects_;
+  std::shared_mutex largeObjectsMu_;
+
+  /**
+   * Lowest and highest addresses ever occupied by large objects. Addresses
+   * outside this range can't be in a large object, so most lookups don't
+   * need largeObjectsMu_.
+   */
+  std::atomic<uintptr_t> largeObjectsBegin_{UINTPTR_MAX};
+  std::atomic<uintptr_t> largeObjectsEnd_{0};
+
+  /** Blocks being scanned by the marking thread. */
+  MarkStack markerStack_;
+
+  /**
+   * Chunks flagged by sweepLocked that the background sweeper hasn't taken
+   * yet. Chunks in this list may already have been swept by allocate.
+   */
+  std::vector<Chunk*> sweepQueue_;
+
+  /**
+   * Background thread that sweeps chunks in sweepQueue_. Started lazily by
+   * sweepLocked.
+   */
+  std::thread sweeper_;
+
+  /** Signaled when chunks are added to sweepQueue_ or the sweeper should stop. */
+  std::condition_variable sweeperCv_;
+
+  /** Set to tell the sweeper thread to exit. */
+  bool sweeperStop_ = false;
+
+  /**
+   * sweeperMu_ is held by the sweeper thread while it sweeps a chunk
+   * without holding mu_. When both locks are needed, mu_ must be
+   * acquired first.
    */
-  std::deque<uintptr_t> markStack_;
+  std::mutex sweeperMu_;
 };
 
 extern Heap* heap;
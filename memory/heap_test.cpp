@@ -5,7 +5,19 @@
 
 #include "test/test.h"
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "chunkcache.h"
+#include "handle.h"
 #include "heap.h"
+#include "layout.h"
+#include "markstack.h"
+#include "ptr.h"
+#include "platform/platform.h"
 
 namespace codeswitch {
 
@@ -21,4 +33,659 @@ TEST(Allocate) {
   }
 }
 
+TEST(LargeObject) {
+  // A large block is zeroed and can be written through its pointer bitmap
+  // like any other block.
+  const uintptr_t kSize = 3 * MB + 8;
+  auto big = handle(reinterpret_cast<uintptr_t*>(heap->allocate(kSize)));
+  auto addr = reinterpret_cast<uintptr_t>(*big);
+  ASSERT_EQ(addr, Heap::blockContaining(addr + 2 * MB));
+  ASSERT_EQ(kSize, Heap::blockSize(addr));
+  ASSERT_EQ(0, (*big)[kSize / kWordSize - 1]);
+
+  // Store a small block at the end of the large block. It must survive
+  // both kinds of collection.
+  auto small = reinterpret_cast<uintptr_t>(heap->allocate(2 * kWordSize));
+  auto slot = reinterpret_cast<uintptr_t>(&(*big)[kSize / kWordSize - 1]);
+  storePointer(slot, small);
+  heap->recordWrite(slot, small);
+  heap->collectGarbage();
+  ASSERT_TRUE(Heap::isMarked(addr));
+  ASSERT_TRUE(Heap::isMarked(small));
+
+  // Unreachable large blocks are unmapped.
+  auto garbage = reinterpret_cast<uintptr_t>(heap->allocate(kSize));
+  ASSERT_TRUE(heap->isOnHeap(garbage));
+  heap->collectYoungGarbage();
+  ASSERT_FALSE(heap->isOnHeap(garbage));
+  heap->validate();
+}
+
+TEST(YoungCollection) {
+  // Allocate a block and promote it to the old generation.
+  auto old = handle(reinterpret_cast<uintptr_t*>(heap->allocate(2 * kWordSize)));
+  heap->collectGarbage();
+  ASSERT_TRUE(Heap::isMarked(reinterpret_cast<uintptr_t>(*old)));
+
+  // Store a pointer to a young block in the old block. The young block is
+  // only reachable through the dirty card.
+  auto young = reinterpret_cast<uintptr_t>(heap->allocate(2 * kWordSize));
+  auto slot = reinterpret_cast<uintptr_t>(&(*old)[1]);
+  storePointer(slot, young);
+  heap->recordWrite(slot, young);
+  auto garbage = reinterpret_cast<uintptr_t>(heap->allocate(2 * kWordSize));
+
+  heap->collectYoungGarbage();
+  ASSERT_TRUE(Heap::isMarked(young));
+  ASSERT_FALSE(Heap::isMarked(garbage));
+  ASSERT_EQ(young, loadPointer(slot));
+
+  auto stats = heap->cardTableStats();
+  ASSERT_TRUE(stats.dirtyCardCount >= 1);
+  ASSERT_TRUE(stats.slotCount >= 1);
+  ASSERT_TRUE(stats.dirtyRatio() > 0.0);
+}
+
+TEST(LazySweep) {
+  // Use an unusual size so both blocks are on their own chunk.
+  const uintptr_t kSize = 5000;
+  auto live = handle(reinterpret_cast<uintptr_t*>(heap->allocate(kSize)));
+  auto garbage = reinterpret_cast<uintptr_t*>(heap->allocate(kSize));
+  garbage[0] = 1;
+  heap->collectGarbage();
+
+  // The garbage block may or may not have been swept yet, but allocate
+  // must sweep the chunk before reusing it.
+  auto block = reinterpret_cast<uintptr_t*>(heap->allocate(kSize));
+  ASSERT_EQ(garbage, block);
+  ASSERT_EQ(0, block[0]);
+  ASSERT_TRUE(Heap::isMarked(reinterpret_cast<uintptr_t>(*live)));
+  heap->validate();
+}
+
+TEST(LazyZeroing) {
+  // With lazy zeroing, sweeping leaves dead blocks dirty. The one before
+  // the live block goes on the free list; the one after it joins the free
+  // space. Both must read as zero when they're allocated again.
+  heap->setLazyZeroing(true);
+  const uintptr_t kSize = 4040;
+  const uintptr_t kWords = kSize / kWordSize;
+  auto before = reinterpret_cast<uintptr_t*>(heap->allocate(kSize));
+  auto live = handle(reinterpret_cast<uintptr_t*>(heap->allocate(kSize)));
+  auto after = reinterpret_cast<uintptr_t*>(heap->allocate(kSize));
+  std::fill(before, before + kWords, 1);
+  std::fill(after, after + kWords, 1);
+  heap->collectGarbage();
+  heap->validate();
+
+  auto a = reinterpret_cast<uintptr_t*>(heap->allocate(kSize));
+  auto b = reinterpret_cast<uintptr_t*>(heap->allocate(kSize));
+  ASSERT_EQ(before, a);
+  ASSERT_EQ(after, b);
+  ASSERT_TRUE(std::all_of(a, a + kWords, [](uintptr_t w) { return w == 0; }));
+  ASSERT_TRUE(std::all_of(b, b + kWords, [](uintptr_t w) { return w == 0; }));
+  ASSERT_TRUE(Heap::isMarked(reinterpret_cast<uintptr_t>(*live)));
+  heap->validate();
+  heap->setLazyZeroing(false);
+}
+
+TEST(Compact) {
+  // Fill several chunks with blocks of an unusual size, keeping only every
+  // tenth block in a list. The list head is in a different size class, so
+  // the root doesn't pin any of these chunks.
+  const uintptr_t kSize = 392;
+  const int kBlockCount = 3 * ChunkGeometry::forBlockSize(kSize).blockCount;
+  auto root = handle(reinterpret_cast<uintptr_t*>(heap->allocate(2 * kWordSize)));
+  heap->setGCLock(true);
+  auto last = &(*root)[0];
+  int liveCount = 0;
+  for (int i = 0; i < kBlockCount; i++) {
+    auto block = reinterpret_cast<uintptr_t*>(heap->allocate(kSize));
+    if (i % 10 != 0) {
+      continue;
+    }
+    block[1] = i;
+    storePointer(reinterpret_cast<uintptr_t>(last), reinterpret_cast<uintptr_t>(block));
+    heap->recordWrite(reinterpret_cast<uintptr_t>(last), reinterpret_cast<uintptr_t>(block));
+    last = &block[0];
+    liveCount++;
+  }
+  heap->setGCLock(false);
+
+  auto stats = heap->compact();
+  ASSERT_TRUE(stats.chunksEvacuated >= 2);
+  ASSERT_TRUE(stats.chunksCreated < stats.chunksEvacuated);
+  ASSERT_EQ(static_cast<uintptr_t>(liveCount), stats.blocksMoved);
+  heap->validate();
+
+  // The list should be intact, in order.
+  int count = 0;
+  for (auto block = reinterpret_cast<uintptr_t*>(loadPointer(reinterpret_cast<uintptr_t>(*root))); block != nullptr;
+       block = reinterpret_cast<uintptr_t*>(loadPointer(reinterpret_cast<uintptr_t>(block)))) {
+    ASSERT_EQ(static_cast<uintptr_t>(count * 10), block[1]);
+    count++;
+  }
+  ASSERT_EQ(liveCount, count);
+}
+
+TEST(ChunkGeometry) {
+  // Every block size gets a chunk that doesn't waste much at the end.
+  for (auto size = kBlockAlignment; size <= kMaxBlockSize; size += kBlockAlignment) {
+    auto g = ChunkGeometry::forBlockSize(size);
+    ASSERT_TRUE(g.blockCount > 0);
+    ASSERT_TRUE(g.wasteSize() * kChunkWasteDivisor <= g.size);
+  }
+
+  // The largest blocks need chunks spanning several slots. Blocks in every
+  // slot are found from interior addresses and survive collection.
+  auto g = ChunkGeometry::forBlockSize(kMaxBlockSize);
+  ASSERT_TRUE(g.size > Chunk::kSize);
+  const uintptr_t kLastWord = kMaxBlockSize / kWordSize - 1;
+  std::deque<Handle<uintptr_t>> blocks;
+  for (uintptr_t i = 0; i < 2 * g.blockCount; i++) {
+    auto block = reinterpret_cast<uintptr_t*>(heap->allocate(kMaxBlockSize));
+    block[kLastWord] = i;
+    blocks.emplace_back(block);
+  }
+  heap->collectGarbage();
+  heap->validate();
+  for (uintptr_t i = 0; i < blocks.size(); i++) {
+    auto block = reinterpret_cast<uintptr_t>(*blocks[i]);
+    ASSERT_EQ(g.size, Chunk::fromAddress(block)->geometry().size);
+    ASSERT_EQ(block, Heap::blockContaining(block + kLastWord * kWordSize));
+    ASSERT_EQ(i, (*blocks[i])[kLastWord]);
+  }
+}
+
+TEST(ChunkCacheReuse) {
+  ChunkCache cache;
+  auto a = reinterpret_cast<uintptr_t*>(cache.allocate());
+  a[0] = 1;
+  a[Chunk::kSize / kWordSize - 1] = 1;
+  cache.free(a);
+
+  // Memory is reused and zeroed.
+  auto b = reinterpret_cast<uintptr_t*>(cache.allocate());
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(0, b[0]);
+  ASSERT_EQ(0, b[Chunk::kSize / kWordSize - 1]);
+  auto stats = cache.stats();
+  ASSERT_EQ(1, stats.mapCount);
+  ASSERT_EQ(1, stats.reuseCount);
+
+  // Idle chunks are released by the scavenger.
+  cache.setReleaseDelay(std::chrono::milliseconds(0));
+  cache.free(b);
+  for (int i = 0; i < 1000 && cache.stats().releasedCount == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  stats = cache.stats();
+  ASSERT_EQ(1, stats.cachedCount);
+  ASSERT_EQ(1, stats.releasedCount);
+}
+
+TEST(ChunkCacheHugePages) {
+  // Whether or not the kernel provides huge pages, chunks come in aligned
+  // groups and are zeroed.
+  ChunkCache cache;
+  cache.setHugePages(true);
+  auto a = reinterpret_cast<uintptr_t>(cache.allocate());
+  auto b = reinterpret_cast<uintptr_t>(cache.allocate());
+  ASSERT_TRUE(isAligned(std::min(a, b), kHugePageSize));
+  ASSERT_EQ(Chunk::kSize, std::max(a, b) - std::min(a, b));
+  ASSERT_EQ(0, *reinterpret_cast<uintptr_t*>(b));
+  auto stats = cache.stats();
+  ASSERT_EQ(1, stats.mapCount);
+  ASSERT_EQ(1, stats.hugePageGroupCount);
+  cache.free(reinterpret_cast<void*>(a));
+  cache.free(reinterpret_cast<void*>(b));
+}
+
+TEST(HeapReservation) {
+  // Chunks come from the reservation, and their states track whether
+  // they're in use.
+  ChunkCache cache;
+  auto reservation = cache.reservation();
+  auto a = reinterpret_cast<uintptr_t>(cache.allocate());
+  ASSERT_TRUE(reservation->contains(a));
+  ASSERT_TRUE(reservation->state(a) == ChunkState::ACTIVE);
+  cache.free(reinterpret_cast<void*>(a));
+  ASSERT_TRUE(reservation->state(a) == ChunkState::CACHED);
+
+  // Warm chunks are handed out before new ones are committed.
+  cache.prefault(2 * Chunk::kSize);
+  auto stats = cache.stats();
+  ASSERT_EQ(3, stats.mapCount);
+  ASSERT_EQ(3, stats.cachedCount);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_EQ(0, *reinterpret_cast<uintptr_t*>(cache.allocate()));
+  }
+  ASSERT_EQ(3, cache.stats().mapCount);
+
+  // The heap's membership check uses the states.
+  auto block = reinterpret_cast<uintptr_t>(heap->allocate(2 * kWordSize));
+  ASSERT_TRUE(heap->isOnHeap(block));
+  ASSERT_FALSE(heap->isOnHeap(heap->chunkCache()->reservation()->end()));
+  ASSERT_FALSE(heap->isOnHeap(reinterpret_cast<uintptr_t>(&cache)));
+}
+
+TEST(MarkStackSegments) {
+  // Every address comes back out, across segment boundaries and through
+  // the prefetch FIFO, even when pushes and pops are interleaved.
+  MarkStack stack;
+  const uintptr_t n = 3 * kMarkStackSegmentSize + 5;
+  for (uintptr_t i = 1; i <= n; i++) {
+    stack.push(i);
+  }
+  std::vector<uintptr_t> popped;
+  popped.push_back(stack.pop());
+  stack.push(n + 1);
+  ASSERT_EQ(n, stack.size());
+  MarkStack other;
+  other.takeAll(&stack);
+  ASSERT_TRUE(stack.empty());
+  while (!other.empty()) {
+    popped.push_back(other.pop());
+  }
+  std::sort(popped.begin(), popped.end());
+  ASSERT_EQ(n + 1, popped.size());
+  for (uintptr_t i = 0; i < popped.size(); i++) {
+    ASSERT_EQ(i + 1, popped[i]);
+  }
+}
+
+TEST(Pacer) {
+  auto memoryLimit = heap->memoryLimit();
+  heap->setMemoryLimit(0);
+
+  // A higher growth target allows more allocation before a full collection.
+  heap->collectGarbage();
+  heap->setGCPercent(100);
+  auto limit = heap->allocationLimit();
+  ASSERT_TRUE(limit >= kInitialAllocationLimit);
+  heap->setGCPercent(300);
+  ASSERT_TRUE(heap->allocationLimit() > limit);
+
+  // With the growth target off, only the soft memory limit triggers a
+  // collection. Once resident memory exceeds it, collections are as
+  // frequent as the minimum headroom allows.
+  heap->setGCPercent(-1);
+  auto unlimited = heap->allocationLimit();
+  ASSERT_TRUE(unlimited > limit);
+  heap->setMemoryLimit(1);
+  ASSERT_TRUE(heap->allocationLimit() < unlimited);
+  ASSERT_TRUE(heap->allocationLimit() >= kMinHeadroom);
+
+  heap->setGCPercent(kDefaultGCPercent);
+  heap->setMemoryLimit(memoryLimit);
+}
+
+TEST(GCStats) {
+  std::vector<GCCycleStats> cycles;
+  heap->setGCEventListener([&cycles](const GCCycleStats& cycle) { cycles.push_back(cycle); });
+
+  auto before = heap->gcStats();
+  handle(new (heap->allocate(sizeof(uintptr_t))) uintptr_t(1));
+  heap->collectGarbage();
+  heap->collectYoungGarbage();
+  heap->setGCEventListener(nullptr);
+
+  // Each cycle is reported once, in order, with its kind.
+  ASSERT_EQ(2, cycles.size());
+  ASSERT_TRUE(cycles[0].kind == GCKind::FULL);
+  ASSERT_TRUE(cycles[1].kind == GCKind::YOUNG);
+  ASSERT_EQ(cycles[0].id + 1, cycles[1].id);
+  ASSERT_TRUE(cycles[0].heapBytes >= cycles[0].bytesAfter);
+
+  auto stats = heap->gcStats();
+  ASSERT_EQ(before.fullCount + 1, stats.fullCount);
+  ASSERT_EQ(before.youngCount + 1, stats.youngCount);
+  ASSERT_EQ(cycles[1].id, stats.lastCycle.id);
+  ASSERT_EQ(before.fullPauses.count + 1, stats.fullPauses.count);
+  ASSERT_EQ(before.youngPauses.count + 1, stats.youngPauses.count);
+  ASSERT_TRUE(stats.fullPauses.p99 <= stats.fullPauses.max);
+  ASSERT_FALSE(stats.sizeClasses.empty());
+
+  std::ostringstream os;
+  writeJSONLine(os, cycles[1]);
+  ASSERT_EQ(0, os.str().find("{\"id\":"));
+  ASSERT_TRUE(os.str().find("\"kind\":\"young\"") != std::string::npos);
+}
+
+TEST(AllocationSampling) {
+  // Sample every allocation. Changing the interval discards earlier samples.
+  heap->setAllocationSampleInterval(1);
+  ASSERT_TRUE(heap->allocationProfile().records.empty());
+
+  for (int i = 0; i < 10; i++) {
+    heap->allocate(64);
+  }
+  auto kept = handle(new (heap->allocate(4096)) uintptr_t(1));
+
+  // Samples aren't counted as in use until a collection finds them live.
+  auto total = [](const AllocationProfile& profile) {
+    AllocationRecord total;
+    for (auto& r : profile.records) {
+      total.allocObjects += r.allocObjects;
+      total.allocBytes += r.allocBytes;
+      total.inuseObjects += r.inuseObjects;
+      total.inuseBytes += r.inuseBytes;
+    }
+    return total;
+  };
+  auto before = total(heap->allocationProfile());
+  ASSERT_EQ(11, before.allocObjects);
+  ASSERT_EQ(10 * 64 + 4096, before.allocBytes);
+  ASSERT_EQ(0, before.inuseObjects);
+
+  heap->collectGarbage();
+  auto profile = heap->allocationProfile();
+  for (auto& r : profile.records) {
+    ASSERT_FALSE(r.site.frames.empty());
+  }
+  auto after = total(profile);
+  ASSERT_EQ(11, after.allocObjects);
+  ASSERT_EQ(1, after.inuseObjects);
+  ASSERT_EQ(4096, after.inuseBytes);
+
+  std::ostringstream os;
+  writeHeapProfile(os, profile);
+  ASSERT_EQ(0, os.str().find("heap profile: 1: 4096 [11: 4736] @ heap_v2/1\n"));
+
+  heap->setAllocationSampleInterval(kDefaultAllocationSampleInterval);
+}
+
+struct TypedNode {
+  uintptr_t value;
+  Ptr<TypedNode> next;
+
+  static uintptr_t pointerMask() { return memberPointerMask(&TypedNode::next); }
+};
+
+TEST(TypedLayout) {
+  // Layouts are interned, and all pointer-free layouts are the same.
+  auto layout = layoutOf<TypedNode>();
+  auto mask = static_cast<uintptr_t>(1) << (kWordSize / kPointerSize);
+  ASSERT_EQ(2 * kWordSize, layout->size);
+  ASSERT_EQ(mask, layout->pointerMask);
+  ASSERT_TRUE(layout == internLayout(2 * kWordSize, mask));
+  ASSERT_TRUE(layoutOf<uint32_t>() == layoutOf<double>());
+  ASSERT_FALSE(layoutOf<uint32_t>()->hasPointers());
+  ASSERT_TRUE(layoutOf<std::vector<int>>() == nullptr);
+
+  // Pointer bits of a typed block are known before anything is written.
+  auto head = handle(new (heap->allocate(sizeof(TypedNode), layout)) TypedNode);
+  ASSERT_TRUE(Heap::isPointer(reinterpret_cast<uintptr_t>(&head->next)));
+  ASSERT_FALSE(Heap::isPointer(reinterpret_cast<uintptr_t>(&head->value)));
+
+  // Blocks reachable through typed slots survive collection, in chunks and
+  // in large objects.
+  auto node = new (heap->allocate(sizeof(TypedNode), layout)) TypedNode;
+  node->value = 1;
+  head->next = node;
+  const uintptr_t kLargeSize = kMaxBlockSize + sizeof(TypedNode);
+  auto large = reinterpret_cast<TypedNode*>(heap->allocate(kLargeSize, layout));
+  auto last = &large[kLargeSize / sizeof(TypedNode) - 1];
+  node->next = last;
+  last->next = new (heap->allocate(sizeof(TypedNode), layout)) TypedNode;
+  last->next->value = 2;
+  heap->collectGarbage();
+  heap->validate();
+  ASSERT_EQ(1, head->next->value);
+  ASSERT_TRUE(Heap::isMarked(reinterpret_cast<uintptr_t>(last->next.get())));
+  ASSERT_EQ(2, last->next->value);
+}
+
+struct GraphNode {
+  Ptr<GraphNode> left, right;
+
+  static uintptr_t pointerMask() {
+    return memberPointerMask(&GraphNode::left) | memberPointerMask(&GraphNode::right);
+  }
+};
+
+TEST(HeapSnapshot) {
+  // a points to b and c, which both point to d. a dominates every block,
+  // but neither b nor c dominates d.
+  auto newNode = [] { return new (heap->allocate(sizeof(GraphNode), layoutOf<GraphNode>())) GraphNode; };
+  auto a = handle(newNode());
+  a->left = newNode();
+  a->right = newNode();
+  a->left->left = newNode();
+  a->right->left = a->left->left;
+
+  std::stringstream ss;
+  heap->writeSnapshot(ss);
+  auto snapshot = readHeapSnapshot(ss);
+  ASSERT_EQ(0, snapshot.danglingCount);
+  auto index = [&snapshot](GraphNode* node) { return snapshot.indexOf(reinterpret_cast<uintptr_t>(node)); };
+  auto ia = index(*a), ib = index(a->left.get()), ic = index(a->right.get()), id = index(a->left->left.get());
+  ASSERT_TRUE(ia != kNoBlock && ib != kNoBlock && ic != kNoBlock && id != kNoBlock);
+
+  auto isRootFrom = [&snapshot](uint32_t block, const std::string& source) {
+    for (auto& root : snapshot.roots) {
+      if (root.block == block && snapshot.rootSources[root.source] == source) {
+        return true;
+      }
+    }
+    return false;
+  };
+  ASSERT_TRUE(isRootFrom(ia, "HandleStorage"));
+
+  auto tree = computeDominators(snapshot);
+  ASSERT_EQ(snapshot.blockCount(), tree.idom[ia]);
+  ASSERT_EQ(ia, tree.idom[ib]);
+  ASSERT_EQ(ia, tree.idom[ic]);
+  ASSERT_EQ(ia, tree.idom[id]);
+  ASSERT_EQ(sizeof(GraphNode), tree.retainedSize[ib]);
+  ASSERT_EQ(4 * sizeof(GraphNode), tree.retainedSize[ia]);
+}
+
+TEST(HeapImage) {
+  // a is typed and points to itself. u is untyped: it holds a number and
+  // an interior pointer into big, a large block that points back to a.
+  auto a = handle(new (heap->allocate(sizeof(GraphNode), layoutOf<GraphNode>())) GraphNode);
+  a->left = *a;
+  auto u = handle(reinterpret_cast<uintptr_t*>(heap->allocate(2 * kWordSize)));
+  (*u)[0] = 12345;
+  auto big = reinterpret_cast<uintptr_t>(heap->allocate(3 * MB));
+  auto slot = reinterpret_cast<uintptr_t>(&(*u)[1]);
+  storePointer(slot, big + 3 * kWordSize);
+  heap->recordWrite(slot, big + 3 * kWordSize);
+  storePointer(big, reinterpret_cast<uintptr_t>(*a));
+  heap->recordWrite(big, reinterpret_cast<uintptr_t>(*a));
+
+  std::stringstream ss;
+  heap->writeImage(ss, {reinterpret_cast<uintptr_t>(*a), reinterpret_cast<uintptr_t>(*u), 0});
+  auto data = ss.str();
+  auto image = readHeapImage(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+  ASSERT_EQ(3, image.runs.size());
+  heap->setGCLock(true);
+  auto roots = heap->loadImage(image);
+  auto a2 = handle(reinterpret_cast<GraphNode*>(roots[0]));
+  auto u2 = handle(reinterpret_cast<uintptr_t*>(roots[1]));
+  heap->setGCLock(false);
+  ASSERT_EQ(0, roots[2]);
+
+  // The copies point to each other, not to the originals, and survive
+  // collection.
+  heap->collectGarbage();
+  ASSERT_TRUE(*a2 != *a && *u2 != *u);
+  ASSERT_EQ(*a2, a2->left.get());
+  ASSERT_EQ(12345, (*u2)[0]);
+  auto slot2 = reinterpret_cast<uintptr_t>(&(*u2)[1]);
+  ASSERT_TRUE(Heap::isPointer(slot2));
+  auto big2 = Heap::blockContaining(loadPointer(slot2));
+  ASSERT_TRUE(big2 != big);
+  ASSERT_EQ(big2 + 3 * kWordSize, loadPointer(slot2));
+  ASSERT_EQ(3 * MB, Heap::blockSize(big2));
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(*a2), loadPointer(big2));
+  heap->validate();
+}
+
+TEST(PointerCompression) {
+  ASSERT_EQ(kPointerSize, sizeof(Ptr<GraphNode>));
+  ASSERT_EQ(2 * kPointerSize, layoutOf<GraphNode>()->size);
+  ASSERT_EQ(0, decompressPointer(compressPointer(0)));
+  ASSERT_EQ(kZeroAllocAddress, decompressPointer(compressPointer(kZeroAllocAddress)));
+
+  // Pointers to chunks, large objects, and the middle of blocks all survive
+  // a round trip through a slot. With compressed pointers, large objects
+  // are in the cage, too.
+  auto node = handle(new (heap->allocate(sizeof(GraphNode), layoutOf<GraphNode>())) GraphNode);
+  auto small = heap->allocate(3 * kWordSize);
+  auto big = heap->allocate(kMaxBlockSize + kWordSize);
+  auto reservation = heap->chunkCache()->reservation();
+  ASSERT_EQ(kCompressedPointers, reservation->contains(reinterpret_cast<uintptr_t>(big)));
+  ASSERT_TRUE(!kCompressedPointers || !reservation->mayHoldChunk(reinterpret_cast<uintptr_t>(big)));
+  for (auto p : {small, big}) {
+    auto target = reinterpret_cast<GraphNode*>(reinterpret_cast<uintptr_t>(p) + 1);
+    node->left = target;
+    ASSERT_TRUE(node->left.get() == target);
+  }
+  node->left = reinterpret_cast<GraphNode*>(big);
+  heap->collectGarbage();
+  ASSERT_TRUE(Heap::isMarked(reinterpret_cast<uintptr_t>(big)));
+  ASSERT_TRUE(heap->isOnHeap(reinterpret_cast<uintptr_t>(big)));
+  heap->validate();
+}
+
+TEST(ParallelMark) {
+  auto workerCount = heap->gcWorkerCount();
+  heap->setGCWorkerCount(4);
+
+  // Build a tree of blocks, each pointing to two children, so there's work
+  // to steal.
+  const int kDepth = 10;
+  auto root = handle(reinterpret_cast<uintptr_t*>(heap->allocate(2 * kWordSize)));
+  std::vector<uintptr_t*> level = {*root};
+  heap->setGCLock(true);
+  for (int d = 1; d < kDepth; d++) {
+    std::vector<uintptr_t*> next;
+    for (auto parent : level) {
+      for (int i = 0; i < 2; i++) {
+        auto child = reinterpret_cast<uintptr_t*>(heap->allocate(2 * kWordSize));
+        storePointer(reinterpret_cast<uintptr_t>(&parent[i]), reinterpret_cast<uintptr_t>(child));
+        heap->recordWrite(reinterpret_cast<uintptr_t>(&parent[i]), reinterpret_cast<uintptr_t>(child));
+        next.push_back(child);
+      }
+    }
+    level = std::move(next);
+  }
+  heap->setGCLock(false);
+  auto garbage = reinterpret_cast<uintptr_t>(heap->allocate(2 * kWordSize));
+
+  heap->collectGarbage();
+  for (auto block : level) {
+    ASSERT_TRUE(Heap::isMarked(reinterpret_cast<uintptr_t>(block)));
+  }
+  ASSERT_FALSE(Heap::isMarked(garbage));
+
+  // Finish sweeping on the workers too.
+  heap->validate();
+
+  heap->setGCWorkerCount(workerCount);
+}
+
+TEST(RootSpans) {
+  // Fill more than one block of handle slots, then free every other handle.
+  // Free slots are on the free list and must be skipped.
+  const uintptr_t kCount = 2 * kHandleBlockSize + 1;
+  std::deque<Handle<uintptr_t>> handles;
+  std::vector<uintptr_t> blocks;
+  heap->setGCLock(true);
+  for (uintptr_t i = 0; i < kCount; i++) {
+    handles.emplace_back(reinterpret_cast<uintptr_t*>(heap->allocate(2 * kWordSize)));
+    blocks.push_back(reinterpret_cast<uintptr_t>(*handles.back()));
+  }
+  heap->setGCLock(false);
+  for (uintptr_t i = 1; i < kCount; i += 2) {
+    handles[i].reset();
+  }
+
+  // A root set with its own slots. Slots that don't hold pointers are skipped.
+  struct TestRoots : public RootSet {
+    void appendRootSpans(std::vector<RootSpan>* spans) override { spans->push_back(RootSpan{slots, 3}); }
+    uintptr_t slots[3] = {0, kZeroAllocAddress, 0};
+  };
+  static TestRoots testRoots;
+  static bool registered = false;
+  if (!registered) {
+    heap->registerRoots(&testRoots, "TestRoots");
+    registered = true;
+  }
+  auto workerCount = heap->gcWorkerCount();
+  for (size_t workers : {1, 4}) {
+    heap->setGCWorkerCount(workers);
+    testRoots.slots[2] = reinterpret_cast<uintptr_t>(heap->allocate(2 * kWordSize));
+    heap->collectGarbage();
+    ASSERT_TRUE(Heap::isMarked(testRoots.slots[2]));
+    for (uintptr_t i = 0; i < kCount; i += 2) {
+      ASSERT_TRUE(Heap::isMarked(blocks[i]));
+    }
+  }
+  heap->setGCWorkerCount(workerCount);
+  for (uintptr_t i = 1; i < kCount; i += 2) {
+    ASSERT_FALSE(Heap::isMarked(blocks[i]));
+  }
+  testRoots.slots[2] = 0;
+}
+
+/**
+ * Builds a list of nodes, then moves the nodes one at a time to another list
+ * while allocating enough garbage to start and finish several collections.
+ * Once the root block has been marked, moved nodes are only found through
+ * the write barrier. Checks that no node was swept.
+ */
+static void testMarkWhileMoving(Test& t) {
+  // Each node holds a next pointer and a tag. The root block holds the
+  // heads of two lists, A and B.
+  const uintptr_t kTag = 0x5a5a5a5a;
+  const int kNodeCount = 2000;
+  auto root = handle(reinterpret_cast<uintptr_t*>(heap->allocate(2 * kWordSize)));
+  auto link = [](uintptr_t* from, uintptr_t* to) {
+    storePointer(reinterpret_cast<uintptr_t>(from), reinterpret_cast<uintptr_t>(to));
+    heap->recordWrite(reinterpret_cast<uintptr_t>(from), reinterpret_cast<uintptr_t>(to));
+  };
+  auto load = [](uintptr_t* from) { return reinterpret_cast<uintptr_t*>(loadPointer(reinterpret_cast<uintptr_t>(from))); };
+  for (int i = 0; i < kNodeCount; i++) {
+    auto node = reinterpret_cast<uintptr_t*>(heap->allocate(2 * kWordSize));
+    node[1] = kTag;
+    link(&node[0], load(&(*root)[1]));
+    link(&(*root)[1], node);
+  }
+
+  // Move nodes from B to A.
+  for (int i = 0; i < kNodeCount; i++) {
+    auto node = load(&(*root)[1]);
+    link(&(*root)[1], load(&node[0]));
+    link(&node[0], load(&(*root)[0]));
+    link(&(*root)[0], node);
+    for (int j = 0; j < 4; j++) {
+      heap->allocate(1 * KB);
+    }
+  }
+  heap->validate();
+
+  ASSERT_EQ(0, (*root)[1]);
+  int count = 0;
+  for (auto node = load(&(*root)[0]); node != nullptr; node = load(&node[0])) {
+    ASSERT_EQ(kTag, node[1]);
+    count++;
+  }
+  ASSERT_EQ(kNodeCount, count);
+}
+
+TEST(ConcurrentMark) {
+  heap->setConcurrentMarking(true);
+  testMarkWhileMoving(t);
+  heap->setConcurrentMarking(false);
+}
+
+TEST(IncrementalMark) {
+  heap->setIncrementalMarking(true);
+  testMarkWhileMoving(t);
+  heap->setIncrementalMarking(false);
+}
+
 }  // namespace codeswitch
@@ -0,0 +1,147 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include "heapimage.h"
+
+#include <cstring>
+#include <limits>
+#include "chunk.h"
+#include "common/error.h"
+
+namespace codeswitch {
+
+namespace {
+
+void writeVarint(std::ostream& os, uint64_t n) {
+  while (n >= 0x80) {
+    os.put(static_cast<char>(n | 0x80));
+    n >>= 7;
+  }
+  os.put(static_cast<char>(n));
+}
+
+}  // namespace
+
+uintptr_t HeapImage::size() const {
+  uintptr_t size = 0;
+  for (auto& run : runs) {
+    size += run.size();
+  }
+  return size;
+}
+
+void writeHeapImage(std::ostream& os, const HeapImage& image) {
+  os.write(kHeapImageMagic, sizeof(kHeapImageMagic) - 1);
+  writeVarint(os, kPointerSize);
+  writeVarint(os, image.roots.size());
+  for (auto root : image.roots) {
+    writeVarint(os, root);
+  }
+  writeVarint(os, image.runs.size());
+  for (auto& run : image.runs) {
+    writeVarint(os, run.blockSize);
+    writeVarint(os, run.blockCount);
+    writeVarint(os, run.layout != nullptr);
+    if (run.layout != nullptr) {
+      writeVarint(os, run.layout->size);
+      writeVarint(os, run.layout->pointerMask);
+    }
+    writeVarint(os, run.slots.size());
+    uintptr_t prev = 0;
+    for (auto slot : run.slots) {
+      writeVarint(os, slot - prev);
+      prev = slot;
+    }
+    os.write(reinterpret_cast<const char*>(run.data), run.size());
+  }
+  os.flush();
+}
+
+HeapImage readHeapImage(const uint8_t* data, uintptr_t size) {
+  auto p = data, end = data + size;
+  auto readVarint = [&p, end]() {
+    uint64_t n = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p == end) {
+        throw errorstr("heap image is truncated");
+      }
+      auto c = *p++;
+      n |= static_cast<uint64_t>(c & 0x7f) << shift;
+      if ((c & 0x80) == 0) {
+        return n;
+      }
+    }
+    throw errorstr("heap image has an invalid integer");
+  };
+
+  if (!isHeapImage(data, size)) {
+    throw errorstr("not a heap image");
+  }
+  p += sizeof(kHeapImageMagic) - 1;
+  auto pointerSize = readVarint();
+  if (pointerSize != kPointerSize) {
+    throw errorstr("heap image has ", pointerSize, "-byte pointers; expected ", kPointerSize);
+  }
+
+  HeapImage image;
+  auto rootCount = readVarint();
+  for (uint64_t i = 0; i < rootCount; i++) {
+    image.roots.push_back(readVarint());
+  }
+
+  // Biased offsets must fit in a pointer slot.
+  const uintptr_t kMaxImageSize = std::numeric_limits<PointerSlot>::max() - kHeapImagePointerBias;
+  uintptr_t imageSize = 0;
+  auto runCount = readVarint();
+  for (uint64_t i = 0; i < runCount; i++) {
+    HeapImageRun run;
+    run.blockSize = readVarint();
+    run.blockCount = readVarint();
+    if (run.blockSize == 0 || !isAligned(run.blockSize, kBlockAlignment) || run.blockCount == 0 ||
+        run.blockCount > kMaxImageSize / run.blockSize || imageSize + run.size() > kMaxImageSize) {
+      throw errorstr("heap image run ", i, " has an invalid size");
+    }
+    imageSize += run.size();
+    if (readVarint() != 0) {
+      auto layoutSize = readVarint();
+      auto layoutMask = readVarint();
+      if (layoutSize == 0 || !isAligned(layoutSize, kPointerSize) ||
+          (layoutSize < kBitsInWord * kPointerSize && (layoutMask >> (layoutSize / kPointerSize)) != 0)) {
+        throw errorstr("heap image run ", i, " has an invalid layout");
+      }
+      run.layout = internLayout(layoutSize, layoutMask);
+    }
+    auto slotCount = readVarint();
+    if (slotCount > run.size() / kPointerSize) {
+      throw errorstr("heap image run ", i, " has too many pointer slots");
+    }
+    run.slots.reserve(slotCount);
+    uintptr_t slot = 0;
+    for (uint64_t j = 0; j < slotCount; j++) {
+      auto delta = readVarint();
+      if ((j > 0 && delta == 0) || delta >= run.size() / kPointerSize - slot) {
+        throw errorstr("heap image run ", i, " has an invalid pointer slot");
+      }
+      slot += delta;
+      run.slots.push_back(slot);
+    }
+    if (run.size() > static_cast<uintptr_t>(end - p)) {
+      throw errorstr("heap image is truncated");
+    }
+    run.data = p;
+    p += run.size();
+    image.runs.push_back(std::move(run));
+  }
+  if (p != end) {
+    throw errorstr("heap image has unexpected data at the end");
+  }
+  return image;
+}
+
+bool isHeapImage(const uint8_t* data, uintptr_t size) {
+  return size >= sizeof(kHeapImageMagic) - 1 && memcmp(data, kHeapImageMagic, sizeof(kHeapImageMagic) - 1) == 0;
+}
+
+}  // namespace codeswitch
@@ -0,0 +1,97 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_heapimage_h
+#define memory_heapimage_h
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "cage.h"
+#include "common/common.h"
+#include "layout.h"
+
+namespace codeswitch {
+
+/**
+ * A heap image holds a set of blocks and pointers into them (the roots),
+ * copied from one process's heap so another can load them without
+ * rebuilding them. Heap::writeImage writes one, and Heap::loadImage copies
+ * its blocks onto the heap and relocates them. Blocks end up at different
+ * addresses, so nothing in them may depend on addresses (for example, hash
+ * tables keyed by address).
+ *
+ * Blocks are grouped into runs of the same size and layout, so each run can
+ * be copied into fresh chunks in a few large copies. Blocks in a run are
+ * packed together, and runs are packed one after another, which gives each
+ * block an offset in the image. Pointer slots hold the offset they point to
+ * plus kHeapImagePointerBias. Smaller values (null and kZeroAllocAddress)
+ * are stored as they are. Typed runs store their layout, which tells the
+ * loader where their pointer slots are. Untyped runs list their pointer
+ * slots instead, so the loader can relocate them and set their pointer bits.
+ *
+ * Integers are unsigned LEB128 varints. Block contents are raw bytes in the
+ * writer's byte order, and slots are kPointerSize bytes, so images are only
+ * loaded by builds with the same pointer size.
+ *
+ *   image  := magic pointerSize rootCount root* runCount run*
+ *   root   := pointer
+ *   run    := blockSize blockCount typed [layoutSize layoutMask]
+ *             slotCount (slotIndex - previousSlotIndex)* bytes
+ */
+const char kHeapImageMagic[] = "CSWIMG01";
+
+/**
+ * Added to image offsets in pointer slots. It's above kZeroAllocAddress,
+ * so values below it aren't relocated.
+ */
+const uintptr_t kHeapImagePointerBias = 2 * MB;
+
+/**
+ * A run of blocks in a heap image. When writing, data points to the
+ * writer's encoded copy. When reading, it points into the image.
+ */
+struct HeapImageRun {
+  uintptr_t blockSize = 0;
+  uintptr_t blockCount = 0;
+
+  /** Layout of the blocks, or nullptr if they're untyped. */
+  const Layout* layout = nullptr;
+
+  /**
+   * For untyped runs, indices of pointer slots that need relocating, from
+   * the start of the run, in increasing order. Empty for typed runs.
+   */
+  std::vector<uintptr_t> slots;
+
+  const uint8_t* data = nullptr;
+
+  uintptr_t size() const { return blockSize * blockCount; }
+};
+
+/** Contents of a heap image. Roots are encoded like pointer slots. */
+struct HeapImage {
+  std::vector<uintptr_t> roots;
+  std::vector<HeapImageRun> runs;
+
+  /** Total size of the blocks in all runs. */
+  uintptr_t size() const;
+};
+
+/** Writes an image in the format described above. */
+void writeHeapImage(std::ostream& os, const HeapImage& image);
+
+/**
+ * Reads the image in data, which must stay mapped while the result is used,
+ * since runs point into it. Throws Error if it's malformed.
+ */
+HeapImage readHeapImage(const uint8_t* data, uintptr_t size);
+
+/** Returns whether data starts like a heap image. */
+bool isHeapImage(const uint8_t* data, uintptr_t size);
+
+}  // namespace codeswitch
+
+#endif
@@ -0,0 +1,283 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include "heapsnapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <utility>
+#include "common/error.h"
+
+namespace codeswitch {
+
+enum class SnapshotTag : uint8_t {
+  END,
+  ROOT,
+  BLOCK,
+};
+
+HeapSnapshotWriter::HeapSnapshotWriter(std::ostream& os, const std::vector<std::string>& rootSources) : os_(os) {
+  os_.write(kHeapSnapshotMagic, sizeof(kHeapSnapshotMagic) - 1);
+  writeVarint(rootSources.size());
+  for (auto& source : rootSources) {
+    writeVarint(source.size());
+    os_.write(source.data(), source.size());
+  }
+}
+
+void HeapSnapshotWriter::writeRoot(uintptr_t source, uintptr_t block) {
+  os_.put(static_cast<char>(SnapshotTag::ROOT));
+  writeVarint(source);
+  writeVarint(block);
+}
+
+void HeapSnapshotWriter::writeBlock(uintptr_t block, uintptr_t size, const std::vector<uintptr_t>& edges) {
+  os_.put(static_cast<char>(SnapshotTag::BLOCK));
+  writeVarint(block);
+  writeVarint(size);
+  writeVarint(edges.size());
+  for (auto target : edges) {
+    auto offset = static_cast<int64_t>(target - block);
+    writeVarint((static_cast<uint64_t>(offset) << 1) ^ static_cast<uint64_t>(offset >> 63));
+  }
+}
+
+void HeapSnapshotWriter::finish() {
+  os_.put(static_cast<char>(SnapshotTag::END));
+  os_.flush();
+}
+
+void HeapSnapshotWriter::writeVarint(uint64_t n) {
+  while (n >= 0x80) {
+    os_.put(static_cast<char>(n | 0x80));
+    n >>= 7;
+  }
+  os_.put(static_cast<char>(n));
+}
+
+uint32_t HeapSnapshot::indexOf(uintptr_t address) const {
+  auto it = std::lower_bound(addresses.begin(), addresses.end(), address);
+  if (it == addresses.end() || *it != address) {
+    return kNoBlock;
+  }
+  return static_cast<uint32_t>(it - addresses.begin());
+}
+
+HeapSnapshot readHeapSnapshot(std::istream& is) {
+  auto readVarint = [&is]() {
+    uint64_t n = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      auto c = is.get();
+      if (c == EOF) {
+        throw errorstr("heap snapshot is truncated");
+      }
+      n |= static_cast<uint64_t>(c & 0x7f) << shift;
+      if ((c & 0x80) == 0) {
+        return n;
+      }
+    }
+    throw errorstr("heap snapshot has an invalid integer");
+  };
+
+  char magic[sizeof(kHeapSnapshotMagic) - 1];
+  if (!is.read(magic, sizeof(magic)) || memcmp(magic, kHeapSnapshotMagic, sizeof(magic)) != 0) {
+    throw errorstr("not a heap snapshot");
+  }
+  HeapSnapshot snapshot;
+  auto sourceCount = readVarint();
+  for (uint64_t i = 0; i < sourceCount; i++) {
+    std::string source(readVarint(), '\0');
+    if (!is.read(source.data(), source.size())) {
+      throw errorstr("heap snapshot is truncated");
+    }
+    snapshot.rootSources.push_back(std::move(source));
+  }
+
+  // Blocks may be written in any order, so edges are kept as addresses
+  // until the blocks are sorted.
+  struct RawBlock {
+    uintptr_t address, size;
+    size_t edgeBegin, edgeEnd;
+  };
+  std::vector<RawBlock> blocks;
+  std::vector<uintptr_t> targets;
+  std::vector<std::pair<uint64_t, uintptr_t>> roots;
+  while (true) {
+    auto tag = is.get();
+    if (tag == EOF) {
+      throw errorstr("heap snapshot is truncated");
+    }
+    if (tag == static_cast<int>(SnapshotTag::END)) {
+      break;
+    } else if (tag == static_cast<int>(SnapshotTag::ROOT)) {
+      auto source = readVarint();
+      if (source >= snapshot.rootSources.size()) {
+        throw errorstr("heap snapshot has a root with an unknown source: ", source);
+      }
+      roots.emplace_back(source, readVarint());
+    } else if (tag == static_cast<int>(SnapshotTag::BLOCK)) {
+      RawBlock block;
+      block.address = readVarint();
+      block.size = readVarint();
+      auto edgeCount = readVarint();
+      block.edgeBegin = targets.size();
+      for (uint64_t i = 0; i < edgeCount; i++) {
+        auto n = readVarint();
+        auto offset = static_cast<int64_t>(n >> 1) ^ -static_cast<int64_t>(n & 1);
+        targets.push_back(block.address + static_cast<uintptr_t>(offset));
+      }
+      block.edgeEnd = targets.size();
+      blocks.push_back(block);
+    } else {
+      throw errorstr("heap snapshot has an unknown record: ", tag);
+    }
+  }
+  if (blocks.size() >= kNoBlock) {
+    throw errorstr("heap snapshot has too many blocks: ", blocks.size());
+  }
+
+  std::sort(blocks.begin(), blocks.end(), [](auto& a, auto& b) { return a.address < b.address; });
+  for (auto& block : blocks) {
+    snapshot.addresses.push_back(block.address);
+    snapshot.sizes.push_back(block.size);
+  }
+  for (auto& block : blocks) {
+    snapshot.edgeBegin.push_back(snapshot.edges.size());
+    for (auto i = block.edgeBegin; i < block.edgeEnd; i++) {
+      auto target = snapshot.indexOf(targets[i]);
+      if (target == kNoBlock) {
+        snapshot.danglingCount++;
+      } else {
+        snapshot.edges.push_back(target);
+      }
+    }
+  }
+  snapshot.edgeBegin.push_back(snapshot.edges.size());
+  for (auto& root : roots) {
+    auto block = snapshot.indexOf(root.second);
+    if (block == kNoBlock) {
+      snapshot.danglingCount++;
+    } else {
+      snapshot.roots.push_back(HeapSnapshot::Root{static_cast<uint32_t>(root.first), block});
+    }
+  }
+  return snapshot;
+}
+
+DominatorTree computeDominators(const HeapSnapshot& snapshot) {
+  // Node n is a virtual root with an edge to each root block.
+  auto n = static_cast<uint32_t>(snapshot.blockCount());
+  auto root = n;
+  std::vector<uint32_t> rootEdges;
+  for (auto& r : snapshot.roots) {
+    rootEdges.push_back(r.block);
+  }
+  auto successors = [&](uint32_t v) -> std::pair<const uint32_t*, const uint32_t*> {
+    if (v == root) {
+      return std::make_pair(rootEdges.data(), rootEdges.data() + rootEdges.size());
+    }
+    auto begin = snapshot.edges.data() + snapshot.edgeBegin[v];
+    auto end = snapshot.edges.data() + snapshot.edgeBegin[v + 1];
+    return std::make_pair(begin, end);
+  };
+
+  // Number reachable nodes in postorder with an explicit stack, since heap
+  // graphs can be much deeper than the native stack.
+  std::vector<uint32_t> postorder;
+  std::vector<uint32_t> postIndex(n + 1, kNoBlock);
+  std::vector<uint8_t> visited(n + 1);
+  std::vector<std::pair<uint32_t, const uint32_t*>> stack;
+  visited[root] = 1;
+  stack.emplace_back(root, successors(root).first);
+  while (!stack.empty()) {
+    auto& top = stack.back();
+    auto end = successors(top.first).second;
+    if (top.second == end) {
+      postIndex[top.first] = postorder.size();
+      postorder.push_back(top.first);
+      stack.pop_back();
+      continue;
+    }
+    auto w = *top.second++;
+    if (!visited[w]) {
+      visited[w] = 1;
+      stack.emplace_back(w, successors(w).first);
+    }
+  }
+
+  // Collect predecessors of reachable nodes.
+  std::vector<size_t> predBegin(n + 2);
+  for (auto v : postorder) {
+    auto s = successors(v);
+    for (auto p = s.first; p != s.second; p++) {
+      predBegin[*p + 1]++;
+    }
+  }
+  std::partial_sum(predBegin.begin(), predBegin.end(), predBegin.begin());
+  std::vector<uint32_t> preds(predBegin.back());
+  auto fill = predBegin;
+  for (auto v : postorder) {
+    auto s = successors(v);
+    for (auto p = s.first; p != s.second; p++) {
+      preds[fill[*p]++] = v;
+    }
+  }
+
+  // Iterate to a fixed point in reverse postorder. A node's dominators all
+  // come before it, so this usually converges in two or three passes.
+  std::vector<uint32_t> idom(n + 1, kNoBlock);
+  idom[root] = root;
+  auto intersect = [&](uint32_t a, uint32_t b) {
+    while (a != b) {
+      while (postIndex[a] < postIndex[b]) {
+        a = idom[a];
+      }
+      while (postIndex[b] < postIndex[a]) {
+        b = idom[b];
+      }
+    }
+    return a;
+  };
+  auto changed = true;
+  while (changed) {
+    changed = false;
+    for (auto i = postorder.size() - 1; i-- > 0;) {
+      auto v = postorder[i];
+      auto newIdom = kNoBlock;
+      for (auto j = predBegin[v]; j < predBegin[v + 1]; j++) {
+        auto p = preds[j];
+        if (idom[p] == kNoBlock) {
+          continue;
+        }
+        newIdom = newIdom == kNoBlock ? p : intersect(p, newIdom);
+      }
+      if (idom[v] != newIdom) {
+        idom[v] = newIdom;
+        changed = true;
+      }
+    }
+  }
+
+  // A node comes before its dominator in postorder, so retained sizes can
+  // be accumulated in one pass.
+  DominatorTree tree;
+  tree.retainedSize.resize(n);
+  for (auto v : postorder) {
+    if (v != root) {
+      tree.retainedSize[v] += snapshot.sizes[v];
+      tree.reachableCount++;
+      tree.reachableBytes += snapshot.sizes[v];
+      if (idom[v] != root) {
+        tree.retainedSize[idom[v]] += tree.retainedSize[v];
+      }
+    }
+  }
+  idom.pop_back();
+  tree.idom = std::move(idom);
+  return tree;
+}
+
+}  // namespace codeswitch
@@ -0,0 +1,114 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_heapsnapshot_h
+#define memory_heapsnapshot_h
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "common/common.h"
+
+namespace codeswitch {
+
+/**
+ * Heap snapshots are written as a magic string, a table of root source
+ * names, then a sequence of records, each starting with a tag byte. Integers
+ * are unsigned LEB128 varints. Edges are stored as signed (zigzag) offsets
+ * from the block they're in, since most pointers are to nearby blocks.
+ *
+ *   snapshot := magic sourceCount (length bytes)* record* END
+ *   record   := ROOT source address
+ *             | BLOCK address size edgeCount (target - address)*
+ */
+const char kHeapSnapshotMagic[] = "CSWHEAP1";
+
+/**
+ * HeapSnapshotWriter encodes blocks and roots to a stream as they're found,
+ * so the heap doesn't need to build the graph in memory.
+ */
+class HeapSnapshotWriter {
+ public:
+  HeapSnapshotWriter(std::ostream& os, const std::vector<std::string>& rootSources);
+  NON_COPYABLE(HeapSnapshotWriter)
+
+  /** Records that a root from the given source points to block. */
+  void writeRoot(uintptr_t source, uintptr_t block);
+
+  /** Records a block and the blocks its pointer slots point to. */
+  void writeBlock(uintptr_t block, uintptr_t size, const std::vector<uintptr_t>& edges);
+
+  /** Writes the end marker. Nothing may be written after this. */
+  void finish();
+
+ private:
+  void writeVarint(uint64_t n);
+
+  std::ostream& os_;
+};
+
+/** Index of a block that isn't in a snapshot. */
+const uint32_t kNoBlock = UINT32_MAX;
+
+/**
+ * A heap snapshot read back for analysis. Blocks are identified by their
+ * index in address order. Edges are in compressed sparse row form: the
+ * targets of block i are edges[edgeBegin[i]] up to edges[edgeBegin[i+1]].
+ */
+struct HeapSnapshot {
+  struct Root {
+    uint32_t source;
+    uint32_t block;
+  };
+
+  std::vector<std::string> rootSources;
+  std::vector<uintptr_t> addresses;
+  std::vector<uintptr_t> sizes;
+  std::vector<size_t> edgeBegin;
+  std::vector<uint32_t> edges;
+  std::vector<Root> roots;
+
+  /** Number of edges and roots that pointed to blocks not in the snapshot. */
+  uintptr_t danglingCount = 0;
+
+  size_t blockCount() const { return addresses.size(); }
+
+  /** Returns the index of the block at address, or kNoBlock. */
+  uint32_t indexOf(uintptr_t address) const;
+};
+
+/** Reads a snapshot written by Heap::writeSnapshot. Throws Error if it's malformed. */
+HeapSnapshot readHeapSnapshot(std::istream& is);
+
+/**
+ * The dominator tree of a snapshot's blocks. A block X dominates Y if every
+ * path from the roots to Y passes through X, so freeing X would free Y too.
+ * A block's retained size is the total size of the blocks it dominates,
+ * including itself.
+ */
+struct DominatorTree {
+  /**
+   * Immediate dominator of each block. It's blockCount for a block that's
+   * only dominated by the roots, and kNoBlock for an unreachable block.
+   */
+  std::vector<uint32_t> idom;
+
+  std::vector<uintptr_t> retainedSize;
+
+  uintptr_t reachableCount = 0;
+  uintptr_t reachableBytes = 0;
+};
+
+/**
+ * Computes the dominator tree of a snapshot with the iterative algorithm of
+ * Cooper, Harvey, and Kennedy, which is simple and fast on the shallow,
+ * wide graphs heaps usually form.
+ */
+DominatorTree computeDominators(const HeapSnapshot& snapshot);
+
+}  // namespace codeswitch
+
+#endif
@@ -0,0 +1,149 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include "largeobject.h"
+
+#include <algorithm>
+#include <new>
+#include "heap.h"
+#include "platform/platform.h"
+
+namespace codeswitch {
+
+LargeObject* LargeObject::create(uintptr_t blockSize, const Layout* layout) {
+  ASSERT(isAligned(blockSize, kBlockAlignment));
+  auto bitmapSize = Bitmap::sizeFor(blockSize / kPointerSize);
+  auto cardCount = align(blockSize, kCardSize) / kCardSize;
+  auto dataOffset = align(align(sizeof(LargeObject), kWordSize) + bitmapSize + cardCount, kLargeObjectAlignment);
+  auto regionSize = align(dataOffset + blockSize, kLargeObjectAlignment);
+
+  // Fresh mappings are zeroed, so the bitmap, card table, and block start
+  // out clear. With compressed pointers, the block must be in the cage.
+  auto region = kCompressedPointers ? heap->chunkCache()->allocateLarge(regionSize)
+                                    : allocateChunk(regionSize, kLargeObjectAlignment);
+  return new (region) LargeObject(blockSize, regionSize, dataOffset, layout);
+}
+
+void LargeObject::destroy(LargeObject* obj) {
+  auto regionSize = obj->regionSize_;
+  obj->~LargeObject();
+  if (kCompressedPointers) {
+    heap->chunkCache()->freeLarge(obj, regionSize);
+  } else {
+    freeChunk(obj, regionSize);
+  }
+}
+
+LargeObject::LargeObject(uintptr_t blockSize, uintptr_t regionSize, uintptr_t dataOffset, const Layout* layout) :
+    blockSize_(blockSize),
+    regionSize_(regionSize),
+    dataOffset_(dataOffset),
+    cardCount_(align(blockSize, kCardSize) / kCardSize),
+    layout_(layout),
+    marked_(0) {
+  if (layout_ != nullptr) {
+    auto ptr = pointerBitmapLocked();
+    layout_->forEachPointerSlot(block(), blockSize_, [&](uintptr_t slot) { ptr.set((slot - block()) / kPointerSize, true); });
+  }
+}
+
+bool LargeObject::regionContains(uintptr_t addr) const {
+  auto base = reinterpret_cast<uintptr_t>(this);
+  return base <= addr && addr < base + regionSize_;
+}
+
+bool LargeObject::isPointer(uintptr_t addr) {
+  std::lock_guard lock(mu_);
+  return pointerBitmapLocked()[(addr - block()) / kPointerSize];
+}
+
+void LargeObject::setPointer(uintptr_t addr) {
+  if (layout_ != nullptr) {
+    // Like Chunk::setPointer, the bitmap of a typed object never changes.
+    ASSERT(pointerBitmapLocked()[(addr - block()) / kPointerSize]);
+    return;
+  }
+  std::lock_guard lock(mu_);
+  pointerBitmapLocked().set((addr - block()) / kPointerSize, true);
+}
+
+uintptr_t LargeObject::scanDirtyCards(std::vector<uintptr_t>* slots) {
+  std::lock_guard lock(mu_);
+  auto cards = cardTable();
+  auto ptr = pointerBitmapLocked();
+  auto base = block();
+  const auto slotsPerCard = kCardSize / kPointerSize;
+
+  uintptr_t dirtyCount = 0;
+  for (uintptr_t card = 0; card < cardCount_; card++) {
+    if (cards[card] == 0) {
+      continue;
+    }
+    cards[card] = 0;
+    dirtyCount++;
+
+    // The block starts on a page boundary, so each card covers a whole
+    // number of pointer bitmap words, except maybe the last one.
+    auto wordIndex = card * slotsPerCard / kBitsInWord;
+    auto n = std::min(wordIndex + slotsPerCard / kBitsInWord, ptr.wordCount());
+    for (; wordIndex < n; wordIndex++) {
+      auto bits = ptr.wordAt(wordIndex);
+      while (bits != 0) {
+        auto index = wordIndex * kBitsInWord + __builtin_ctzl(bits);
+        bits &= bits - 1;
+        slots->push_back(base + index * kPointerSize);
+      }
+    }
+  }
+  return dirtyCount;
+}
+
+void LargeObject::forEachPointerSlot(const std::function<void(uintptr_t)>& f) {
+  std::lock_guard lock(mu_);
+  auto ptr = pointerBitmapLocked();
+  auto base = block();
+  for (uintptr_t wordIndex = 0, n = ptr.wordCount(); wordIndex < n; wordIndex++) {
+    auto bits = ptr.wordAt(wordIndex);
+    while (bits != 0) {
+      auto index = wordIndex * kBitsInWord + __builtin_ctzl(bits);
+      bits &= bits - 1;
+      f(base + index * kPointerSize);
+    }
+  }
+}
+
+void LargeObject::clearCards() {
+  std::fill(cardTable(), cardTable() + cardCount_, 0);
+}
+
+void LargeObject::validate() {
+  std::lock_guard lock(mu_);
+  if (!isMarked()) {
+    return;
+  }
+
+  // Each slot with pointer bit set must either be 0, kZeroAllocAddress, or
+  // an address inside another marked block on the heap.
+  auto ptr = pointerBitmapLocked();
+  for (uintptr_t i = 0, n = blockSize_ / kPointerSize; i < n; i++) {
+    auto p = loadPointer(block() + i * kPointerSize);
+    if (ptr[i] && p != 0 && p != kZeroAllocAddress) {
+      ASSERT(heap->isOnHeap(p));
+      ASSERT(Heap::isMarked(Heap::blockContaining(p)));
+    }
+  }
+}
+
+Bitmap LargeObject::pointerBitmapLocked() {
+  auto base = reinterpret_cast<uintptr_t>(this) + align(sizeof(LargeObject), kWordSize);
+  return Bitmap(reinterpret_cast<uintptr_t*>(base), blockSize_ / kPointerSize);
+}
+
+uint8_t* LargeObject::cardTable() {
+  auto base = reinterpret_cast<uintptr_t>(this) + align(sizeof(LargeObject), kWordSize);
+  return reinterpret_cast<uint8_t*>(base + Bitmap::sizeFor(blockSize_ / kPointerSize));
+}
+
+}  // namespace codeswitch
@@ -0,0 +1,166 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_largeobject_h
+#define memory_largeobject_h
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "bitmap.h"
+#include "chunk.h"
+#include "common/common.h"
+#include "layout.h"
+
+namespace codeswitch {
+
+/**
+ * Large objects start on a page boundary, so freeing one can return whole
+ * pages to the kernel.
+ */
+const uintptr_t kLargeObjectAlignment = 4 * KB;
+
+/**
+ * LargeObject holds a single block larger than kMaxBlockSize. Each large
+ * object has its own region of memory mapped from the kernel (or, with
+ * compressed pointers, committed in the cage). The region starts with a
+ * header, followed by a pointer bitmap with one bit per pointer-sized slot
+ * of the block and a card table with one byte per kCardSize bytes of the
+ * block. The block itself starts at the next page boundary and takes up
+ * the rest of the region.
+ *
+ * Large objects aren't laid out like chunks, so Chunk::fromAddress doesn't
+ * work for them. The heap keeps a registry of large objects sorted by
+ * address and checks it first (see Heap::largeObjectContaining).
+ *
+ * A large object has one mark bit. It follows the same rules as mark bits in
+ * chunks: a marked object is old, and an unmarked object is young or garbage.
+ * Garbage objects are unmapped when the heap is swept.
+ */
+class LargeObject {
+ public:
+  NON_COPYABLE(LargeObject)
+
+  /**
+   * Maps a region for a large object with the given block size, which must
+   * be a multiple of kBlockAlignment. The block is zeroed. If layout is
+   * not nullptr, the pointer bitmap is filled in from it, and setPointer
+   * won't change it.
+   *
+   * @throws SystemAllocationError if the region couldn't be mapped.
+   */
+  static LargeObject* create(uintptr_t blockSize, const Layout* layout = nullptr);
+
+  /** Unmaps the region of a large object, returning it to the kernel. */
+  static void destroy(LargeObject* obj);
+
+  /** Returns the address of the block. */
+  uintptr_t block() const { return reinterpret_cast<uintptr_t>(this) + dataOffset_; }
+
+  /** Returns the size of the block in bytes. */
+  uintptr_t blockSize() const { return blockSize_; }
+
+  /** Returns the layout of the block, or nullptr if it's untyped. */
+  const Layout* layout() const { return layout_; }
+
+  /** Returns the address just past the end of the block. */
+  uintptr_t end() const { return block() + blockSize_; }
+
+  /** Returns whether addr is inside the mapped region, including the header. */
+  bool regionContains(uintptr_t addr) const;
+
+  /**
+   * Returns whether an address has been marked as a pointer with setPointer.
+   * addr must be a kPointerSize-aligned address in the block.
+   */
+  bool isPointer(uintptr_t addr);
+
+  /**
+   * Marks an address as a pointer. addr must be a kPointerSize-aligned
+   * address in the block. If the object is typed, this only checks that the layout
+   * already says addr is a pointer.
+   */
+  void setPointer(uintptr_t addr);
+
+  /** Returns whether the block has been marked as live. */
+  bool isMarked() const { return __atomic_load_n(&marked_, __ATOMIC_RELAXED) != 0; }
+
+  /** Marks the block as live. */
+  void setMarked() { __atomic_store_n(&marked_, 1, __ATOMIC_RELAXED); }
+
+  /**
+   * Marks the block as live and returns whether it was already marked.
+   * GC workers may call this concurrently.
+   */
+  bool testAndSetMarked() { return __atomic_exchange_n(&marked_, 1, __ATOMIC_RELAXED) != 0; }
+
+  /** Clears the mark bit. */
+  void clearMark() { __atomic_store_n(&marked_, 0, __ATOMIC_RELAXED); }
+
+  /**
+   * Marks the card containing addr as dirty. addr must be a word-aligned
+   * address in the block.
+   */
+  void dirtyCard(uintptr_t addr);
+
+  /**
+   * Finds pointer slots within dirty cards, appends them to slots, and cleans
+   * the cards. Returns the number of dirty cards found. Unlike
+   * Chunk::scanDirtyCards, this doesn't check the mark bit; the caller should
+   * only scan marked objects.
+   */
+  uintptr_t scanDirtyCards(std::vector<uintptr_t>* slots);
+
+  /** Calls f with the address of each pointer slot in the block. */
+  void forEachPointerSlot(const std::function<void(uintptr_t)>& f);
+
+  /** Marks all cards as clean. */
+  void clearCards();
+
+  /** Returns the number of cards covering the block. */
+  uintptr_t cardCount() const { return cardCount_; }
+
+  /** Checks heap invariants on this object. Used for debugging and testing. */
+  void validate();
+
+ private:
+  LargeObject(uintptr_t blockSize, uintptr_t regionSize, uintptr_t dataOffset, const Layout* layout);
+
+  Bitmap pointerBitmapLocked();
+  uint8_t* cardTable();
+
+  /** mu_ guards the pointer bitmap. */
+  std::mutex mu_;
+
+  /** Size of the block in bytes. */
+  uintptr_t blockSize_;
+
+  /** Size of the whole mapped region in bytes, including the header. */
+  uintptr_t regionSize_;
+
+  /** Offset of the block from the beginning of the region. */
+  uintptr_t dataOffset_;
+
+  /** Number of entries in the card table. */
+  uintptr_t cardCount_;
+
+  /** Layout of the block, or nullptr if it's untyped. Never changed. */
+  const Layout* layout_;
+
+  /** Non-zero if the block is marked. Accessed atomically. */
+  uint8_t marked_;
+
+  // The pointer bitmap and card table follow the header.
+};
+
+inline void LargeObject::dirtyCard(uintptr_t addr) {
+  // Like Chunk::dirtyCard, no lock is needed.
+  cardTable()[(addr - block()) / kCardSize] = 1;
+}
+
+}  // namespace codeswitch
+
+#endif
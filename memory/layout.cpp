@@ -0,0 +1,37 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include "layout.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace codeswitch {
+
+const Layout* internLayout(uintptr_t size, uintptr_t pointerMask) {
+  static std::mutex mu;
+  static std::map<std::pair<uintptr_t, uintptr_t>, std::unique_ptr<Layout>> layouts;
+
+  ASSERT(size > 0);
+  if (pointerMask == 0) {
+    // Element size doesn't matter if there are no pointers to find, and
+    // sharing one layout lets blocks of all pointer-free types share chunks.
+    size = kWordSize;
+  } else {
+    ASSERT(isAligned(size, kPointerSize));
+    ASSERT(size / kPointerSize >= kBitsInWord || pointerMask >> (size / kPointerSize) == 0);
+  }
+
+  std::lock_guard lock(mu);
+  auto& layout = layouts[std::make_pair(size, pointerMask)];
+  if (!layout) {
+    layout.reset(new Layout{size, pointerMask});
+  }
+  return layout.get();
+}
+
+}  // namespace codeswitch
@@ -0,0 +1,133 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_layout_h
+#define memory_layout_h
+
+#include <cstdint>
+#include <type_traits>
+#include "cage.h"
+#include "common/common.h"
+
+namespace codeswitch {
+
+/**
+ * Layout describes where pointers are in blocks that hold a sequence of
+ * elements of the same type. Each element is size bytes long. Bit i of
+ * pointerMask is set if the pointer-sized slot at offset i * kPointerSize of
+ * each element is a pointer to the heap.
+ *
+ * Chunks and large objects allocated with a layout are typed: their pointer
+ * bitmaps are filled in from the layout when they're created, the write
+ * barrier doesn't need to set pointer bits, and the garbage collector scans
+ * blocks by layout. Blocks allocated without a layout are untyped and rely
+ * on the write barrier to record each pointer slot.
+ *
+ * Layouts are interned with internLayout, so two layouts are the same if
+ * and only if their addresses are equal.
+ */
+struct Layout {
+  uintptr_t size;
+  uintptr_t pointerMask;
+
+  bool hasPointers() const { return pointerMask != 0; }
+
+  /**
+   * Calls f with the address of each pointer slot in a block starting at
+   * block that holds blockSize bytes of elements.
+   */
+  template <class F>
+  void forEachPointerSlot(uintptr_t block, uintptr_t blockSize, F f) const;
+};
+
+/**
+ * Returns the canonical layout with the given element size and pointer mask.
+ * All layouts without pointers are the same, regardless of element size.
+ * Layouts are never freed.
+ */
+const Layout* internLayout(uintptr_t size, uintptr_t pointerMask);
+
+/**
+ * LayoutTraits tells whether T has a static layout, and if so, which of its
+ * slots are pointers. Arithmetic and enum types have no pointers. A class
+ * has a static layout if it declares a public static method pointerMask()
+ * returning a mask of its slots that hold pointers (usually built with
+ * memberPointerMask). Other types are untyped.
+ */
+template <class T, class = void>
+struct LayoutTraits {
+  static const bool kKnown = false;
+};
+
+template <class T>
+struct LayoutTraits<T, std::enable_if_t<std::is_arithmetic_v<T> || std::is_enum_v<T>>> {
+  static const bool kKnown = true;
+  static uintptr_t pointerMask() { return 0; }
+};
+
+template <class T>
+struct LayoutTraits<T, std::void_t<decltype(T::pointerMask())>> {
+  static const bool kKnown = true;
+  static uintptr_t pointerMask() { return T::pointerMask(); }
+};
+
+/**
+ * Returns the layout for blocks holding elements of type T, or nullptr if
+ * T is untyped.
+ */
+template <class T>
+const Layout* layoutOf() {
+  typedef std::remove_cv_t<T> U;
+  if constexpr (LayoutTraits<U>::kKnown) {
+    static const Layout* layout = internLayout(sizeof(U), LayoutTraits<U>::pointerMask());
+    return layout;
+  } else {
+    return nullptr;
+  }
+}
+
+/**
+ * Returns the byte offset of a data member within T. Unlike offsetof, this
+ * works for classes that aren't standard-layout. No T is constructed.
+ */
+template <class T, class M>
+uintptr_t offsetOf(M T::*member) {
+  alignas(T) unsigned char probe[sizeof(T)];
+  auto obj = reinterpret_cast<T*>(probe);
+  return reinterpret_cast<uintptr_t>(&(obj->*member)) - reinterpret_cast<uintptr_t>(obj);
+}
+
+/**
+ * Returns the pointer mask of a data member, shifted to the member's offset
+ * within T. Classes combine these in their pointerMask methods. The member's
+ * type must have a static layout.
+ */
+template <class T, class M>
+uintptr_t memberPointerMask(M T::*member) {
+  static_assert(LayoutTraits<std::remove_cv_t<M>>::kKnown, "member type has no static layout");
+  auto mask = LayoutTraits<std::remove_cv_t<M>>::pointerMask();
+  if (mask == 0) {
+    return 0;
+  }
+  auto offset = offsetOf(member);
+  ASSERT(isAligned(offset, kPointerSize) && offset / kPointerSize < kBitsInWord);
+  return mask << (offset / kPointerSize);
+}
+
+template <class F>
+void Layout::forEachPointerSlot(uintptr_t block, uintptr_t blockSize, F f) const {
+  if (pointerMask == 0) {
+    return;
+  }
+  for (auto elem = block, end = block + blockSize; elem + size <= end; elem += size) {
+    for (auto bits = pointerMask; bits != 0; bits &= bits - 1) {
+      f(elem + __builtin_ctzl(bits) * kPointerSize);
+    }
+  }
+}
+
+}  // namespace codeswitch
+
+#endif
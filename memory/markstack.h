@@ -0,0 +1,104 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_markstack_h
+#define memory_markstack_h
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "common/common.h"
+
+namespace codeswitch {
+
+/** Number of addresses in each segment of a MarkStack. */
+const size_t kMarkStackSegmentSize = 4096;
+
+/**
+ * Number of addresses MarkStack::pop prefetches ahead of the one it
+ * returns. This should be enough to cover memory latency while blocks
+ * are scanned, but not so many that prefetched lines are evicted first.
+ */
+const size_t kMarkPrefetchDistance = 8;
+
+/**
+ * MarkStack holds addresses of blocks the garbage collector still needs to
+ * scan. It's a stack of fixed-size segments, so pushing never moves or
+ * copies addresses already on the stack, and segments are kept for reuse
+ * once allocated.
+ *
+ * pop returns addresses through a small FIFO. Each address is prefetched
+ * as it enters the FIFO, so by the time it's returned, the block it points
+ * to is likely in cache.
+ *
+ * MarkStack is not synchronized.
+ */
+class MarkStack {
+ public:
+  NON_COPYABLE(MarkStack)
+  MarkStack() = default;
+
+  bool empty() const { return count_ == 0 && fifoCount_ == 0; }
+  size_t size() const { return count_ + fifoCount_; }
+
+  void push(uintptr_t p) {
+    auto index = count_ / kMarkStackSegmentSize;
+    if (index == segments_.size()) {
+      segments_.emplace_back(new Segment);
+    }
+    (*segments_[index])[count_ % kMarkStackSegmentSize] = p;
+    count_++;
+  }
+
+  /** Removes and returns an address. The stack must not be empty. */
+  uintptr_t pop() {
+    ASSERT(!empty());
+    while (fifoCount_ < kMarkPrefetchDistance && count_ > 0) {
+      count_--;
+      auto p = (*segments_[count_ / kMarkStackSegmentSize])[count_ % kMarkStackSegmentSize];
+      __builtin_prefetch(reinterpret_cast<const void*>(p));
+      fifo_[(fifoHead_ + fifoCount_) % kMarkPrefetchDistance] = p;
+      fifoCount_++;
+    }
+    auto p = fifo_[fifoHead_];
+    fifoHead_ = (fifoHead_ + 1) % kMarkPrefetchDistance;
+    fifoCount_--;
+    return p;
+  }
+
+  /** Moves all addresses from other onto this stack, leaving other empty. */
+  void takeAll(MarkStack* other) {
+    while (!other->empty()) {
+      push(other->pop());
+    }
+  }
+
+  /** Removes all addresses. Only the first segment is kept. */
+  void clear() {
+    count_ = 0;
+    fifoCount_ = 0;
+    if (segments_.size() > 1) {
+      segments_.resize(1);
+    }
+  }
+
+ private:
+  typedef std::array<uintptr_t, kMarkStackSegmentSize> Segment;
+
+  std::vector<std::unique_ptr<Segment>> segments_;
+
+  /** Number of addresses in segments_, not counting the FIFO. */
+  size_t count_ = 0;
+
+  /** Addresses popped from segments_ and prefetched, oldest first. */
+  uintptr_t fifo_[kMarkPrefetchDistance];
+  size_t fifoHead_ = 0;
+  size_t fifoCount_ = 0;
+};
+
+}  // namespace codeswitch
+
+#endif
@@ -7,6 +7,7 @@
 #define memory_ptr_h
 
 #include <functional>
+#include "cage.h"
 #include "common/common.h"
 #include "heap.h"
 
@@ -16,45 +17,56 @@ namespace codeswitch {
  * Wrapper for pointers stored within Blocks. Ensures that pointer fields are
  * properly initialized and writes are recorded. Generally should not be used
  * as a value, since it doesn't make sense to record a write to the C++ stack.
+ *
+ * With compressed pointers, Ptr holds a 32-bit offset into the cage and is
+ * half the size of a raw pointer (see cage.h).
  */
 template <class T>
-class alignas(uintptr_t) Ptr {
+class alignas(PointerSlot) Ptr {
  public:
-  Ptr() : p_(nullptr) {}
+  Ptr() : p_(0) {}
   template <class S>
   Ptr(S* q) {
     set(q);
   }
   template <class S>
   Ptr(const Ptr<S>& q) {
-    set(q.p_);
+    set(q.pointer());
   }
   template <class S>
   Ptr(Ptr<S>&& q) {
-    set(q.p_);
+    set(q.pointer());
     q.set(nullptr);
   }
   template <class S>
+  Ptr& operator=(S* q) {
+    set(q);
+    return *this;
+  }
+  template <class S>
   Ptr& operator=(const Ptr<S>& q) {
-    set(q.p_);
+    set(q.pointer());
     return *this;
   }
   template <class S>
   Ptr& operator=(Ptr<S>&& q) {
-    set(q.p_);
+    set(q.pointer());
     q.set(nullptr);
     return *this;
   }
 
-  const T* get() const { return p_; }
-  T* get() { return p_; }
-  const T& operator*() const { return *p_; }
-  T& operator*() { return *p_; }
-  const T* operator->() const { return p_; }
-  T* operator->() { return p_; }
+  /** Ptr is a single pointer, so its layout has one pointer slot. */
+  static uintptr_t pointerMask() { return 1; }
+
+  const T* get() const { return pointer(); }
+  T* get() { return pointer(); }
+  const T& operator*() const { return *get(); }
+  T& operator*() { return *get(); }
+  const T* operator->() const { return get(); }
+  T* operator->() { return get(); }
   void set(T* q) {
-    p_ = q;
-    heap->recordWrite(&p_, q);
+    p_ = compressPointer(reinterpret_cast<uintptr_t>(q));
+    heap->recordWrite(reinterpret_cast<uintptr_t>(&p_), reinterpret_cast<uintptr_t>(q));
   }
 
   template <class S>
@@ -65,11 +77,16 @@ class alignas(uintptr_t) Ptr {
   bool operator!=(const Ptr<S>& q) const {
     return p_ != q.p_;
   }
-  operator bool() const { return p_ != nullptr; }
-  bool operator!() const { return p_ == nullptr; }
+  operator bool() const { return p_ != 0; }
+  bool operator!() const { return p_ == 0; }
 
  private:
-  T* p_;
+  template <class S>
+  friend class Ptr;
+
+  T* pointer() const { return reinterpret_cast<T*>(decompressPointer(p_)); }
+
+  PointerSlot p_;
 };
 
 template <class T>
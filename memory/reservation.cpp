@@ -0,0 +1,110 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#include "reservation.h"
+
+#include <algorithm>
+#include "chunk.h"
+#include "platform/platform.h"
+
+namespace codeswitch {
+
+HeapReservation::HeapReservation() {
+  // Reserve as much as the system allows, up to kHeapReservationSize.
+  // Align to kHugePageSize so chunks can be grouped into huge pages.
+  for (auto size = kHeapReservationSize;; size /= 2) {
+    try {
+      begin_ = reinterpret_cast<uintptr_t>(reserveMemory(size, kHugePageSize));
+      end_ = begin_ + size;
+      break;
+    } catch (SystemAllocationError& err) {
+      if (size / 2 < kMinHeapReservationSize) {
+        throw;
+      }
+    }
+  }
+  // With compressed pointers, small compressed values are stored as they
+  // are, so the beginning of the cage can't hold blocks.
+  next_ = kCompressedPointers ? begin_ + kCageGuardSize : begin_;
+  states_.reset(new uint8_t[(end_ - begin_) / Chunk::kSize]());
+  slotOffsets_.reset(new uint8_t[(end_ - begin_) / Chunk::kSize]());
+}
+
+HeapReservation::~HeapReservation() {
+  freeChunk(reinterpret_cast<void*>(begin_), end_ - begin_);
+}
+
+uintptr_t HeapReservation::take(uintptr_t count, uintptr_t alignment) {
+  // Single slots may be reused. Groups are reused if a run of free slots
+  // is big enough, which matters for large objects in the cage: they're
+  // taken as groups and given back one slot at a time.
+  if (count == 1 && !free_.empty()) {
+    auto addr = free_.back();
+    free_.pop_back();
+    return addr;
+  }
+  if (count > 1 && free_.size() >= count) {
+    auto addr = takeFreeRun(count, alignment);
+    if (addr != 0) {
+      return addr;
+    }
+  }
+  auto addr = align(next_, alignment);
+  if (addr + count * Chunk::kSize > end_) {
+    return 0;
+  }
+
+  // Slots skipped for alignment may be used for single chunks later.
+  for (auto skipped = next_; skipped < addr; skipped += Chunk::kSize) {
+    free_.push_back(skipped);
+  }
+  next_ = addr + count * Chunk::kSize;
+  return addr;
+}
+
+void HeapReservation::give(uintptr_t addr) {
+  decommitMemory(reinterpret_cast<void*>(addr), Chunk::kSize);
+  setState(addr, ChunkState::UNUSED);
+  free_.push_back(addr);
+}
+
+void HeapReservation::setSpan(uintptr_t addr, uintptr_t count) {
+  auto first = slotIndex(addr);
+  for (uintptr_t i = 0; i < count; i++) {
+    slotOffsets_[first + i] = static_cast<uint8_t>(i);
+  }
+}
+
+uintptr_t HeapReservation::clearSpan(uintptr_t addr) {
+  // Offsets of the chunk's slots count up from 1 after the first. The slot
+  // after the chunk is the first slot of something else (or of nothing),
+  // so its offset is 0.
+  auto first = slotIndex(addr);
+  auto slotCount = (end_ - begin_) / Chunk::kSize;
+  uintptr_t count = 1;
+  while (first + count < slotCount && slotOffsets_[first + count] == count) {
+    slotOffsets_[first + count] = 0;
+    count++;
+  }
+  return count;
+}
+
+uintptr_t HeapReservation::takeFreeRun(uintptr_t count, uintptr_t alignment) {
+  std::sort(free_.begin(), free_.end());
+  for (size_t i = 0; i + count <= free_.size(); i++) {
+    auto addr = free_[i];
+    if (isAligned(addr, alignment) && free_[i + count - 1] == addr + (count - 1) * Chunk::kSize) {
+      free_.erase(free_.begin() + i, free_.begin() + i + count);
+      return addr;
+    }
+  }
+  return 0;
+}
+
+uintptr_t HeapReservation::slotIndex(uintptr_t addr) const {
+  return (addr - begin_) / Chunk::kSize;
+}
+
+}  // namespace codeswitch
@@ -0,0 +1,136 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_reservation_h
+#define memory_reservation_h
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "cage.h"
+#include "common/common.h"
+
+namespace codeswitch {
+
+/**
+ * Size of the address range reserved for chunks. Only chunks in use are
+ * backed by memory, so this only limits how large the heap may grow. With
+ * compressed pointers, the reservation is the cage, and large objects are
+ * carved out of it, too.
+ */
+const uintptr_t kHeapReservationSize = kCompressedPointers ? kCageSize : 64ULL * 1024 * MB;
+
+/**
+ * If kHeapReservationSize can't be reserved (for example, because of a
+ * limit on address space), smaller sizes are tried down to this one.
+ */
+const uintptr_t kMinHeapReservationSize = 256 * MB;
+
+/** State of each chunk-sized slot in a HeapReservation. */
+enum class ChunkState : uint8_t {
+  /** Not backed by memory. */
+  UNUSED,
+
+  /** Backed by memory but not in use. Held in ChunkCache. */
+  CACHED,
+
+  /** In use by the heap. */
+  ACTIVE,
+
+  /** Part of a large object. Only used with compressed pointers. */
+  LARGE,
+};
+
+/**
+ * HeapReservation is a contiguous range of address space that chunks are
+ * carved out of. The range is reserved up front but only backed by memory
+ * as chunks are committed.
+ *
+ * Each chunk-sized slot has a state byte, so checking whether an address
+ * belongs to a chunk in use is a range check and an array lookup.
+ *
+ * HeapReservation is not synchronized, except that state may be called
+ * concurrently with anything. ChunkCache guards everything else.
+ */
+class HeapReservation {
+ public:
+  NON_COPYABLE(HeapReservation)
+  HeapReservation();
+  ~HeapReservation();
+
+  uintptr_t begin() const { return begin_; }
+  uintptr_t end() const { return end_; }
+  bool contains(uintptr_t addr) const { return begin_ <= addr && addr < end_; }
+
+  /**
+   * Returns whether addr is in a slot that may hold a chunk. Large objects
+   * are only in the reservation with compressed pointers, so the state
+   * isn't checked otherwise.
+   */
+  bool mayHoldChunk(uintptr_t addr) const {
+    return contains(addr) && (!kCompressedPointers || state(addr) != ChunkState::LARGE);
+  }
+
+  /** Returns the state of the slot containing addr, which must be in range. */
+  ChunkState state(uintptr_t addr) const {
+    return static_cast<ChunkState>(__atomic_load_n(&states_[slotIndex(addr)], __ATOMIC_RELAXED));
+  }
+
+  /** Sets the state of the slot containing addr, which must be in range. */
+  void setState(uintptr_t addr, ChunkState state) {
+    __atomic_store_n(&states_[slotIndex(addr)], static_cast<uint8_t>(state), __ATOMIC_RELAXED);
+  }
+
+  /**
+   * Finds count consecutive unused slots starting at a multiple of
+   * alignment and returns the address of the first. The slots are not
+   * committed. Returns 0 if the reservation is exhausted.
+   */
+  uintptr_t take(uintptr_t count, uintptr_t alignment);
+
+  /** Decommits a slot and makes it available to take again. */
+  void give(uintptr_t addr);
+
+  /**
+   * Returns a table with a byte for each slot, holding the slot's distance
+   * (in slots) from the first slot of the chunk it belongs to. Most chunks
+   * are one slot, so most entries are 0. Chunk::fromAddress reads this
+   * without synchronization; entries only change while their slots aren't
+   * in use.
+   */
+  const uint8_t* slotOffsets() const { return slotOffsets_.get(); }
+
+  /** Records that count slots starting at addr hold one chunk. */
+  void setSpan(uintptr_t addr, uintptr_t count);
+
+  /**
+   * Forgets the chunk starting at addr, recorded with setSpan. Returns the
+   * number of slots it held, which is 1 if it wasn't recorded.
+   */
+  uintptr_t clearSpan(uintptr_t addr);
+
+ private:
+  uintptr_t slotIndex(uintptr_t addr) const;
+
+  uintptr_t begin_, end_;
+
+  /** Slots below this address have been taken at least once. */
+  uintptr_t next_;
+
+  /** Slots below next_ that have been given back. */
+  std::vector<uintptr_t> free_;
+
+  uintptr_t takeFreeRun(uintptr_t count, uintptr_t alignment);
+
+  /** One ChunkState per slot. */
+  std::unique_ptr<uint8_t[]> states_;
+
+  /** One offset per slot. See slotOffsets. */
+  std::unique_ptr<uint8_t[]> slotOffsets_;
+};
+
+}  // namespace codeswitch
+
+#endif
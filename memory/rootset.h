@@ -0,0 +1,48 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_rootset_h
+#define memory_rootset_h
+
+#include <cstdint>
+#include <vector>
+
+namespace codeswitch {
+
+/**
+ * A contiguous array of root slots. Each slot holds an uncompressed pointer
+ * into the heap. Slots holding null, kZeroAllocAddress, or an odd value
+ * (like a free handle slot) are skipped.
+ */
+struct RootSpan {
+  const uintptr_t* slots;
+  uintptr_t count;
+};
+
+/**
+ * RootSet is implemented by anything outside the heap that holds pointers
+ * into it, like handles, interpreter stacks, and global roots. Root sets are
+ * registered with Heap::registerRoots.
+ *
+ * The garbage collector asks each set for its slots once per scan, then
+ * reads them in a tight loop, prefetching blocks they point to. That's
+ * much cheaper than a callback per root, so sets should keep their slots in
+ * a few large arrays where they can.
+ */
+class RootSet {
+ public:
+  virtual ~RootSet() = default;
+
+  /**
+   * Appends spans covering all root slots in this set. Called while the
+   * world is stopped. Spans are read before anything else runs, so they
+   * may point to memory that changes afterward.
+   */
+  virtual void appendRootSpans(std::vector<RootSpan>* spans) = 0;
+};
+
+}  // namespace codeswitch
+
+#endif
@@ -5,7 +5,7 @@
 
 #include "stack.h"
 
-#include <functional>
+#include <vector>
 #include "heap.h"
 
 namespace codeswitch {
@@ -18,13 +18,15 @@ Stack::Stack() {
   start_ = limit_ + kStackSize;
   sp = start_;
   fp = start_;
+  fn = nullptr;
+  ipOffset = 0;
 }
 
 Stack::~Stack() {
   delete[] reinterpret_cast<uint8_t*>(limit_);
 }
 
-void Stack::accept(std::function<void(uintptr_t)> visit) {
+void Stack::appendRootSpans(std::vector<RootSpan>* spans) {
   // TODO: visit other pointers on the stack. Currently, the type system doesn't
   // allow pointers, so there's actually nothing to visit. When pointers are
   // allowed, each function needs a bitmap indicating which argument words
@@ -32,8 +34,7 @@ void Stack::accept(std::function<void(uintptr_t)> visit) {
   // point. Safe points are instructions that can trigger GC, especially
   // anything that allocates or calls.
   for (auto fr = frame(); fr != nullptr; fr = fr->fp) {
-    visit(reinterpret_cast<uintptr_t>(fr->fn));
-    visit(reinterpret_cast<uintptr_t>(fr->pp));
+    spans->push_back(RootSpan{reinterpret_cast<const uintptr_t*>(&fr->fn), 2});
   }
 }
 
@@ -45,8 +46,10 @@ Stack* StackPool::get() {
 
 StackPool* stackPool;
 
+thread_local Stack* currentStack;
+
 StackPool::StackPool() {
-  heap->registerRoots(std::bind(&StackPool::accept, this, std::placeholders::_1));
+  heap->registerRoots(this, "StackPool");
 }
 
 void StackPool::put(Stack* stack) {
@@ -54,11 +57,11 @@ void StackPool::put(Stack* stack) {
   used_ = false;
 }
 
-void StackPool::accept(std::function<void(uintptr_t)> visit) {
+void StackPool::appendRootSpans(std::vector<RootSpan>* spans) {
   if (!used_) {
     return;
   }
-  stack_.accept(visit);
+  stack_.appendRootSpans(spans);
 }
 
 }  // namespace codeswitch
@@ -6,10 +6,11 @@
 #ifndef memory_stack_h
 #define memory_stack_h
 
-#include <deque>
-#include <functional>
+#include <cstddef>
 #include <mutex>
+#include <vector>
 #include "common/common.h"
+#include "rootset.h"
 
 namespace codeswitch {
 
@@ -24,6 +25,9 @@ struct Frame {
   Package* pp;
 };
 
+static_assert(offsetof(Frame, pp) == offsetof(Frame, fn) + sizeof(Function*),
+              "fn and pp are scanned as one RootSpan");
+
 class Stack {
  public:
   Stack();
@@ -35,7 +39,7 @@ class Stack {
   inline void check(size_t n);
 
   Frame* frame() const { return reinterpret_cast<Frame*>(fp); }
-  void accept(std::function<void(uintptr_t)> visit);
+  void appendRootSpans(std::vector<RootSpan>* spans);
 
   template <class T>
   void push(const T& v);
@@ -46,18 +50,27 @@ class Stack {
 
   uintptr_t sp, fp;
 
+  /**
+   * Function being interpreted and the bytecode offset of its current
+   * instruction, saved with sp and fp before the interpreter calls code
+   * that may allocate. Used to attribute sampled allocations.
+   */
+  Function* fn;
+  uintptr_t ipOffset;
+
  private:
   uintptr_t start_, limit_;
 };
 
-class StackPool {
+class StackPool : public RootSet {
  public:
   StackPool();
+  NON_COPYABLE(StackPool)
 
   Stack* get();
   void put(Stack* stack);
 
-  void accept(std::function<void(uintptr_t)> visit);
+  void appendRootSpans(std::vector<RootSpan>* spans) override;
 
  private:
   // TODO: support more than one stack.
@@ -67,6 +80,9 @@ class StackPool {
 
 extern StackPool* stackPool;
 
+/** The stack of the interpreter running on this thread, or nullptr. */
+extern thread_local Stack* currentStack;
+
 class StackOverflowError : public std::exception {
  public:
   virtual const char* what() const noexcept override { return "stack overflow"; }
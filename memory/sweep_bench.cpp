@@ -0,0 +1,74 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+// sweep_bench compares eager and lazy zeroing of freed blocks. For each
+// block size, it fills the heap with blocks, keeps one in eight alive,
+// then times a full collection including the sweep (the pause, when
+// sweeping is finished in it) and the allocations that reuse the freed
+// blocks.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include "handle.h"
+#include "heap.h"
+
+using namespace codeswitch;
+
+namespace {
+
+const uintptr_t kHeapBytes = 64 * MB;
+const uintptr_t kLiveRatio = 8;
+
+void bench(uintptr_t blockSize, bool lazy) {
+  heap->setLazyZeroing(lazy);
+  auto count = kHeapBytes / blockSize;
+  // Collections are only done where the benchmark asks for them, so the
+  // sweep sees the whole heap and allocations are timed on their own.
+  heap->setGCLock(true);
+  std::deque<Handle<uintptr_t>> live;
+  for (uintptr_t i = 0; i < count; i++) {
+    auto block = reinterpret_cast<uintptr_t*>(heap->allocate(blockSize));
+    std::fill(block, block + blockSize / kWordSize, i);
+    if (i % kLiveRatio == 0) {
+      live.emplace_back(block);
+    }
+  }
+  heap->setGCLock(false);
+
+  auto begin = std::chrono::steady_clock::now();
+  heap->collectGarbage();
+  heap->gcStats();
+  auto pause = std::chrono::steady_clock::now() - begin;
+
+  auto reused = count - live.size();
+  uintptr_t sink = 0;
+  heap->setGCLock(true);
+  begin = std::chrono::steady_clock::now();
+  for (uintptr_t i = 0; i < reused; i++) {
+    auto block = reinterpret_cast<uintptr_t*>(heap->allocate(blockSize));
+    sink += block[blockSize / kWordSize - 1];
+  }
+  auto alloc = std::chrono::steady_clock::now() - begin;
+  heap->setGCLock(false);
+
+  printf("Sweep/%s/%lu\t%8.2f ms sweep\t%8.1f ns/alloc\t(%lu)\n", lazy ? "lazy" : "eager", blockSize,
+         std::chrono::duration<double, std::milli>(pause).count(),
+         std::chrono::duration<double, std::nano>(alloc).count() / reused, sink);
+  live.clear();
+  heap->collectGarbage();
+}
+
+}  // namespace
+
+int main() {
+  for (uintptr_t blockSize : {64, 512, 4096, 32768}) {
+    bench(blockSize, false);
+    bench(blockSize, true);
+  }
+  heap->setLazyZeroing(false);
+  return 0;
+}
@@ -0,0 +1,149 @@
+// Copyright Jay Conrod. All rights reserved.
+
+// This file is part of CodeSwitch. Use of this source code is governed by
+// the 3-clause BSD license that can be found in the LICENSE.txt file.
+
+#ifndef memory_workqueue_h
+#define memory_workqueue_h
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "common/common.h"
+
+namespace codeswitch {
+
+/**
+ * WorkStealingQueue is a Chase-Lev deque. One thread owns the queue and may
+ * push and pop elements at the bottom. Any thread may steal elements from
+ * the top.
+ *
+ * The memory orderings follow "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Lê et al., PPoPP 2013). When the queue grows, the old
+ * array is kept until the queue is destroyed, since a thief may still be
+ * reading from it.
+ *
+ * T must be trivially copyable and lock-free when atomic.
+ */
+template <class T>
+class WorkStealingQueue {
+ public:
+  NON_COPYABLE(WorkStealingQueue)
+  explicit WorkStealingQueue(size_t capacity = 1024);
+
+  /** Adds an element to the bottom of the queue. Only the owner may call. */
+  void push(T value);
+
+  /**
+   * Removes an element from the bottom of the queue. Only the owner may call.
+   * Returns false if the queue is empty.
+   */
+  bool pop(T* value);
+
+  /**
+   * Removes an element from the top of the queue. Any thread may call.
+   * Returns false if the queue is empty or if another thread took the
+   * element first.
+   */
+  bool steal(T* value);
+
+  /** Returns whether the queue appears to be empty. */
+  bool empty() const;
+
+ private:
+  class Array {
+   public:
+    explicit Array(size_t capacity) : capacity_(capacity), elements_(new std::atomic<T>[capacity]) {}
+    size_t capacity() const { return capacity_; }
+    T get(int64_t i) const { return elements_[i & (capacity_ - 1)].load(std::memory_order_relaxed); }
+    void put(int64_t i, T v) { elements_[i & (capacity_ - 1)].store(v, std::memory_order_relaxed); }
+
+   private:
+    size_t capacity_;
+    std::unique_ptr<std::atomic<T>[]> elements_;
+  };
+
+  Array* grow(Array* array, int64_t top, int64_t bottom);
+
+  std::atomic<int64_t> top_{0};
+  std::atomic<int64_t> bottom_{0};
+  std::atomic<Array*> array_;
+  std::vector<std::unique_ptr<Array>> arrays_;
+};
+
+template <class T>
+WorkStealingQueue<T>::WorkStealingQueue(size_t capacity) {
+  ASSERT(isPowerOf2(capacity));
+  arrays_.emplace_back(new Array(capacity));
+  array_.store(arrays_.back().get(), std::memory_order_relaxed);
+}
+
+template <class T>
+void WorkStealingQueue<T>::push(T value) {
+  auto b = bottom_.load(std::memory_order_relaxed);
+  auto t = top_.load(std::memory_order_acquire);
+  auto a = array_.load(std::memory_order_relaxed);
+  if (b - t > static_cast<int64_t>(a->capacity()) - 1) {
+    a = grow(a, t, b);
+  }
+  a->put(b, value);
+  std::atomic_thread_fence(std::memory_order_release);
+  bottom_.store(b + 1, std::memory_order_relaxed);
+}
+
+template <class T>
+bool WorkStealingQueue<T>::pop(T* value) {
+  auto b = bottom_.load(std::memory_order_relaxed) - 1;
+  auto a = array_.load(std::memory_order_relaxed);
+  bottom_.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto t = top_.load(std::memory_order_relaxed);
+  if (t > b) {
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return false;
+  }
+  *value = a->get(b);
+  if (t < b) {
+    return true;
+  }
+
+  // This is the last element. Race with thieves for it.
+  auto won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+  bottom_.store(b + 1, std::memory_order_relaxed);
+  return won;
+}
+
+template <class T>
+bool WorkStealingQueue<T>::steal(T* value) {
+  auto t = top_.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto b = bottom_.load(std::memory_order_acquire);
+  if (t >= b) {
+    return false;
+  }
+  auto a = array_.load(std::memory_order_acquire);
+  *value = a->get(t);
+  return top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+template <class T>
+bool WorkStealingQueue<T>::empty() const {
+  auto b = bottom_.load(std::memory_order_relaxed);
+  auto t = top_.load(std::memory_order_relaxed);
+  return t >= b;
+}
+
+template <class T>
+typename WorkStealingQueue<T>::Array* WorkStealingQueue<T>::grow(Array* array, int64_t top, int64_t bottom) {
+  auto newArray = new Array(array->capacity() * 2);
+  for (auto i = top; i < bottom; i++) {
+    newArray->put(i, array->get(i));
+  }
+  arrays_.emplace_back(newArray);
+  array_.store(newArray, std::memory_order_release);
+  return newArray;
+}
+
+}  // namespace codeswitch
+
+#endif
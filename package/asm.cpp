@@ -616,7 +616,7 @@ Handle<Function> PackageBuilder::buildFunction(const AsmFunction& function) {
     }
   }
 
-  auto fn = handle(new(heap->allocate(sizeof(Function))) Function);
+  auto fn = handle(new(heap->allocate(sizeof(Function), layoutOf<Function>())) Function);
   fn->name = **name;
   fn->paramTypes = **paramTypes;
   fn->returnTypes = **returnTypes;
@@ -7,6 +7,7 @@
 #define package_asm_h
 
 #include <cstdint>
+#include <deque>
 #include <filesystem>
 #include <string>
 #include "data/array.h"
@@ -62,6 +62,30 @@ TEST(SerializeDeserialize) {
   }
 }
 
+// For each .csws file in testdata, assemble the file, write a heap image
+// of it, then load the image. The loaded package's blocks are copies at
+// new addresses, so this checks that pointers between them are relocated.
+TEST(WriteReadImage) {
+  filesystem::path path("package/testdata");
+  for (filesystem::directory_iterator it(path); it != filesystem::directory_iterator(); it++) {
+    auto filename = it->path();
+    if (filename.extension() != ".csws") {
+      continue;
+    }
+    std::ifstream file(filename);
+    auto package1 = readPackageAsm(filename, file);
+    package1->validate();
+    TempFile tmp(filename.stem().string() + "-*.cswimg");
+    package1->writeImage(tmp.filename);
+    ASSERT_TRUE(Package::isImageFile(tmp.filename));
+    auto package2 = Package::readFromImage(tmp.filename);
+    ASSERT_TRUE(*package2 != *package1);
+    package2->validate();
+    checkPackagesEqual(t, package1, package2);
+    heap->validate();
+  }
+}
+
 void checkPackagesEqual(Test& t, Handle<Package>& p1, Handle<Package>& p2) {
   ASSERT_EQ(p1->functionCount(), p2->functionCount());
   for (size_t i = 0, n = p1->functionCount(); i < n; i++) {
@@ -617,7 +617,7 @@ void SafepointBuilder::setPointer(uint16_t slot) {
 }
 
 Handle<Safepoints> SafepointBuilder::build(uint16_t frameSize) {
-  auto safepoints = handle(new (heap->allocate(sizeof(Safepoints))) Safepoints);
+  auto safepoints = handle(new (heap->allocate(sizeof(Safepoints), layoutOf<Safepoints>())) Safepoints);
   build(frameSize, safepoints);
   return safepoints;
 }
@@ -628,7 +628,7 @@ void SafepointBuilder::build(uint16_t frameSize, Handle<Safepoints>& safepoints)
   });
   auto bytesPerEntry = sizeof(uint32_t) + align(align(frameSize, 8) / 8, sizeof(uint32_t));
   auto size = entries_.size() * bytesPerEntry;
-  auto data = handle(new(heap->allocate(sizeof(BoundArray<uint8_t>))) BoundArray<uint8_t>());
+  auto data = handle(new(heap->allocate(sizeof(BoundArray<uint8_t>), layoutOf<BoundArray<uint8_t>>())) BoundArray<uint8_t>());
   data->init(Array<uint8_t>::make(size), size);
 
   // TODO: check little-endian or support big-endian.
@@ -11,6 +11,7 @@
 #include "inst.h"
 #include "memory/handle.h"
 #include "memory/heap.h"
+#include "memory/layout.h"
 #include "memory/ptr.h"
 #include "type.h"
 
@@ -61,6 +62,8 @@ class Safepoints {
   bool operator == (const Safepoints& that) const;
   bool operator != (const Safepoints& that) const { return !(*this == that); }
 
+  static uintptr_t pointerMask() { return memberPointerMask(&Safepoints::data_); }
+
  private:
   struct Entry {
     uint32_t instOffset;
@@ -97,7 +100,14 @@ class Function {
       name(name), paramTypes(paramTypes), returnTypes(returnTypes), insts(insts), safepoints(safepoints) {}
   static Function* make(const String& name, List<Ptr<Type>>& paramTypes, List<Ptr<Type>>& returnTypes,
                         List<Inst>& insts, const Safepoints& safepoints) {
-    return new (heap->allocate(sizeof(Function))) Function(name, paramTypes, returnTypes, insts, safepoints);
+    return new (heap->allocate(sizeof(Function), layoutOf<Function>()))
+        Function(name, paramTypes, returnTypes, insts, safepoints);
+  }
+
+  static uintptr_t pointerMask() {
+    return memberPointerMask(&Function::name) | memberPointerMask(&Function::paramTypes) |
+           memberPointerMask(&Function::returnTypes) | memberPointerMask(&Function::insts) |
+           memberPointerMask(&Function::safepoints);
   }
 
   Handle<Safepoints> buildSafepoints(Handle<Package>& package);
@@ -87,6 +87,8 @@ class Inst {
   inline bool mayAllocate() const;
   const Inst* next() const { return const_cast<Inst*>(this)->next(); }
   Inst* next() { return this + size(); }
+
+  static uintptr_t pointerMask() { return 0; }
 };
 
 static_assert(sizeof(Inst) == 1);
@@ -7,11 +7,14 @@
 
 #include <array>
 #include <filesystem>
+#include <fstream>
 #include "common/common.h"
 #include "common/file.h"
 #include "common/str.h"
 #include "memory/handle.h"
+#include "memory/heapimage.h"
 #include "platform/platform.h"
+#include "roots.h"
 #include "type.h"
 
 #include <iostream>
@@ -103,7 +106,7 @@ Handle<Package> Package::readFromFile(const filesystem::path& filename) {
     throw FileError(filename, "unexpected space at end of file");
   }
 
-  auto package = handle(new (heap->allocate(sizeof(Package)))
+  auto package = handle(new (heap->allocate(sizeof(Package), layoutOf<Package>()))
                             Package(std::move(file), functionSection, typeSection, stringSection));
   package->functions_.resize(functionSection.entryCount);
   package->types_.resize(typeSection.entryCount);
@@ -243,6 +246,71 @@ void Package::writeToFile(const filesystem::path& filename) {
   p = std::copy(stringData.begin(), stringData.end(), p);
 }
 
+void Package::writeImage(const filesystem::path& filename) {
+  std::lock_guard lock(mu_);
+  populateLocked();
+  indexFunctionsByNameLocked();
+  std::ofstream file(filename, std::ios::binary);
+  if (!file) {
+    throw FileError(filename, "could not create file");
+  }
+  std::vector<uintptr_t> imageRoots{reinterpret_cast<uintptr_t>(this), reinterpret_cast<uintptr_t>(roots->unitType),
+                                    reinterpret_cast<uintptr_t>(roots->boolType),
+                                    reinterpret_cast<uintptr_t>(roots->int64Type)};
+  heap->writeImage(file, imageRoots);
+  if (!file) {
+    throw FileError(filename, "could not write heap image");
+  }
+}
+
+Handle<Package> Package::readFromImage(const filesystem::path& filename) {
+  MappedFile file(filename, MappedFile::READ);
+  HeapImage image;
+  try {
+    image = readHeapImage(file.data, file.size);
+  } catch (const Error& err) {
+    throw FileError(filename, err.what());
+  }
+  if (image.roots.size() != 4) {
+    throw FileError(filename, "heap image doesn't hold a package");
+  }
+
+  // Nothing may be collected until the image's blocks are referenced by
+  // a handle and Roots.
+  heap->setGCLock(true);
+  std::vector<uintptr_t> imageRoots;
+  try {
+    imageRoots = heap->loadImage(image);
+  } catch (const Error& err) {
+    heap->setGCLock(false);
+    throw FileError(filename, err.what());
+  }
+  if (imageRoots[0] == 0 || Heap::blockSize(imageRoots[0]) != align(sizeof(Package), kBlockAlignment)) {
+    heap->setGCLock(false);
+    throw FileError(filename, "heap image doesn't hold a package");
+  }
+  auto package = handle(reinterpret_cast<Package*>(imageRoots[0]));
+  roots->unitType = reinterpret_cast<Type*>(imageRoots[1]);
+  roots->boolType = reinterpret_cast<Type*>(imageRoots[2]);
+  roots->int64Type = reinterpret_cast<Type*>(imageRoots[3]);
+  heap->setGCLock(false);
+
+  // Members that aren't on the heap were copied from the process that
+  // wrote the image and mean nothing here. Every function is already
+  // loaded, so the package file isn't needed.
+  new (&package->mu_) std::mutex;
+  new (&package->filename_) filesystem::path(filename);
+  new (&package->file_) MappedFile;
+  return package;
+}
+
+bool Package::isImageFile(const filesystem::path& filename) {
+  std::ifstream file(filename, std::ios::binary);
+  char magic[sizeof(kHeapImageMagic) - 1];
+  return file.read(magic, sizeof(magic)) &&
+         isHeapImage(reinterpret_cast<const uint8_t*>(magic), sizeof(magic));
+}
+
 /**
  * Checks that a package in memory satisfies all invariants expected.
  * validate completely loads the package from a binary file (if there is one),
@@ -273,7 +341,7 @@ Function* Package::functionByIndexLocked(size_t index) {
   FunctionEntry entry;
   readFunctionEntry(&p, &entry);
 
-  auto function = new (heap->allocate(sizeof(Function))) Function;
+  auto function = new (heap->allocate(sizeof(Function), layoutOf<Function>())) Function;
   functions_[index] = function;
   function->name = stringByIndexLocked(entry.nameIndex);
   readTypeList(&function->paramTypes, entry.paramTypeCount, entry.paramTypeOffset);
@@ -299,7 +367,7 @@ Function* Package::functionByIndexLocked(size_t index) {
   if (safepointsEnd > functionSectionEnd) {
     throw errorstr(filename_, ": for function ", index, ", end of safepoints outside function section");
   }
-  auto safepointsData = handle(new (heap->allocate(sizeof(BoundArray<uint8_t>))) BoundArray<uint8_t>);
+  auto safepointsData = handle(new (heap->allocate(sizeof(BoundArray<uint8_t>), layoutOf<BoundArray<uint8_t>>())) BoundArray<uint8_t>);
   safepointsData->init(Array<uint8_t>::make(safepointsSize), safepointsSize);
   std::copy(safepointsBegin, safepointsEnd, safepointsData->begin());
   function->safepoints.init(entry.frameSize, **safepointsData);
@@ -308,15 +376,18 @@ Function* Package::functionByIndexLocked(size_t index) {
 }
 
 Function* Package::functionByNameLocked(const String& name) {
+  indexFunctionsByNameLocked();
+  return functionsByName_.get(name).get();
+}
+
+void Package::indexFunctionsByNameLocked() {
   if (functions_.empty() || !functionsByName_.empty()) {
-    return functionsByName_.get(name).get();
+    return;
   }
-
   for (size_t i = 0, n = functions_.length(); i < n; i++) {
-    auto function = functionByIndex(i);
+    auto function = functionByIndexLocked(i);
     functionsByName_.set(function->name, function);
   }
-  return functionsByName_.get(name).get();
 }
 
 String& Package::stringByIndexLocked(size_t index) {
@@ -13,6 +13,7 @@
 #include "function.h"
 #include "memory/handle.h"
 #include "memory/heap.h"
+#include "memory/layout.h"
 #include "memory/ptr.h"
 #include "platform/platform.h"
 
@@ -100,7 +101,12 @@ class Package {
  public:
   explicit Package(List<Ptr<Function>>& functions) : functions_(functions) {}
   static Package* make(List<Ptr<Function>>& functions) {
-    return new (heap->allocate(sizeof(Package))) Package(functions);
+    return new (heap->allocate(sizeof(Package), layoutOf<Package>())) Package(functions);
+  }
+
+  static uintptr_t pointerMask() {
+    return memberPointerMask(&Package::functions_) | memberPointerMask(&Package::types_) |
+           memberPointerMask(&Package::strings_) | memberPointerMask(&Package::functionsByName_);
   }
 
   size_t functionCount() const { return functions_.length(); }
@@ -110,6 +116,23 @@ class Package {
   static Handle<Package> readFromFile(const std::filesystem::path& filename);
   void writeToFile(const std::filesystem::path& filename);
 
+  /**
+   * Writes a heap image (see heapimage.h) holding this package with all its
+   * functions loaded, along with the types in Roots. Loading the image
+   * with readFromImage skips parsing and materializing functions, so the
+   * package is ready to run as soon as it's copied onto the heap.
+   */
+  void writeImage(const std::filesystem::path& filename);
+
+  /**
+   * Loads a package from an image written by writeImage. The types in
+   * Roots are replaced by the image's copies.
+   */
+  static Handle<Package> readFromImage(const std::filesystem::path& filename);
+
+  /** Returns whether filename is a heap image rather than a package file. */
+  static bool isImageFile(const std::filesystem::path& filename);
+
   void validate();
 
  private:
@@ -121,6 +144,7 @@ class Package {
 
   Function* functionByIndexLocked(size_t index);
   Function* functionByNameLocked(const String& name);
+  void indexFunctionsByNameLocked();
   String& stringByIndexLocked(size_t index);
   void readTypeList(List<Ptr<Type>>* types, uint32_t count, uint64_t offset);
   Type* readType(uint8_t** p, uint8_t* end);
@@ -5,6 +5,8 @@
 
 #include "roots.h"
 
+#include "function.h"
+#include "memory/allocprofile.h"
 #include "memory/handle.h"
 #include "memory/heap.h"
 #include "memory/stack.h"
@@ -26,6 +28,7 @@ __attribute__((constructor)) void init() {
   handleStorage = new HandleStorage;
   stackPool = new StackPool;
   roots = new Roots;
+  functionNameForProfile = [](Function* fn) { return fn->name.str(); };
 }
 
 Roots::Roots() {
@@ -33,14 +36,14 @@ Roots::Roots() {
   unitType = Type::make(Type::UNIT);
   boolType = Type::make(Type::BOOL);
   int64Type = Type::make(Type::INT64);
-  heap->registerRoots(std::bind(&Roots::accept, this, std::placeholders::_1));
+  heap->registerRoots(this, "Roots");
   heap->setGCLock(false);
 }
 
-void Roots::accept(std::function<void(uintptr_t)> visit) {
-  visit(reinterpret_cast<uintptr_t>(unitType));
-  visit(reinterpret_cast<uintptr_t>(boolType));
-  visit(reinterpret_cast<uintptr_t>(int64Type));
+void Roots::appendRootSpans(std::vector<RootSpan>* spans) {
+  auto begin = reinterpret_cast<const uintptr_t*>(&unitType);
+  auto end = reinterpret_cast<const uintptr_t*>(&int64Type + 1);
+  spans->push_back(RootSpan{begin, static_cast<uintptr_t>(end - begin)});
 }
 
 }  // namespace codeswitch
@@ -6,19 +6,24 @@
 #ifndef package_roots_h
 #define package_roots_h
 
-#include <functional>
+#include <vector>
 #include "common/common.h"
+#include "memory/rootset.h"
 
 namespace codeswitch {
 
 class Type;
 
-class Roots {
+/**
+ * Roots holds blocks used throughout the VM. Its fields are scanned as one
+ * RootSpan, so they must all be pointers, declared together.
+ */
+class Roots : public RootSet {
  public:
   Roots();
   NON_COPYABLE(Roots)
 
-  void accept(std::function<void(uintptr_t)> visit);
+  void appendRootSpans(std::vector<RootSpan>* spans) override;
 
   Type* unitType = nullptr;
   Type* boolType = nullptr;
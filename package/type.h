@@ -9,6 +9,7 @@
 #include <iostream>
 #include "common/common.h"
 #include "memory/heap.h"
+#include "memory/layout.h"
 
 namespace codeswitch {
 
@@ -22,7 +23,7 @@ class Type {
 
   Type() = default;
   explicit Type(Kind kind) : kind_(kind) {}
-  static Type* make(Kind kind) { return new (heap->allocate(sizeof(Type))) Type(kind); }
+  static Type* make(Kind kind) { return new (heap->allocate(sizeof(Type), layoutOf<Type>())) Type(kind); }
 
   Kind kind() const { return kind_; }
   uintptr_t size() const;
@@ -31,6 +32,8 @@ class Type {
   bool operator!=(const Type& other) const { return !(*this == other); }
   uintptr_t hash() const;
 
+  static uintptr_t pointerMask() { return 0; }
+
  private:
   friend std::ostream& operator<<(std::ostream&, const Type&);
   Kind kind_ = Kind::UNIT;
@@ -9,6 +9,7 @@
 #include <cstring>
 #include <filesystem>
 #include <stdexcept>
+#include <string>
 #include "common/common.h"
 
 namespace codeswitch {
@@ -25,9 +26,79 @@ class SystemAllocationError : public std::exception {
 /** Allocates a region of memory from the kernel with the given size and * alignment. */
 void* allocateChunk(size_t size, size_t alignment);
 
+/** Size and alignment of huge pages used by {@code commitHugeMemory}. */
+const size_t kHugePageSize = 2 * MB;
+
+/**
+ * Size of ordinary pages. Ranges passed to {@code releaseChunk} are aligned
+ * to this. If the system's pages are larger, releasing misaligned ranges
+ * fails harmlessly.
+ */
+const size_t kPageSize = 4 * KB;
+
+/**
+ * Reserves a range of address space with the given size and alignment
+ * without backing it with memory. Nothing in the range may be accessed
+ * until it's committed with {@code commitMemory} or
+ * {@code commitHugeMemory}. The range is freed with {@code freeChunk}.
+ */
+void* reserveMemory(size_t size, size_t alignment);
+
+/** Makes part of a reserved range readable and writable. It reads as zero. */
+void commitMemory(void* addr, size_t size);
+
+/**
+ * Like {@code commitMemory}, but backs the range with huge pages if the
+ * kernel allows it. addr and size must be multiples of kHugePageSize.
+ *
+ * Explicit huge pages (MAP_HUGETLB) are tried first. If none are available,
+ * the kernel is asked to back the range with transparent huge pages
+ * (MADV_HUGEPAGE). If that's refused too, the range is backed by ordinary
+ * pages. *hugetlb is set to whether explicit huge pages were used. Parts of
+ * such ranges can't be decommitted or released separately.
+ */
+void commitHugeMemory(void* addr, size_t size, bool* hugetlb);
+
+/**
+ * Returns part of a reserved range to the kernel. It can't be accessed
+ * until it's committed again.
+ */
+void decommitMemory(void* addr, size_t size);
+
+/** Faults in the pages of a committed range so the first accesses are fast. */
+void prefaultMemory(void* addr, size_t size);
+
 /** Frees a region allocated with {@code allocateChunk}. */
 void freeChunk(void* addr, size_t size);
 
+/**
+ * Tells the kernel the pages in a region allocated with {@code allocateChunk}
+ * aren't needed. The region stays mapped, but its physical pages may be
+ * reclaimed. If this returns true, the next access reads zeroes. Otherwise,
+ * the region is unchanged.
+ */
+bool releaseChunk(void* addr, size_t size);
+
+/**
+ * Returns the number of bytes of physical memory currently used by the
+ * process (its resident set size), or 0 if that isn't known.
+ */
+size_t residentMemorySize();
+
+/**
+ * Returns the memory limit in bytes of the cgroup containing the process
+ * (memory.max in cgroup v2), or 0 if there's no limit or it isn't known.
+ * Limits of ancestor cgroups apply too, so the lowest one is returned.
+ */
+size_t cgroupMemoryLimit();
+
+/**
+ * Returns the memory mappings of the process in the format of
+ * /proc/self/maps, so profiles with native addresses can be symbolized
+ * later. Returns an empty string if that isn't supported.
+ */
+std::string memoryMappings();
+
 class MappedFile {
  public:
   enum Perm {
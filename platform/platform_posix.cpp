@@ -10,7 +10,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <cerrno>
+#include <cstdio>
 #include <cstdlib>
+#include <string>
 #include "common/file.h"
 
 namespace filesystem = std::filesystem;
@@ -38,10 +40,172 @@ void* allocateChunk(size_t size, size_t alignment) {
   return reinterpret_cast<void*>(chunk);
 }
 
+void* reserveMemory(size_t size, size_t alignment) {
+  // Same as allocateChunk, but without access or swap space.
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif
+  void* basePtr = mmap(nullptr, size + alignment, PROT_NONE, flags, -1, 0);
+  if (basePtr == MAP_FAILED) {
+    throw SystemAllocationError{errno};
+  }
+  auto base = reinterpret_cast<uintptr_t>(basePtr);
+  auto end = base + size + alignment;
+  auto begin = align(base, alignment);
+  if (begin > base) {
+    munmap(basePtr, begin - base);
+  }
+  if (begin + size < end) {
+    munmap(reinterpret_cast<void*>(begin + size), end - (begin + size));
+  }
+  return reinterpret_cast<void*>(begin);
+}
+
+void commitMemory(void* addr, size_t size) {
+  if (mprotect(addr, size, PROT_READ | PROT_WRITE) != 0) {
+    throw SystemAllocationError{errno};
+  }
+}
+
+void commitHugeMemory(void* addr, size_t size, bool* hugetlb) {
+  ASSERT(reinterpret_cast<uintptr_t>(addr) % kHugePageSize == 0 && size % kHugePageSize == 0);
+#ifdef MAP_HUGETLB
+  // Explicit huge pages must be reserved by the administrator, so this
+  // usually fails.
+  auto huge =
+      mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+  if (huge != MAP_FAILED) {
+    *hugetlb = true;
+    return;
+  }
+#endif
+
+  // A failed MAP_FIXED mapping may have already unmapped the range, so map
+  // it again rather than changing its protection.
+  *hugetlb = false;
+  if (mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    throw SystemAllocationError{errno};
+  }
+#ifdef MADV_HUGEPAGE
+  // This fails if transparent huge pages are disabled. That's fine.
+  madvise(addr, size, MADV_HUGEPAGE);
+#endif
+}
+
+void decommitMemory(void* addr, size_t size) {
+  // Mapping fresh inaccessible pages over the range frees the old pages
+  // and gives back the swap space they were charged for.
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif
+  mmap(addr, size, PROT_NONE, flags, -1, 0);
+}
+
+void prefaultMemory(void* addr, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(addr, size, MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+#endif
+  // Older kernels don't support MADV_POPULATE_WRITE. Touch each page
+  // instead. The range is zero, so this doesn't change anything.
+  auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  auto p = reinterpret_cast<volatile uint8_t*>(addr);
+  for (size_t offset = 0; offset < size; offset += pageSize) {
+    p[offset] = 0;
+  }
+}
+
 void freeChunk(void* addr, size_t size) {
   munmap(addr, size);
 }
 
+bool releaseChunk(void* addr, size_t size) {
+#ifdef __linux__
+  // On Linux, private anonymous pages read as zero after MADV_DONTNEED.
+  return madvise(addr, size, MADV_DONTNEED) == 0;
+#else
+  // Elsewhere, MADV_DONTNEED may keep the old contents, so map fresh pages
+  // over the region instead.
+  return mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED;
+#endif
+}
+
+size_t residentMemorySize() {
+  // Linux reports this in /proc. Other systems aren't supported yet.
+  auto f = fopen("/proc/self/statm", "r");
+  if (f == nullptr) {
+    return 0;
+  }
+  unsigned long size, resident;
+  auto n = fscanf(f, "%lu %lu", &size, &resident);
+  fclose(f);
+  if (n != 2) {
+    return 0;
+  }
+  return static_cast<size_t>(resident) * sysconf(_SC_PAGESIZE);
+}
+
+size_t cgroupMemoryLimit() {
+  // With cgroup v2, /proc/self/cgroup has a single line, "0::<path>".
+  // Other systems and cgroup v1 aren't supported.
+  auto f = fopen("/proc/self/cgroup", "r");
+  if (f == nullptr) {
+    return 0;
+  }
+  char line[4096];
+  std::string path;
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    if (strncmp(line, "0::", 3) == 0) {
+      path = line + 3;
+      path.erase(path.find_last_not_of('\n') + 1);
+      break;
+    }
+  }
+  fclose(f);
+  if (path.empty()) {
+    return 0;
+  }
+
+  // Check the cgroup and each of its ancestors. In a container with its
+  // own cgroup namespace, the path is "/", but the root of the namespace
+  // may still have a limit. A limit of "max" doesn't parse and is skipped.
+  size_t limit = 0;
+  for (filesystem::path dir = path; !dir.empty(); dir = dir.parent_path()) {
+    auto maxPath = filesystem::path("/sys/fs/cgroup") / dir.relative_path() / "memory.max";
+    auto f = fopen(maxPath.c_str(), "r");
+    if (f != nullptr) {
+      unsigned long value;
+      if (fscanf(f, "%lu", &value) == 1 && (limit == 0 || value < limit)) {
+        limit = static_cast<size_t>(value);
+      }
+      fclose(f);
+    }
+    if (dir == dir.root_path()) {
+      break;
+    }
+  }
+  return limit;
+}
+
+std::string memoryMappings() {
+  // Linux reports this in /proc. Other systems aren't supported yet.
+  auto f = fopen("/proc/self/maps", "r");
+  if (f == nullptr) {
+    return "";
+  }
+  std::string maps;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    maps.append(buf, n);
+  }
+  fclose(f);
+  return maps;
+}
+
 MappedFile::MappedFile(const filesystem::path& filename, MappedFile::Perm perm) {
   auto openFlags = O_RDONLY;
   if (perm & Perm::WRITE) {